@@ -119,14 +119,35 @@ paddr_t ram_getfirstfree(void);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+/*
+ * ASID values as handed out by vm.c: the low bits are the hardware
+ * ASID (NUM_TLBPID of them) and the rest a generation number.
+ */
+#define ASID_MASK		0x3f
+#define ASID_FIRST_VERSION	0x40
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;	/* whose translation */
+	vaddr_t ts_vaddr;		/* page to drop from the TLB */
 };
 
 #define TLBSHOOTDOWN_MAX 16
 
+/*
+ * Per-cpu state for the UTLB refill handler, in vm_refill[] indexed
+ * by cpu number the way cpustacks[] is. mips_utlb_handler (see
+ * exception-mips1.S) hardcodes this layout: keep the two in step.
+ * vr_pt is never NULL; it points at an empty table when there's no
+ * address space to refill from.
+ */
+struct pagetable;
+
+struct vm_refill {
+	struct pagetable *vr_pt;	/* page table of current address space */
+	unsigned vr_nrefill;		/* UTLB misses taken */
+	unsigned vr_nslow;		/* of those, passed on to vm_fault */
+	unsigned vr_unused;		/* pad to 16 bytes */
+};
+
 
 #endif /* _MIPS_VM_H_ */
@@ -85,6 +85,8 @@ syscall(struct trapframe *tf)
 	int32_t retval;
 	int32_t retval2;
     int whence;
+    int fd;
+    off_t offset;
 	int err = 0;
 
 	KASSERT(curthread != NULL);
@@ -176,6 +178,65 @@ syscall(struct trapframe *tf)
 		err = sys_sbrk((intptr_t) tf->tf_a0, (void *) &retval);
 		break;
 
+		case SYS_mmap:
+		/* fd and the 64-bit offset come from the stack at sp+16 and sp+24 */
+		err = copyin((const_userptr_t) tf->tf_sp+16, &fd, sizeof(int));
+		if (!err) {
+			err = copyin((const_userptr_t) tf->tf_sp+24, &offset, sizeof(off_t));
+		}
+		if (!err) {
+			err = sys_mmap((void *)tf->tf_a0, (size_t)tf->tf_a1, (int)tf->tf_a2,
+				       (int)tf->tf_a3, fd, offset, &retval);
+		}
+		break;
+
+		case SYS_munmap:
+		err = sys_munmap((void *)tf->tf_a0, (size_t)tf->tf_a1);
+		break;
+
+		case SYS_madvise:
+		err = sys_madvise((void *)tf->tf_a0, (size_t)tf->tf_a1, (int)tf->tf_a2);
+		break;
+
+		case SYS_mincore:
+		err = sys_mincore((void *)tf->tf_a0, (size_t)tf->tf_a1,
+				  (unsigned char *)tf->tf_a2);
+		break;
+
+		case SYS_mlock:
+		err = sys_mlock((const void *)tf->tf_a0, (size_t)tf->tf_a1);
+		break;
+
+		case SYS_munlock:
+		err = sys_munlock((const void *)tf->tf_a0, (size_t)tf->tf_a1);
+		break;
+
+		case SYS_munlockall:
+		err = sys_munlockall();
+		break;
+
+		case SYS_sync:
+		err = sys_sync();
+		break;
+
+		case SYS_shm_attach:
+		err = sys_shm_attach((const char *)tf->tf_a0, (size_t)tf->tf_a1,
+				     (int)tf->tf_a2, &retval);
+		break;
+
+		case SYS_shm_unlink:
+		err = sys_shm_unlink((const char *)tf->tf_a0);
+		break;
+
+		case SYS_getrlimit:
+		err = sys_getrlimit((int)tf->tf_a0, (struct rlimit *)tf->tf_a1);
+		break;
+
+		case SYS_setrlimit:
+		err = sys_setrlimit((int)tf->tf_a0,
+				    (const struct rlimit *)tf->tf_a1);
+		break;
+
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
 		err = ENOSYS;
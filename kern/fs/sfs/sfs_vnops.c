@@ -231,14 +231,21 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). The VM system pages mapped files through
+ * sfs_read and sfs_write, so any range of a regular file will do.
+ * (Directories have their own vop_mmap that refuses.)
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v, off_t offset, size_t len)
 {
 	(void)v;
-	return ENOSYS;
+	(void)len;
+
+	if (offset < 0) {
+		return EINVAL;
+	}
+	return 0;
 }
 
 /*
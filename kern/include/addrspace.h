@@ -36,11 +36,25 @@
 
 
 #include <vm.h>
+#include <platform/maxcpus.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct lock;
+struct pagetable;
+struct memobj;
 
 
+/*
+ * A range of pages locked in memory with mlock. An address space
+ * keeps them sorted, with no two overlapping or touching.
+ */
+struct lockrange {
+        vaddr_t lr_start;               /* first page */
+        vaddr_t lr_end;                 /* page after the last */
+        struct lockrange *lr_next;      /* next higher range */
+};
+
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -61,8 +75,23 @@ struct addrspace {
         vaddr_t stack_end;              /* grows down */
         vaddr_t heap_base;              /* starts low */
         vaddr_t heap_end;               /* grows up */
-        struct page_table *ptable;  /* first page in page table */
-        struct region *first_region;    /* first region */
+        struct pagetable *ptable;       /* two-level page table */
+        struct region *first_region;    /* lowest region */
+        struct region *region_root;     /* AVL tree of the regions */
+        struct region *last_region;     /* last as_find_region hit */
+        struct lock *lock;              /* protects regions and ptable */
+        bool loading;                   /* between prepare/complete_load */
+        struct fault_history heap_history; /* fault-around in the heap */
+        unsigned rss;                   /* frames it owns (coremap lock) */
+        vaddr_t rss_clock;              /* clock hand for its own pages */
+        unsigned ws_size;               /* working set, in pages */
+        unsigned ws_seq;                /* creation order (load control) */
+        unsigned ws_samples;            /* samples since (re)activated */
+        bool ws_suspended;              /* swapped out by load control */
+        struct addrspace *ws_next;      /* load control's list */
+        struct lockrange *locked;       /* mlocked ranges */
+        unsigned locked_pages;          /* pages in them */
+        uint32_t as_asid[MAXCPUS];      /* ASID on each cpu, or 0 */
 #endif
 };
 
@@ -103,6 +132,45 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_define_backing - back FILESIZE bytes of the region containing
+ *                VADDR, starting at VADDR, with file V at OFFSET. The
+ *                pages are read in on first touch; the rest of the
+ *                region is zero-fill.
+ *
+ *    as_define_image - have the read-only region containing VADDR take
+ *                its frames from segment SEG of the cached program
+ *                image IM (see imagecache.h).
+ *
+ *    as_find_region - return the region containing VADDR, or NULL.
+ *                Caller must hold the address space lock.
+ *
+ *    as_mmap   - map LEN bytes with PROT_* and MAP_* flags as for
+ *                mmap(2): of memory object OBJECT (see memobj.h) if
+ *                MAP_SHARED, else of file VN, or zero-fill memory if
+ *                VN is NULL; either from OFFSET. Returns the address
+ *                in *RET.
+ *
+ *    as_munmap - remove the mmap mappings in [VADDR, VADDR+LEN),
+ *                writing back dirty shared pages first.
+ *
+ *    as_sbrk   - move the end of the heap by AMOUNT bytes. Returns the
+ *                old end in *RET.
+ *
+ *    as_madvise - apply MADV_* ADVICE to [VADDR, VADDR+LEN).
+ *
+ *    as_mincore - report which pages of [VADDR, VADDR+LEN) are in
+ *                memory, a byte each, in the user buffer VEC.
+ *
+ *    as_mlock  - lock the pages in [VADDR, VADDR+LEN) in memory,
+ *                faulting them all in now. AS must be curproc's.
+ *
+ *    as_munlock - unlock the pages in [VADDR, VADDR+LEN).
+ *
+ *    as_munlockall - unlock every page.
+ *
+ *    as_mlocked - whether VADDR is locked. Caller must hold the
+ *                address space lock.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -121,6 +189,26 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_define_backing(struct addrspace *as, vaddr_t vaddr,
+                                    struct vnode *v, off_t offset,
+                                    size_t filesize);
+int               as_define_image(struct addrspace *as, vaddr_t vaddr,
+                                  struct image *im, unsigned seg);
+struct region    *as_find_region(struct addrspace *as, vaddr_t vaddr);
+int               as_mmap(struct addrspace *as, vaddr_t vaddr, size_t len,
+                          int prot, int flags, struct vnode *vn,
+                          struct memobj *object, off_t offset,
+                          vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *ret);
+int               as_madvise(struct addrspace *as, vaddr_t vaddr, size_t len,
+                             int advice);
+int               as_mincore(struct addrspace *as, vaddr_t vaddr, size_t len,
+                             userptr_t vec);
+int               as_mlock(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_munlock(struct addrspace *as, vaddr_t vaddr, size_t len);
+void              as_munlockall(struct addrspace *as);
+bool              as_mlocked(struct addrspace *as, vaddr_t vaddr);
 
 
 /*
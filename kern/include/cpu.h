@@ -34,6 +34,7 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <vm.h>          /* for struct page_magazine */
 
 
 /*
@@ -61,6 +62,9 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	struct page_magazine c_pagemag;	/* Cache of free pages */
+	uint32_t c_asid_cache;		/* Last ASID handed out, with generation */
+	uint32_t c_asid;		/* ASID currently in entryhi */
 
 	/*
 	 * Accessed by other cpus.
@@ -83,10 +87,14 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * c_shootdown_gen counts batches of shootdowns handled; it is
+	 * read without the lock by cpus waiting for theirs to be done.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	volatile unsigned c_shootdown_gen;
 	struct spinlock c_ipi_lock;
 };
 
@@ -110,6 +118,15 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Access to the list of cpus, for subsystems that keep per-cpu state.
+ *
+ * cpu_count returns the number of cpus; cpu_get returns the cpu with
+ * the given software number.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned num);
+
 /*
  * Produce a string describing the CPU type.
  */
@@ -150,9 +167,17 @@ void cpu_halt(void);
  * has (or may have) a page mapped in the MMU and it is being changed
  * or otherwise needs to be invalidated across all CPUs.
  *
+ * When memory runs out, the VM system asks the other CPUs to give
+ * back the free pages cached in their page magazines.
+ *
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * It returns the target's c_shootdown_gen as of the request; the
+ * request has been carried out once that value changes.
+ * ipi_tlbshootdown_batch does the same for NUM mappings with one IPI;
+ * if they don't all fit, the target flushes its whole TLB instead.
+ * ipi_tlbshootdown_all asks the target to flush its whole TLB.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -163,10 +188,16 @@ void cpu_halt(void);
 #define IPI_OFFLINE		1	/* CPU is requested to go offline */
 #define IPI_UNIDLE		2	/* Runnable threads are available */
 #define IPI_TLBSHOOTDOWN	3	/* MMU mapping(s) need invalidation */
+#define IPI_PAGEMAG		4	/* Cached free pages are wanted */
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
-void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown(struct cpu *target,
+			  const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_batch(struct cpu *target,
+				const struct tlbshootdown *mappings,
+				unsigned num);
+unsigned ipi_tlbshootdown_all(struct cpu *target);
 
 void interprocessor_interrupt(void);
 
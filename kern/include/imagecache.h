@@ -0,0 +1,106 @@
+#ifndef _IMAGECACHE_H_
+#define _IMAGECACHE_H_
+
+/*
+ * Executable image cache.
+ *
+ * For each executable vnode, remembers the loadable segments load_elf
+ * found in its program headers, and the frames of its read-only
+ * segments (text and rodata). Every process running the binary maps
+ * those frames directly, shared and read-only (PTE_SHARED), so a
+ * repeated exec neither re-reads the headers nor makes its own copy
+ * of the text.
+ *
+ * An image is reference counted: one reference per region using it,
+ * plus one while it is in the cache. Images stay cached after their
+ * last process exits, up to IMAGE_CACHESIZE of them. Under memory
+ * pressure the VM system takes back cached frames that no process
+ * maps any more. Opening the file for writing, writing to it through
+ * a descriptor opened earlier, or writing back a shared mapping of it
+ * drops its image from the cache; processes still running it keep
+ * what they have.
+ */
+
+#include <vm.h>
+
+#define IMAGE_CACHESIZE	16	/* images kept with nobody running them */
+
+struct vnode;
+
+struct image_segment {
+	vaddr_t is_vaddr;		/* where it is loaded */
+	size_t is_memsize;		/* bytes in memory */
+	size_t is_filesize;		/* bytes from the file */
+	off_t is_offset;		/* where those are in the file */
+	int is_flags;			/* PF_R, PF_W, PF_X */
+	unsigned is_npages;		/* pages it spans */
+	paddr_t *is_frames;		/* shared frames (read-only only) */
+};
+
+struct image {
+	struct vnode *im_vn;		/* the executable */
+	vaddr_t im_entry;		/* entry point */
+	unsigned im_nsegs;		/* segments filled in so far */
+	struct image_segment *im_segs;	/* the PT_LOAD segments */
+	unsigned im_refcount;		/* users, plus one while cached */
+	bool im_cached;			/* on the cache list */
+	struct image *im_next;		/* cache list, most recent first */
+};
+
+/*
+ * Functions in imagecache.c:
+ *
+ *    image_bootstrap  - set up the cache.
+ *
+ *    image_create     - make an uncached image of VN with room for
+ *                       MAXSEGS segments and one reference.
+ *
+ *    image_addseg     - record a loadable segment. Returns ENOMEM.
+ *
+ *    image_insert     - cache *IMP. If another exec cached the same
+ *                       vnode first, *IMP is swapped for that image.
+ *
+ *    image_lookup     - return the cached image of VN with a new
+ *                       reference, or NULL.
+ *
+ *    image_incref     - add a reference.
+ *
+ *    image_decref     - drop a reference, freeing the image and its
+ *                       frames with the last one.
+ *
+ *    image_getpage    - return the shared frame for VADDR in segment
+ *                       SEG with a new reference, or 0 if there isn't
+ *                       one yet.
+ *
+ *    image_putpage    - offer the freshly filled frame *PADDR for VADDR
+ *                       in segment SEG. Returns true if the page is now
+ *                       shared; *PADDR may have been swapped for a frame
+ *                       someone else put first (ours is freed). Returns
+ *                       false if the image is no longer cached, and the
+ *                       frame stays private.
+ *
+ *    image_invalidate - drop VN's image from the cache, if it's there.
+ *
+ *    image_reclaim    - free some cached frames nobody maps. Returns
+ *                       false if there weren't any.
+ *
+ *    image_printstats - print cache statistics.
+ */
+
+void image_bootstrap(void);
+struct image *image_create(struct vnode *vn, vaddr_t entry, unsigned maxsegs);
+int image_addseg(struct image *im, vaddr_t vaddr, size_t memsize,
+		 size_t filesize, off_t offset, int flags);
+void image_insert(struct image **imp);
+struct image *image_lookup(struct vnode *vn);
+void image_incref(struct image *im);
+void image_decref(struct image *im);
+paddr_t image_getpage(struct image *im, unsigned seg, vaddr_t vaddr);
+bool image_putpage(struct image *im, unsigned seg, vaddr_t vaddr,
+		   paddr_t *paddr);
+void image_invalidate(struct vnode *vn);
+bool image_reclaim(void);
+void image_printstats(void);
+
+
+#endif /* _IMAGECACHE_H_ */
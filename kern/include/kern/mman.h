@@ -0,0 +1,33 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Definitions for mmap(), munmap(), madvise() and mincore().
+ */
+
+/* Protection: the PROT argument */
+#define PROT_NONE	0x0	/* no access */
+#define PROT_READ	0x1	/* readable */
+#define PROT_WRITE	0x2	/* writable */
+#define PROT_EXEC	0x4	/* executable */
+
+/* Mapping type and options: the FLAGS argument */
+#define MAP_SHARED	0x0001	/* changes go to the file/other mappers */
+#define MAP_PRIVATE	0x0002	/* changes are private copies */
+#define MAP_FIXED	0x0010	/* map exactly at ADDR */
+#define MAP_ANON	0x1000	/* no file; zero-filled */
+#define MAP_ANONYMOUS	MAP_ANON
+
+/* Advice: the ADVICE argument of madvise() */
+#define MADV_NORMAL	0	/* no special treatment */
+#define MADV_RANDOM	1	/* no point reading ahead */
+#define MADV_SEQUENTIAL	2	/* read well ahead, drop what's behind */
+#define MADV_WILLNEED	3	/* bring the pages in soon */
+#define MADV_DONTNEED	4	/* drop the pages now */
+#define MADV_FREE	5	/* contents may be discarded (anonymous only) */
+
+/* Returned by mmap() on failure */
+#define MAP_FAILED	((void *)-1)
+
+
+#endif /* _KERN_MMAN_H_ */
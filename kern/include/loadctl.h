@@ -0,0 +1,79 @@
+#ifndef _LOADCTL_H_
+#define _LOADCTL_H_
+
+/*
+ * Working sets and load control.
+ *
+ * Every LOADCTL_INTERVAL seconds the load controller samples each
+ * running process's page table. A resident private page referenced
+ * since the last sample (PTE_REF) has its age (PTE_AGE) reset and its
+ * reference bit cleared, with a shootdown so that the next use faults
+ * and sets it again; any other page ages by one. A process's working
+ * set is its pages referenced within the last LOADCTL_WINDOW samples.
+ * Shared frames (text, MAP_SHARED) are left out, as they are from the
+ * RSS: nobody is charged for them.
+ *
+ * When the working sets of the running processes add up to more
+ * memory than they could have (free pages plus the frames processes
+ * own, less the pageout daemon's reserve), paging would only take
+ * pages each of them is about to need again. The controller then
+ * suspends processes until the rest fit: it swaps out every frame a
+ * suspended process owns, and any fault it takes afterwards sleeps
+ * until it is reactivated. The scheduler has no priorities, so the
+ * process least worth keeping is taken to be the one started most
+ * recently, as in a batch system; one that has only just been let
+ * back in is left alone for LOADCTL_MINRUN samples so it can get
+ * something done.
+ *
+ * Suspended processes come back oldest first, whenever their working
+ * set (as it was when they were suspended) fits again, and in any
+ * case after LOADCTL_MAXSUSPEND samples, so none waits forever and a
+ * process suspended in the middle of a system call can't hold its
+ * locks for long.
+ *
+ * Nothing is suspended without swap, or to leave no process running.
+ *
+ * The pageout daemon also uses the list of address spaces to let go
+ * of MAP_SHARED file pages, which the clock can't take (see memobj.h):
+ * loadctl_trim_shared clears the reference bit of each such mapping
+ * that has one, and unmaps the rest, so that pages unused since the
+ * last call are left to their memory object alone.
+ */
+
+#include <vm.h>
+
+#define LOADCTL_INTERVAL	1	/* seconds between samples */
+#define LOADCTL_WINDOW		3	/* samples in a working set (< 4) */
+#define LOADCTL_MINRUN		5	/* samples a resumed process runs */
+#define LOADCTL_MAXSUSPEND	10	/* samples before resuming anyway */
+
+struct addrspace;
+
+/*
+ * Functions in loadctl.c:
+ *
+ *    loadctl_bootstrap  - start the load controller.
+ *
+ *    loadctl_add        - start tracking AS (from as_create).
+ *
+ *    loadctl_remove     - stop tracking AS (from as_destroy).
+ *
+ *    loadctl_wait       - sleep while AS is suspended. Called by
+ *                         vm_fault before it takes AS's lock.
+ *
+ *    loadctl_trim_shared - give mapped file pages a second chance, as
+ *                         above. Returns the number of mappings it
+ *                         looked at; 0 too if the controller was busy.
+ *
+ *    loadctl_printstats - print working-set and load control statistics.
+ */
+
+void loadctl_bootstrap(void);
+void loadctl_add(struct addrspace *as);
+void loadctl_remove(struct addrspace *as);
+void loadctl_wait(struct addrspace *as);
+unsigned loadctl_trim_shared(void);
+void loadctl_printstats(void);
+
+
+#endif /* _LOADCTL_H_ */
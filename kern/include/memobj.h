@@ -0,0 +1,119 @@
+#ifndef _MEMOBJ_H_
+#define _MEMOBJ_H_
+
+/*
+ * Memory objects.
+ *
+ * A memory object holds the frames behind MAP_SHARED mappings. Every
+ * mapping of the same object, in any process, maps the same frames
+ * (PTE_SHARED), so stores through one are seen by all the others.
+ *
+ * A file's object is found by vnode. Its frames are read from the
+ * file on first touch and are written back when dirty: when a process
+ * unmaps them or exits, on sync(), and when the last mapping of the
+ * file goes away.
+ *
+ * An anonymous object (no vnode) is zero-fill memory shared through
+ * fork, from MAP_SHARED|MAP_ANON, or attached by name with
+ * shm_attach. A name holds a reference of its own until shm_unlink,
+ * so a named segment outlives its mappings; otherwise the object and
+ * its frames go when the last mapping does.
+ *
+ * The object holds one reference to each of its frames and each PTE
+ * mapping one holds another. Nothing records which PTEs those are, so
+ * the clock never evicts shared frames. Instead, when memory runs low
+ * the pageout daemon has the load controller unmap file pages nobody
+ * has touched since its last pass (see loadctl.h), and a frame of a
+ * file's object that nothing maps any more is given back, after being
+ * written back if need be; the next fault reads it in again.
+ *
+ * A page is marked dirty in the object when a write fault maps it
+ * writable. A mapping that is still writable can store to the page
+ * without faulting again, so write-back only clears the mark once no
+ * mapping is left; until then every sync writes the page again.
+ */
+
+#include <vm.h>
+
+struct vnode;
+
+/* Object page behind VADDR in REGION, a MAP_SHARED mapping. */
+#define MEMOBJ_INDEX(region, vaddr) \
+	((unsigned)(((region)->file_offset + \
+		     ((vaddr) - (region)->file_base)) / PAGE_SIZE))
+
+struct memobj {
+	struct vnode *mo_vn;		/* backing file, or NULL */
+	char *mo_name;			/* shm_attach name, or NULL */
+	size_t mo_size;			/* bytes in a named segment */
+	unsigned mo_npages;		/* size of the arrays below */
+	paddr_t *mo_frames;		/* frame per page, or 0 */
+	bool *mo_dirty;			/* written since last write-back */
+	bool *mo_busy;			/* being read in or written back */
+	unsigned mo_refcount;		/* regions mapping it, +1 if named */
+	struct memobj *mo_next;		/* list of all objects */
+};
+
+/*
+ * Functions in memobj.c:
+ *
+ *    memobj_bootstrap - set up the object list.
+ *
+ *    memobj_get       - return the object for VN, creating it if need
+ *                       be, with a new reference. NULL if out of memory.
+ *
+ *    memobj_anon      - return a new anonymous object with one
+ *                       reference, or NULL if out of memory.
+ *
+ *    memobj_attach    - return in *RET the segment called NAME with a
+ *                       new reference, creating it LEN bytes long if
+ *                       there isn't one. EINVAL if an existing segment
+ *                       is shorter than LEN.
+ *
+ *    memobj_unlink    - remove NAME; the segment lasts until its last
+ *                       mapping goes. ENOENT if there is no such name.
+ *
+ *    memobj_incref    - add a reference.
+ *
+ *    memobj_decref    - drop a reference. With the last one, dirty pages
+ *                       are written back and the object freed.
+ *
+ *    memobj_getpage   - return in *PADDR the frame for page INDEX, with
+ *                       a new reference, reading it in (or zeroing it)
+ *                       if needed.
+ *                       Without WAIT, fails (ENOMEM) rather than page
+ *                       anything out to make room.
+ *
+ *    memobj_dirty     - mark page INDEX as written.
+ *
+ *    memobj_writeback - write page INDEX back to the file if it is
+ *                       resident, and clear its mark if nothing maps
+ *                       it. Anonymous objects have nowhere to write.
+ *
+ *    memobj_sync      - write back every marked page of every object.
+ *
+ *    memobj_reclaim   - free some frames of files that nothing maps,
+ *                       returning true if it did. Clean ones first;
+ *                       failing those, with WRITEBACK, dirty ones of one
+ *                       file are written back and freed.
+ *
+ *    memobj_printstats - print statistics.
+ */
+
+void memobj_bootstrap(void);
+struct memobj *memobj_get(struct vnode *vn);
+struct memobj *memobj_anon(void);
+int memobj_attach(const char *name, size_t len, struct memobj **ret);
+int memobj_unlink(const char *name);
+void memobj_incref(struct memobj *mo);
+void memobj_decref(struct memobj *mo);
+int memobj_getpage(struct memobj *mo, unsigned index, bool wait,
+		   paddr_t *paddr);
+void memobj_dirty(struct memobj *mo, unsigned index);
+int memobj_writeback(struct memobj *mo, unsigned index);
+void memobj_sync(void);
+bool memobj_reclaim(bool writeback);
+void memobj_printstats(void);
+
+
+#endif /* _MEMOBJ_H_ */
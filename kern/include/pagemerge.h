@@ -0,0 +1,53 @@
+#ifndef _PAGEMERGE_H_
+#define _PAGEMERGE_H_
+
+/*
+ * Same-page merging.
+ *
+ * A kernel thread sweeps the coremap looking at private user frames
+ * (those with a single owner, CM_USER), PAGEMERGE_BATCH of them every
+ * PAGEMERGE_INTERVAL seconds, yielding between frames so that it only
+ * takes time nobody else wants. Each frame's contents are hashed and
+ * looked up in two trees keyed by the hash:
+ *
+ *    the stable tree holds frames already merged. They are mapped
+ *    copy-on-write by everyone using them, and the tree holds a
+ *    reference of its own so that a frame in it is never claimed for
+ *    writing and so never changes. A match there is remapped to the
+ *    stable frame and its own frame freed.
+ *
+ *    the unstable tree holds the frames seen so far this sweep that
+ *    matched nothing. Their contents may change at any time, so the
+ *    hash is only a hint. When a later frame matches, both are
+ *    frozen and compared, and if they are the same the later one
+ *    becomes a stable frame mapped by both.
+ *
+ * A page is frozen by holding its owner's lock, clearing PTE_REF and
+ * PTE_DIRTY in its PTE, and shooting down its translation. Holding
+ * the lock doesn't stop the refill handler, which never takes it, but
+ * without PTE_REF the next access misses into vm_fault and waits for
+ * the lock there. Pages are only ever remapped after a full compare
+ * while frozen; a page that doesn't match gets its bits back. A write
+ * to a merged page breaks copy-on-write as for fork. The unstable tree is emptied at the end of each sweep, and
+ * stable frames nobody maps any more are freed.
+ *
+ * Merged frames are shared, so, like other shared frames, they are
+ * charged to nobody's RSS and aren't paged out.
+ */
+
+#define PAGEMERGE_INTERVAL	1	/* seconds between batches */
+#define PAGEMERGE_BATCH		128	/* frames looked at per batch */
+
+/*
+ * Functions in pagemerge.c:
+ *
+ *    pagemerge_bootstrap  - start the merging thread.
+ *
+ *    pagemerge_printstats - print how much is shared and saved.
+ */
+
+void pagemerge_bootstrap(void);
+void pagemerge_printstats(void);
+
+
+#endif /* _PAGEMERGE_H_ */
@@ -0,0 +1,96 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level page table for user address spaces.
+ *
+ * Laid out the way MIPS-style software refill expects: the top 10
+ * bits of a virtual address index a page directory, the next 10 bits
+ * index a page-sized table of PTEs, and the low 12 bits are the page
+ * offset. Second-level tables are allocated on first use, so a sparse
+ * address space only pays for the 4M chunks it actually touches.
+ *
+ * A PTE is laid out like TLBLO so that loading the TLB is just a
+ * mask:
+ *
+ *    bits 31-12  physical frame number
+ *    PTE_DIRTY   same bit as TLBLO_DIRTY; page is writable in the TLB
+ *    PTE_VALID   same bit as TLBLO_VALID; page is resident
+ *    PTE_REF     software bit; page has been referenced
+ *    PTE_COW     software bit; frame is shared copy-on-write
+ *    PTE_SWAPPED software bit; page is in swap, and the frame number
+ *                bits hold the swap slot instead (PTE_VALID is clear)
+ *    PTE_PREFETCH software bit; page was mapped by fault-around and
+ *                hasn't been faulted on since
+ *    PTE_SHARED  software bit; frame belongs to the image cache and is
+ *                shared read-only by everyone running the program
+ *    PTE_LAZYFREE software bit; page was given up with MADV_FREE and
+ *                hasn't been written since
+ *    PTE_AGE     software bits; working-set samples since the page was
+ *                last referenced (see loadctl.h)
+ *
+ * A PTE of 0 means the page has never been touched.
+ */
+
+#include <vm.h>
+
+typedef uint32_t pte_t;
+
+#define PT_NDIR		1024			/* directory entries */
+#define PT_NPTE		(PAGE_SIZE / sizeof(pte_t))	/* PTEs per table */
+#define PT_DIRSPAN	(PT_NPTE * PAGE_SIZE)	/* bytes mapped per table */
+
+#define PT_DIRINDEX(va)	((va) >> 22)
+#define PT_PTEINDEX(va)	(((va) >> 12) & (PT_NPTE - 1))
+
+#define PTE_FRAME	0xfffff000	/* physical frame */
+#define PTE_DIRTY	0x00000400	/* writable (TLBLO_DIRTY) */
+#define PTE_VALID	0x00000200	/* resident (TLBLO_VALID) */
+#define PTE_REF		0x00000080	/* referenced */
+#define PTE_SWAPPED	0x00000040	/* paged out */
+#define PTE_COW		0x00000020	/* shared copy-on-write */
+#define PTE_PREFETCH	0x00000010	/* mapped ahead, not yet faulted on */
+#define PTE_SHARED	0x00000008	/* text or MAP_SHARED frame */
+#define PTE_LAZYFREE	0x00000004	/* MADV_FREE'd, not written since */
+#define PTE_AGE		0x00000003	/* samples since last referenced */
+
+/* Swap slot of a PTE_SWAPPED entry, and the entry for a slot. */
+#define PTE_SLOT(pte)	((pte) >> 12)
+#define PTE_MKSWAP(slot) (((pte_t)(slot) << 12) | PTE_SWAPPED)
+
+/* Bits of a PTE that go into TLBLO. */
+#define PTE_TLBMASK	(PTE_FRAME | PTE_DIRTY | PTE_VALID)
+
+struct pagetable {
+	pte_t *pt_dir[PT_NDIR];		/* second-level tables, or NULL */
+};
+
+/*
+ * Functions in pagetable.c:
+ *
+ *    pt_create  - create an empty page table. Returns NULL on
+ *                 out-of-memory.
+ *
+ *    pt_destroy - free the page table itself. Whatever the PTEs refer
+ *                 to must already have been released.
+ *
+ *    pt_lookup  - return a pointer to the PTE for VADDR. If CREATE is
+ *                 set, allocates the second-level table if needed
+ *                 (returning NULL only on out-of-memory); otherwise
+ *                 returns NULL if there is no table.
+ *
+ *    pt_walk    - call FUNC on every nonzero PTE for addresses in
+ *                 [START, END), skipping absent tables. Stops early
+ *                 and returns the error if FUNC returns nonzero.
+ */
+
+typedef int (*pt_walkfn)(vaddr_t vaddr, pte_t *pte, void *data);
+
+struct pagetable *pt_create(void);
+void              pt_destroy(struct pagetable *pt);
+pte_t            *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+int               pt_walk(struct pagetable *pt, vaddr_t start, vaddr_t end,
+                          pt_walkfn func, void *data);
+
+
+#endif /* _PAGETABLE_H_ */
@@ -37,6 +37,8 @@
  */
 
 #include <spinlock.h>
+#include <kern/time.h> /* required by kern/resource.h */
+#include <kern/resource.h>
 #include <thread.h> /* required for struct threadarray */
 #include <filetable.h>
 #include <proctable.h>
@@ -68,6 +70,10 @@ struct proc {
     int exitcode;                /* exitcode */
     int exited;                  /* 1 if exited 0 if not exited yet */
     struct cv *exit_signal;      /* condition variable signals when exiting */
+
+    /* resource limits */
+    struct rlimit rss_limit;     /* RLIMIT_RSS, in bytes */
+    struct rlimit memlock_limit; /* RLIMIT_MEMLOCK, in bytes */
 };
 
 /* This is the process structure for the kernel and for kernel-only threads. */
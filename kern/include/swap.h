@@ -0,0 +1,69 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space.
+ *
+ * Pages are paged out to a raw disk device (SWAP_DEVICE), one page per
+ * slot. Slots are allocated from a bitmap and reference counted, since
+ * fork shares a swapped-out page between parent and child the same
+ * way it shares a resident frame. A swapped-out PTE holds one
+ * reference; so does a resident frame that still has an up-to-date
+ * copy in swap (see cm_slot in the coremap).
+ *
+ * Page-in is synchronous. Page-out is asynchronous: swap_pageout
+ * queues the frame for the swap writer thread, which writes it and
+ * then hands the frame back to the VM system with vm_pageout_done.
+ * If the queue is full the write is done on the spot. A page-out that
+ * fails to write keeps its frame in memory as the slot's contents.
+ */
+
+#include <vm.h>
+
+#define SWAP_DEVICE	"lhd1raw:"
+#define SWAP_NOSLOT	0xffffffff	/* frame has no copy in swap */
+#define SWAP_QUEUE	32		/* page-outs in flight */
+
+/*
+ * Functions in swap.c:
+ *
+ *    swap_bootstrap - open the swap device and start the swap writer.
+ *                     Without a swap device the system runs with
+ *                     paging disabled.
+ *
+ *    swap_enabled   - true if there is swap space to page out to.
+ *
+ *    swap_alloc     - allocate a slot with one reference. Returns
+ *                     ENOSPC if swap is full.
+ *
+ *    swap_incref    - add a reference to SLOT.
+ *
+ *    swap_refcount  - return the number of references to SLOT.
+ *
+ *    swap_free      - drop a reference to SLOT, freeing it with the
+ *                     last one.
+ *
+ *    swap_pagein    - read SLOT into the frame at PADDR, first waiting
+ *                     for any page-out of that slot still in flight.
+ *
+ *    swap_pageout   - start writing the frame at PADDR to SLOT.
+ *
+ *    swap_wait      - sleep until some page-out completes. Returns
+ *                     false at once if none are in flight.
+ *
+ *    swap_printstats - print swap statistics.
+ */
+
+void swap_bootstrap(void);
+bool swap_enabled(void);
+int swap_alloc(unsigned *slot);
+void swap_incref(unsigned slot);
+unsigned swap_refcount(unsigned slot);
+void swap_free(unsigned slot);
+int swap_pagein(unsigned slot, paddr_t paddr);
+void swap_pageout(unsigned slot, paddr_t paddr);
+bool swap_wait(void);
+void swap_printstats(void);
+
+
+#endif /* _SWAP_H_ */
@@ -33,6 +33,7 @@
 
 #include <cdefs.h> /* for __DEAD */
 struct trapframe; /* from <machine/trapframe.h> */
+struct rlimit; /* from <kern/resource.h> */
 
 /*
  * The system call dispatcher.
@@ -70,6 +71,7 @@ int sys_close(int fd, int32_t *retval);
 int sys_dup2(int oldfd, int newfd, int32_t *retval);
 int sys_chdir(const char *pathname, int32_t *retval);
 int sys___getcwd(char *buf, size_t buflen, int32_t *retval);
+int sys_sync(void);
 
 /*
  * Prototypes for proc handling system calls
@@ -79,10 +81,22 @@ int sys_execv(const char *program, char **args);
 int sys_waitpid(pid_t curpid, int *status, int options, pid_t *retval);
 int sys_getpid(pid_t *retval);
 void sys__exit(int exitcode);
+int sys_getrlimit(int resource, struct rlimit *rlp);
+int sys_setrlimit(int resource, const struct rlimit *rlp);
 
 /*
  * Prototypes for memory handling system calls
  */
 int sys_sbrk(intptr_t amount, void *retval);
+int sys_mmap(void *addr, size_t len, int prot, int flags, int fd,
+             off_t offset, int32_t *retval);
+int sys_munmap(void *addr, size_t len);
+int sys_madvise(void *addr, size_t len, int advice);
+int sys_mincore(void *addr, size_t len, unsigned char *vec);
+int sys_mlock(const void *addr, size_t len);
+int sys_munlock(const void *addr, size_t len);
+int sys_munlockall(void);
+int sys_shm_attach(const char *name, size_t len, int prot, int32_t *retval);
+int sys_shm_unlink(const char *name);
 
 #endif /* _SYSCALL_H_ */
@@ -44,39 +44,185 @@
 #define VM_FAULT_WRITE       1    /* A write was attempted */
 #define VM_FAULT_READONLY    2    /* A write to a readonly page was attempted*/
 
+/*
+ * Coremap: one entry per physical page managed by the VM system.
+ *
+ * Physical pages are handed out by a binary buddy allocator. Free
+ * blocks sit on per-order free lists whose links are stored in the
+ * free pages themselves, so the coremap only has to hold a few bits
+ * of state per page.
+ *
+ * A user frame with a single mapping is marked CM_USER and records
+ * its owner (cm_as, cm_vaddr) so the page replacement code can find
+ * the PTE that maps it. Frames shared copy-on-write have no owner
+ * and are not evicted, and nor are owned frames CM_WIRED by mlock.
+ * cm_slot is a swap slot still holding a clean copy of the frame, if
+ * any.
+ */
+struct addrspace;
+
 struct coremap_entry {
-    // vaddr_t vaddr;                      /* physical address of this block */
-    int freecount;                  /* 0 for free */
-    int block_start;                /* determines if entry is start of block */
-    int block_end;                  /* determines if entry is end of block */
+	uint16_t cm_flags;		/* CM_* state bits and order */
+	uint16_t cm_refcount;		/* mappings of a user frame */
+	struct addrspace *cm_as;	/* owner of a CM_USER frame */
+	vaddr_t cm_vaddr;		/* where the owner maps it */
+	unsigned cm_slot;		/* swap copy, or SWAP_NOSLOT */
 };
 
-struct page_table {
-    struct page_entry *first_entry;
-    struct lock *lock;              /* lock for this structure */
+#define CM_FREE		0x0001		/* head of a free buddy block */
+#define CM_ALLOC	0x0002		/* page is allocated */
+#define CM_LAST		0x0004		/* last page of an allocation */
+#define CM_USER		0x0008		/* user frame with one owner */
+#define CM_BUSY		0x0010		/* being evicted */
+#define CM_WIRED	0x0020		/* owned frame pinned by mlock */
+
+/* log2 of the block size of a CM_FREE head, in the top of cm_flags */
+#define CM_ORDER_SHIFT	12
+#define CM_ORDER(flags)	((unsigned)(flags) >> CM_ORDER_SHIFT)
+
+/* Largest buddy block is 2^BUDDY_MAXORDER pages; CM_ORDER holds 15. */
+#define BUDDY_MAXORDER	10
+
+/*
+ * Per-cpu page magazine: a small stack of free single pages kept in
+ * front of the coremap so the common one-page alloc/free never takes
+ * coremap_splk. Refilled from and drained to the coremap in batches
+ * of PAGEMAG_BATCH. Only touched by its own cpu, at splhigh; when
+ * memory runs out, the other cpus are asked to empty theirs.
+ */
+#define PAGEMAG_SIZE	32
+#define PAGEMAG_BATCH	16
+
+struct page_magazine {
+	paddr_t pm_pages[PAGEMAG_SIZE];	/* cached free pages */
+	unsigned pm_count;		/* number of cached pages */
+	unsigned pm_hits;		/* allocs served from the magazine */
+	unsigned pm_misses;		/* allocs that had to refill */
 };
 
-/* structure to keep track of page table */
-struct page_entry {
-    vaddr_t as_vaddr;               /* start virtual address */
-    paddr_t as_paddr;               /* start physical address */
-    struct page_entry *next_page;   /* linked list structure */
+/*
+ * Recent faults in a region, for fault-around (see vm_fault). A fault
+ * at fh_next continues a sequential run and widens the window; any
+ * other fault narrows it. madvise can say how the region will be used
+ * instead: MADV_RANDOM turns fault-around off, and MADV_SEQUENTIAL
+ * keeps the window wide open and lets the pages left behind go.
+ */
+struct fault_history {
+    vaddr_t fh_next;                /* page after the last one mapped */
+    unsigned fh_window;             /* pages to map ahead of a fault */
+    int fh_advice;                  /* MADV_NORMAL, _RANDOM or _SEQUENTIAL */
+    vaddr_t fh_behind;              /* next page to drop behind */
 };
 
+/*
+ * A region of a user address space. Pages are filled on first touch:
+ * from VN for the bytes in [file_base, file_base+file_size), zero
+ * everywhere else. A read-only region loaded from an executable also
+ * points at segment IMAGE_SEG of the program's cached image, and gets
+ * its frames from there.
+ *
+ * Regions made by mmap have MAP_FLAGS set. A MAP_SHARED file mapping
+ * takes its frames from the memory object OBJECT instead (see
+ * memobj.h): the page at vaddr is file page
+ * (file_offset + vaddr - file_base) / PAGE_SIZE.
+ */
+struct vnode;
+struct image;
+struct memobj;
+
 struct region {
     vaddr_t region_base;            /* base of this region */
-    vaddr_t region_end;             /* end of region */
+    vaddr_t region_end;             /* end of region (inclusive) */
     size_t npages;                  /* number of pages in region */
     int readable;
     int writeable;
     int executable;
-    struct region *next_region;     /* linked list structure */
-    struct lock *lock;
+    struct vnode *vn;               /* backing file, or NULL */
+    vaddr_t file_base;              /* first byte backed by vn */
+    size_t file_size;               /* bytes backed by vn */
+    off_t file_offset;              /* offset of file_base in vn */
+    struct fault_history history;   /* for fault-around */
+    struct image *image;            /* shared program image, or NULL */
+    unsigned image_seg;             /* which segment of it */
+    int map_flags;                  /* MAP_* if made by mmap, else 0 */
+    struct memobj *object;          /* shared mapping's object, or NULL */
+    struct region *next_region;     /* list, sorted by address */
+    struct region *left_region;     /* region tree: lower addresses */
+    struct region *right_region;    /* region tree: higher addresses */
+    int tree_height;                /* height of this subtree */
 };
 
+/* Pages reserved for the user stack; they are only populated on use. */
+#define VM_STACKPAGES	1024
+
+/* Pages evicted per allocation before giving up with ENOMEM. */
+#define VM_RECLAIM_TRIES	64
+
+/* Largest fault-around window, in pages past the faulting one. */
+#define VM_FAULTAROUND_MAX	8
+
+/* Pages a MADV_SEQUENTIAL reader keeps behind it before dropping them. */
+#define VM_DROPBEHIND		16
+
+/* Most MADV_WILLNEED requests waiting for the prefetch thread. */
+#define VM_WILLNEED_MAX		32
+
+/*
+ * Most mappings of the shared zero frame. Reference counts are 16
+ * bits; past this, reads of untouched memory get frames of their own.
+ */
+#define VM_ZEROFRAME_MAXREFS	0xf000
+
+/*
+ * mlock: the default RLIMIT_MEMLOCK, in bytes, and the fraction of
+ * physical memory all processes together may keep wired.
+ */
+#define VM_MEMLOCK_DEFAULT	(64 * PAGE_SIZE)
+#define VM_WIRED_DIV		4
+
+/* Most pages evicted together, sharing one TLB shootdown. */
+#define VM_EVICT_CLUSTER	8
+
+/*
+ * Pre-zeroed page pool (see vm.c): its capacity, default refill
+ * watermarks, the most pages one trip round the idle loop zeroes, and
+ * how long refilling stops after the pool is drained for memory.
+ */
+#define VM_ZEROPOOL_MAX		128
+#define VM_ZEROPOOL_LOW		16
+#define VM_ZEROPOOL_HIGH	32
+#define VM_ZEROPOOL_CHUNK	4
+#define VM_ZEROPOOL_HOLDOFF	1	/* seconds */
+
+/*
+ * Pageout daemon watermarks, as fractions of physical memory: it is
+ * woken below VM_FREELOW_DIV, works until VM_FREEHIGH_DIV is free,
+ * and foreground allocations wait for it below VM_FREEMIN_DIV. It
+ * evicts VM_PAGEOUT_BATCH clusters between waits for their writes.
+ */
+#define VM_FREEMIN_DIV		64
+#define VM_FREELOW_DIV		32
+#define VM_FREEHIGH_DIV		16
+#define VM_PAGEOUT_BATCH	4
+
 /* Initialization function */
 void vm_bootstrap(void);
 
+/* Start the pageout daemon (after swap_bootstrap) */
+void vm_pageout_bootstrap(void);
+
+/* Start the MADV_WILLNEED prefetch thread */
+void vm_willneed_bootstrap(void);
+
+/*
+ * MADV_WILLNEED: have the prefetch thread bring in the current
+ * process's pages in [START, END) of AS soon, up to its RSS limit. It
+ * is only a hint, and is dropped if too many are waiting already.
+ * vm_willneed_cancel forgets AS's requests (from as_destroy).
+ */
+void vm_willneed(struct addrspace *as, vaddr_t start, vaddr_t end);
+void vm_willneed_cancel(struct addrspace *as);
+
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
@@ -84,6 +230,154 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/* Like alloc_kpages, but fails rather than paging anything out */
+vaddr_t alloc_kpages_nowait(unsigned npages);
+
+/*
+ * User frames. page_alloc returns a zeroed frame with one reference;
+ * page_copy returns a private copy of a frame. Frames shared
+ * copy-on-write are reference counted: page_incref adds a mapping and
+ * page_free drops one, freeing the frame with the last.
+ * page_alloc_nowait is page_alloc without paging anything out.
+ */
+paddr_t page_alloc(void);
+paddr_t page_alloc_nowait(void);
+paddr_t page_copy(paddr_t src);
+void page_incref(paddr_t paddr);
+unsigned page_refcount(paddr_t paddr);
+void page_free(paddr_t paddr);
+
+/*
+ * The zero frame is one read-only frame of zeros that reads of
+ * untouched anonymous memory map copy-on-write, instead of getting
+ * frames of their own. It is never freed.
+ */
+bool page_iszeroframe(paddr_t paddr);
+
+/*
+ * Make AS, at VADDR, the owner of an unshared frame so it can be
+ * paged out. SLOT is a swap slot holding a clean copy, or
+ * SWAP_NOSLOT; the frame takes over that reference.
+ */
+void page_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr,
+		   unsigned slot);
+
+/*
+ * Wire the frame at PADDR, if it is owned, so that it isn't paged
+ * out, or unwire it. A frame is unwired when it stops being owned.
+ */
+void page_wire(paddr_t paddr);
+void page_unwire(paddr_t paddr);
+
+/*
+ * Reserve NPAGES of the 1/VM_WIRED_DIV of memory that mlock may keep
+ * wired, all processes together, or give them back. Reserving fails
+ * if it would pass the limit.
+ */
+bool page_wire_reserve(unsigned npages);
+void page_wire_unreserve(unsigned npages);
+
+/*
+ * If the frame at PADDR is owned, and neither being paged out nor
+ * wired, lock its owner and return it, with where it maps the frame
+ * in *VADDR. *HELD says whether the caller held the lock already.
+ * Returns NULL if the frame has no owner or the lock is taken.
+ */
+struct addrspace *page_lockowner(paddr_t paddr, vaddr_t *vaddr, bool *held);
+
+/* Release a frame once the swap writer has written it out */
+void vm_pageout_done(paddr_t paddr);
+
+/*
+ * Page out every frame AS owns, for load control. The caller holds
+ * AS's lock. Returns the number of frames that went.
+ */
+unsigned vm_swapout(struct addrspace *as);
+
+/*
+ * TLB entries are tagged with a per-cpu address space ID (see vm.c).
+ *
+ *    vm_tlb_activate   - make AS the one the current cpu translates for.
+ *    vm_tlb_drop_as    - retire all of AS's TLB entries on every cpu.
+ *    vm_tlb_forget_as  - stop the refill handler using AS's page table.
+ *    vm_tlb_flush      - empty the current cpu's TLB.
+ *    vm_tlb_load       - load a translation for the current process.
+ *    vm_tlb_invalidate - drop AS's translation of VADDR on this cpu.
+ *    vm_tlb_shootdown  - same, on every cpu, waiting until it's done.
+ *    vm_tlb_flush_all  - empty every cpu's TLB, waiting until it's done.
+ *
+ * An AS of NULL means the kernel's own translations in kseg2 (see
+ * vmalloc.h), which every cpu may hold.
+ *
+ * To drop several of one address space's translations at once, queue
+ * them in a struct tlb_batch and flush it: each other cpu that still
+ * holds an ASID for the address space gets them all in one IPI.
+ *
+ *    vm_tlb_batch_init  - start an empty batch for AS.
+ *    vm_tlb_batch_add   - queue VADDR. Past TLBSHOOTDOWN_MAX pages the
+ *                         batch degrades to flushing whole TLBs
+ *                         (tb_all).
+ *    vm_tlb_batch_flush - invalidate everything queued on every cpu,
+ *                         wait until it's done, and empty the batch.
+ */
+void vm_tlb_activate(struct addrspace *as);
+void vm_tlb_drop_as(struct addrspace *as);
+void vm_tlb_forget_as(struct addrspace *as);
+void vm_tlb_flush(void);
+void vm_tlb_load(vaddr_t vaddr, uint32_t pte);
+void vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr);
+void vm_tlb_shootdown(struct addrspace *as, vaddr_t vaddr);
+void vm_tlb_flush_all(void);
+
+struct tlb_batch {
+	struct addrspace *tb_as;
+	unsigned tb_count;		/* entries in tb_ts */
+	bool tb_all;			/* flush whole TLBs instead */
+	struct tlbshootdown tb_ts[TLBSHOOTDOWN_MAX];
+};
+
+void vm_tlb_batch_init(struct tlb_batch *tb, struct addrspace *as);
+void vm_tlb_batch_add(struct tlb_batch *tb, vaddr_t vaddr);
+void vm_tlb_batch_flush(struct tlb_batch *tb);
+
+/*
+ * Set up a cpu's page magazine (called from cpu_create), and give
+ * all of this cpu's cached pages back to the coremap. pagemag_flush
+ * returns false if there weren't any.
+ */
+void pagemag_init(struct page_magazine *pm);
+bool pagemag_flush(void);
+
+/* Coremap accounting (for stats and tests), and frame INDEX's address */
+unsigned coremap_npages(void);
+unsigned coremap_nfree(void);
+unsigned coremap_wired(void);
+paddr_t coremap_paddr(unsigned index);
+
+/*
+ * The buddy allocator on its own, without the page magazines, the
+ * zero pool or the pageout daemon, and the pages free in it (for the
+ * cmb benchmark). coremap_freeppages frees a whole allocation.
+ */
+paddr_t coremap_getppages(unsigned long npages);
+void coremap_freeppages(paddr_t paddr);
+unsigned coremap_nbuddy(void);
+
+/* Print VM statistics (kernel menu) */
+void vm_printstats(void);
+
+/*
+ * Pre-zeroed page pool.
+ *    vm_zeropool_idle  - called by an idle cpu, at splhigh, before
+ *                        cpu_idle: zero a chunk of pages into the
+ *                        pool if it needs them.
+ *    vm_zeropool_setwater - refill below LOW, up to HIGH (kernel menu).
+ *    vm_zeropool_printstats - print pool statistics.
+ */
+void vm_zeropool_idle(void);
+void vm_zeropool_setwater(unsigned low, unsigned high);
+void vm_zeropool_printstats(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
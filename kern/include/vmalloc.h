@@ -0,0 +1,60 @@
+#ifndef _VMALLOC_H_
+#define _VMALLOC_H_
+
+/*
+ * Virtually contiguous kernel memory.
+ *
+ * alloc_kpages hands out kseg0 addresses, so a multi-page block needs
+ * a physically contiguous run of frames, and under fragmentation there
+ * may be none even with plenty of memory free. vmalloc instead maps
+ * single frames, wherever they are, at consecutive addresses in a
+ * window at the bottom of kseg2, which goes through the TLB.
+ *
+ * The window has its own flat page table in kseg0. Its translations
+ * are loaded global, so they hold in every address space. A TLB miss
+ * on one comes to vm_fault like any other kernel fault, which passes
+ * it to vmalloc_fault to load from the table; that never sleeps or
+ * takes a lock, since the miss can happen anywhere.
+ *
+ * vfree frees the frames straight away but not the addresses: other
+ * cpus may still hold translations for them, which is harmless until
+ * the addresses are handed out again. Freed addresses are reclaimed
+ * in bulk, flushing every TLB once, when too many have piled up or
+ * vmalloc runs out.
+ *
+ * Nothing the TLB miss path itself touches can live here: not thread
+ * stacks, which the exception handler saves registers on, nor page
+ * tables or vm_refill, which the refill handler walks untranslated.
+ * Those are single pages or come from alloc_kpages directly, and
+ * kmalloc only comes here for more than a page, when no contiguous
+ * run can be had without paging.
+ */
+
+#include <vm.h>
+
+#define VMALLOC_BASE	MIPS_KSEG2	/* start of the window */
+#define VMALLOC_PAGES	4096		/* its size (16M) */
+#define VMALLOC_PURGE	1024		/* freed pages before a flush */
+
+/*
+ * Functions in vmalloc.c:
+ *
+ *    vmalloc            - map NPAGES frames at consecutive kseg2
+ *                         addresses. Returns NULL if out of memory or
+ *                         addresses.
+ *
+ *    vfree              - free a block from vmalloc.
+ *
+ *    vmalloc_fault      - load the translation of kseg2 address VADDR.
+ *                         Returns EFAULT if nothing is mapped there.
+ *
+ *    vmalloc_printstats - print vmalloc statistics.
+ */
+
+void *vmalloc(unsigned npages);
+void vfree(void *ptr);
+int vmalloc_fault(vaddr_t vaddr);
+void vmalloc_printstats(void);
+
+
+#endif /* _VMALLOC_H_ */
@@ -0,0 +1,54 @@
+#ifndef _ZSWAP_H_
+#define _ZSWAP_H_
+
+/*
+ * Compressed swap cache.
+ *
+ * A store of compressed pages, keyed by swap slot, that sits in front
+ * of the swap disk. swap_pageout offers each page to zswap first and
+ * only writes it to disk if it doesn't compress well enough or the
+ * store is at its cap; swap_pagein looks here before reading the
+ * disk. An entry lives until its slot is freed or rewritten.
+ *
+ * Pages are compressed with a byte-oriented LZ77 coder (LZ4-like
+ * sequences of literal run, offset, match length) and kept in a slab
+ * of fixed-size chunks per size class, ZSWAP_CHUNK bytes apart.
+ * Slab pages never come from paging anything out, so zswap only
+ * grows into memory that is actually free.
+ */
+
+#include <vm.h>
+
+#define ZSWAP_CHUNK	64			/* size class granularity */
+#define ZSWAP_MAXSIZE	(PAGE_SIZE * 3 / 4)	/* largest stored page */
+#define ZSWAP_NCLASSES	(ZSWAP_MAXSIZE / ZSWAP_CHUNK)
+#define ZSWAP_CAPPCT	25			/* default cap, % of RAM */
+
+/*
+ * Functions in zswap.c:
+ *
+ *    zswap_bootstrap  - set up the store for NSLOTS swap slots.
+ *
+ *    zswap_store      - compress the frame at PADDR as the contents of
+ *                       SLOT. Fails (ENOSPC) if it doesn't compress to
+ *                       ZSWAP_MAXSIZE or the store is full.
+ *
+ *    zswap_load       - decompress SLOT into the frame at PADDR.
+ *                       Fails (ENOENT) if SLOT isn't in the store.
+ *
+ *    zswap_invalidate - drop SLOT from the store, if it is there.
+ *
+ *    zswap_setcap     - limit the store to MAXPAGES pages of memory.
+ *
+ *    zswap_printstats - print the compression ratio and hit rate.
+ */
+
+void zswap_bootstrap(unsigned nslots);
+int zswap_store(unsigned slot, paddr_t paddr);
+int zswap_load(unsigned slot, paddr_t paddr);
+void zswap_invalidate(unsigned slot);
+void zswap_setcap(unsigned maxpages);
+void zswap_printstats(void);
+
+
+#endif /* _ZSWAP_H_ */
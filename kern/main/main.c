@@ -43,6 +43,11 @@
 #include <current.h>
 #include <synch.h>
 #include <vm.h>
+#include <swap.h>
+#include <imagecache.h>
+#include <memobj.h>
+#include <loadctl.h>
+#include <pagemerge.h>
 #include <mainbus.h>
 #include <vfs.h>
 #include <device.h>
@@ -127,6 +132,13 @@ boot(void)
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
+	swap_bootstrap();
+	image_bootstrap();
+	memobj_bootstrap();
+	vm_pageout_bootstrap();
+	vm_willneed_bootstrap();
+	loadctl_bootstrap();
+	pagemerge_bootstrap();
 	kprintf_bootstrap();
 	thread_start_cpus();
 
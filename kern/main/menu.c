@@ -41,6 +41,8 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
+#include <zswap.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
@@ -384,6 +386,91 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+/*
+ * Read a page count for one of the commands below from ARG, limiting
+ * it to MAX. Returns false if ARG isn't a number.
+ */
+static
+bool
+getpages(const char *arg, unsigned max, unsigned *ret)
+{
+	unsigned val = 0;
+
+	if (*arg == '\0') {
+		return false;
+	}
+	for (; *arg != '\0'; arg++) {
+		if (*arg < '0' || *arg > '9') {
+			return false;
+		}
+		if (val < max) {
+			val = val * 10 + (*arg - '0');
+		}
+	}
+	*ret = val < max ? val : max;
+	return true;
+}
+
+/*
+ * Command for showing compressed swap stats, and optionally setting
+ * its memory cap in pages.
+ */
+static
+int
+cmd_zswap(int nargs, char **args)
+{
+	unsigned maxpages;
+
+	if (nargs == 2 && getpages(args[1], coremap_npages(), &maxpages)) {
+		zswap_setcap(maxpages);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: zs [maxpages]\n");
+		return EINVAL;
+	}
+
+	zswap_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for showing the pre-zeroed page pool, and optionally setting
+ * its refill watermarks in pages.
+ */
+static
+int
+cmd_zeropool(int nargs, char **args)
+{
+	unsigned low, high;
+
+	if (nargs == 3 &&
+	    getpages(args[1], VM_ZEROPOOL_MAX, &low) &&
+	    getpages(args[2], VM_ZEROPOOL_MAX, &high)) {
+		vm_zeropool_setwater(low, high);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: zp [low high]\n");
+		return EINVAL;
+	}
+
+	vm_zeropool_printstats();
+
+	return 0;
+}
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -476,6 +563,7 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[cmb] Coremap alloc benchmark       ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -519,6 +607,9 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[vm] VM stats                       ",
+	"[zs] Compressed swap stats/cap      ",
+	"[zp] Zero page pool stats/watermarks",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -573,6 +664,9 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "vm",         cmd_vmstats },
+	{ "zs",         cmd_zswap },
+	{ "zp",         cmd_zeropool },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -582,6 +676,7 @@ static struct {
 	{ "km2",	mallocstress },
 	{ "km3",	malloctest3 },
 	{ "km4",	malloctest4 },
+	{ "cmb",	coremapbench },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
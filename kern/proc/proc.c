@@ -89,6 +89,10 @@ proc_create(const char *name)
     proc->exitcode = -1;
     proc->exited = 0;
     proc->exit_signal = cv_create("");
+    proc->rss_limit.rlim_cur = RLIM_INFINITY;
+    proc->rss_limit.rlim_max = RLIM_INFINITY;
+    proc->memlock_limit.rlim_cur = VM_MEMLOCK_DEFAULT;
+    proc->memlock_limit.rlim_max = RLIM_INFINITY;
 
 	return proc;
 }
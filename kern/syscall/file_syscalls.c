@@ -16,6 +16,8 @@
 #include <proc.h>
 #include <kern/seek.h>
 #include <stat.h>
+#include <imagecache.h>
+#include <memobj.h>
 
 int sys_open(const char *filename, int flags, int32_t *retval) {
 
@@ -63,6 +65,11 @@ int sys_open(const char *filename, int flags, int32_t *retval) {
         return result;
     }
 
+    /* A cached program image may be about to go stale */
+    if ((flags & O_ACCMODE) != O_RDONLY) {
+        image_invalidate(file_vn);
+    }
+
     curproc->filetable->file[fd] = kmalloc(sizeof(struct file));
     curproc->filetable->file[fd]->vn = file_vn;
     curproc->filetable->file[fd]->flags = flags;
@@ -197,6 +204,11 @@ int sys_write(int fd, const void *buf, size_t nbytes, ssize_t *retval) {
     written_bytes = nbytes - uio->uio_resid;
     curproc->filetable->file[fd]->offset += written_bytes;
 
+    /* The file may have been cached as a program image since it was opened */
+    if (written_bytes > 0) {
+        image_invalidate(curproc->filetable->file[fd]->vn);
+    }
+
     kfree(uio);
     kfree(iovec);
     lock_release(curproc->filetable->file[fd]->lock);
@@ -416,3 +428,12 @@ int sys___getcwd(char *buf, size_t buflen, int32_t *retval) {
 
     return 0;
 }
+
+/*
+ * sync: write dirty MAP_SHARED pages back to their files, then flush
+ * the file systems.
+ */
+int sys_sync(void) {
+    memobj_sync();
+    return vfs_sync();
+}
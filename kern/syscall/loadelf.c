@@ -42,8 +42,10 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * Segments are mapped rather than read: each region is backed by the
+ * file and filled by vm_fault on first touch. The parsed headers are
+ * kept in the image cache (see imagecache.h), which also shares the
+ * frames of read-only segments among everyone running the program.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -52,6 +54,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <uio.h>
 #include <proc.h>
@@ -59,108 +62,58 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include <imagecache.h>
 
 /*
- * Load a segment at virtual address VADDR. The segment in memory
- * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
- * segment on disk is located at file offset OFFSET and has length
- * FILESIZE.
+ * Load segment SEG of image IM. The segment in memory extends from
+ * is_vaddr up to (but not including) is_vaddr+is_memsize. The
+ * segment on disk is located at file offset is_offset and has length
+ * is_filesize; the rest of the in-memory segment is zero-filled.
  *
- * FILESIZE may be less than MEMSIZE; if so the remaining portion of
- * the in-memory segment should be zero-filled.
- *
- * Note that uiomove will catch it if someone tries to load an
- * executable whose load address is in kernel space. If you should
- * change this code to not use uiomove, be sure to check for this case
- * explicitly.
+ * Nothing is actually read here: the file range is attached to the
+ * segment's region and vm_fault reads each page in the first time it
+ * is touched. Pages past the file size (the BSS) come up zeroed.
+ * Read-only segments also get the image's shared frames, so pages
+ * another process already read in are just mapped.
  */
 static
 int
-load_segment(struct addrspace *as, struct vnode *v,
-	     off_t offset, vaddr_t vaddr,
-	     size_t memsize, size_t filesize,
-	     int is_executable)
+load_segment(struct addrspace *as, struct image *im, unsigned seg)
 {
-	struct iovec iov;
-	struct uio u;
+	struct image_segment *is = &im->im_segs[seg];
 	int result;
 
-	if (filesize > memsize) {
-		kprintf("ELF: warning: segment filesize > segment memsize\n");
-		filesize = memsize;
-	}
-
-	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
-	      (unsigned long) filesize, (unsigned long) vaddr);
-
-	iov.iov_ubase = (userptr_t)vaddr;
-	iov.iov_len = memsize;		 // length of the memory space
-	u.uio_iov = &iov;
-	u.uio_iovcnt = 1;
-	u.uio_resid = filesize;          // amount to read from the file
-	u.uio_offset = offset;
-	u.uio_segflg = is_executable ? UIO_USERISPACE : UIO_USERSPACE;
-	u.uio_rw = UIO_READ;
-	u.uio_space = as;
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
+	      (unsigned long) is->is_filesize, (unsigned long) is->is_vaddr);
 
-	result = VOP_READ(v, &u);
+	result = as_define_backing(as, is->is_vaddr, im->im_vn,
+				   is->is_offset, is->is_filesize);
 	if (result) {
 		return result;
 	}
-
-	if (u.uio_resid != 0) {
-		/* short read; problem with executable? */
-		kprintf("ELF: short read on segment - file truncated?\n");
-		return ENOEXEC;
+	if (is->is_frames != NULL) {
+		result = as_define_image(as, is->is_vaddr, im, seg);
 	}
-
-	/*
-	 * If memsize > filesize, the remaining space should be
-	 * zero-filled. There is no need to do this explicitly,
-	 * because the VM system should provide pages that do not
-	 * contain other processes' data, i.e., are already zeroed.
-	 *
-	 * During development of your VM system, it may have bugs that
-	 * cause it to (maybe only sometimes) not provide zero-filled
-	 * pages, which can cause user programs to fail in strange
-	 * ways. Explicitly zeroing program BSS may help identify such
-	 * bugs, so the following disabled code is provided as a
-	 * diagnostic tool. Note that it must be disabled again before
-	 * you submit your code for grading.
-	 */
-#if 0
-	{
-		size_t fillamt;
-
-		fillamt = memsize - filesize;
-		if (fillamt > 0) {
-			DEBUG(DB_EXEC, "ELF: Zero-filling %lu more bytes\n",
-			      (unsigned long) fillamt);
-			u.uio_resid += fillamt;
-			result = uiomovezeros(fillamt, &u);
-		}
-	}
-#endif
-
 	return result;
 }
 
 /*
- * Load an ELF executable user program into the current address space.
- *
- * Returns the entry point (initial PC) for the program in ENTRYPOINT.
+ * Read the ELF headers of V and make an (uncached) image recording
+ * its entry point and loadable segments. The file is checked to be
+ * long enough for every segment now, so a truncated executable still
+ * fails at exec rather than faulting later.
  */
+static
 int
-load_elf(struct vnode *v, vaddr_t *entrypoint)
+load_elf_image(struct vnode *v, struct image **ret)
 {
 	Elf_Ehdr eh;   /* Executable header */
 	Elf_Phdr ph;   /* "Program header" = segment header */
 	int result, i;
 	struct iovec iov;
 	struct uio ku;
-	struct addrspace *as;
-
-	as = proc_getas();
+	struct stat st;
+	struct image *im;
 
 	/*
 	 * Read the executable header from offset 0 in the file.
@@ -202,13 +155,22 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return ENOEXEC;
 	}
 
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+
+	im = image_create(v, eh.e_entry, eh.e_phnum);
+	if (im == NULL) {
+		return ENOMEM;
+	}
+
 	/*
-	 * Go through the list of segments and set up the address space.
+	 * Go through the list of segments and record the loadable ones.
 	 *
 	 * Ordinarily there will be one code segment, one read-only
 	 * data segment, and one data/bss segment, but there might
-	 * conceivably be more. You don't need to support such files
-	 * if it's unduly awkward to do so.
+	 * conceivably be more.
 	 *
 	 * Note that the expression eh.e_phoff + i*eh.e_phentsize is
 	 * mandated by the ELF standard - we use sizeof(ph) to load,
@@ -223,12 +185,14 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 
 		result = VOP_READ(v, &ku);
 		if (result) {
+			image_decref(im);
 			return result;
 		}
 
 		if (ku.uio_resid != 0) {
 			/* short read; problem with executable? */
 			kprintf("ELF: short read on phdr - file truncated?\n");
+			image_decref(im);
 			return ENOEXEC;
 		}
 
@@ -240,68 +204,101 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		    default:
 			kprintf("loadelf: unknown segment type %d\n",
 				ph.p_type);
+			image_decref(im);
 			return ENOEXEC;
 		}
 
-		result = as_define_region(as,
-					  ph.p_vaddr, ph.p_memsz,
-					  ph.p_flags & PF_R,
-					  ph.p_flags & PF_W,
-					  ph.p_flags & PF_X);
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > segment memsize\n");
+			ph.p_filesz = ph.p_memsz;
+		}
+		if (ph.p_offset + (off_t)ph.p_filesz > st.st_size) {
+			/* short file; problem with executable? */
+			kprintf("ELF: segment past end of file - file truncated?\n");
+			image_decref(im);
+			return ENOEXEC;
+		}
+
+		result = image_addseg(im, ph.p_vaddr, ph.p_memsz, ph.p_filesz,
+				      ph.p_offset, ph.p_flags);
 		if (result) {
+			image_decref(im);
 			return result;
 		}
 	}
 
-	result = as_prepare_load(as);
-	if (result) {
-		return result;
-	}
+	*ret = im;
+	return 0;
+}
 
-	/*
-	 * Now actually load each segment.
-	 */
+/*
+ * Load an ELF executable user program into the current address space.
+ * The headers are only parsed the first time; after that the program's
+ * image comes from the image cache.
+ *
+ * Returns the entry point (initial PC) for the program in ENTRYPOINT.
+ */
+int
+load_elf(struct vnode *v, vaddr_t *entrypoint)
+{
+	struct image_segment *is;
+	struct addrspace *as;
+	struct image *im;
+	unsigned i;
+	int result;
 
-	for (i=0; i<eh.e_phnum; i++) {
-		off_t offset = eh.e_phoff + i*eh.e_phentsize;
-		uio_kinit(&iov, &ku, &ph, sizeof(ph), offset, UIO_READ);
+	as = proc_getas();
 
-		result = VOP_READ(v, &ku);
+	im = image_lookup(v);
+	if (im == NULL) {
+		result = load_elf_image(v, &im);
 		if (result) {
 			return result;
 		}
+		image_insert(&im);
+	}
 
-		if (ku.uio_resid != 0) {
-			/* short read; problem with executable? */
-			kprintf("ELF: short read on phdr - file truncated?\n");
-			return ENOEXEC;
-		}
+	/*
+	 * Set up the address space: one region per segment, then the
+	 * segments' contents.
+	 */
 
-		switch (ph.p_type) {
-		    case PT_NULL: /* skip */ continue;
-		    case PT_PHDR: /* skip */ continue;
-		    case PT_MIPS_REGINFO: /* skip */ continue;
-		    case PT_LOAD: break;
-		    default:
-			kprintf("loadelf: unknown segment type %d\n",
-				ph.p_type);
-			return ENOEXEC;
+	for (i=0; i<im->im_nsegs; i++) {
+		is = &im->im_segs[i];
+		result = as_define_region(as,
+					  is->is_vaddr, is->is_memsize,
+					  is->is_flags & PF_R,
+					  is->is_flags & PF_W,
+					  is->is_flags & PF_X);
+		if (result) {
+			image_decref(im);
+			return result;
 		}
+	}
+
+	result = as_prepare_load(as);
+	if (result) {
+		image_decref(im);
+		return result;
+	}
 
-		result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
-				      ph.p_memsz, ph.p_filesz,
-				      ph.p_flags & PF_X);
+	for (i=0; i<im->im_nsegs; i++) {
+		result = load_segment(as, im, i);
 		if (result) {
+			image_decref(im);
 			return result;
 		}
 	}
 
 	result = as_complete_load(as);
 	if (result) {
+		image_decref(im);
 		return result;
 	}
 
-	*entrypoint = eh.e_entry;
+	*entrypoint = im->im_entry;
 
+	/* The regions hold their own references. */
+	image_decref(im);
 	return 0;
 }
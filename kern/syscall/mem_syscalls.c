@@ -5,18 +5,196 @@
 #include <current.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/mman.h>
 #include <limits.h>
 #include <filetable.h>
 #include <addrspace.h>
+#include <vnode.h>
+#include <memobj.h>
+#include <copyinout.h>
 #include <mips/trapframe.h>
 #include <kern/wait.h>
 #include <vm.h>
 #include <mips/vm.h>
 
+/*
+ * sbrk: move the heap's break by AMOUNT bytes and return the old
+ * break. New heap pages are only populated when touched.
+ */
 int sys_sbrk(intptr_t amount, void *retval) {
+    vaddr_t old_end;
+    int result;
 
-    /* Unimplemented */
-    (void) amount;
-    (void) retval;
+    result = as_sbrk(proc_getas(), amount, &old_end);
+    if (result) {
+        return result;
+    }
+
+    *(int32_t *)retval = (int32_t)old_end;
+    return 0;
+}
+
+/*
+ * mmap: map LEN bytes of FD from OFFSET, or zero-fill memory with
+ * MAP_ANON, with protection PROT. Exactly one of MAP_SHARED and
+ * MAP_PRIVATE must be given; shared mappings need a file opened
+ * read/write if PROT_WRITE is asked for, and any file mapping needs
+ * one opened for reading. The offset must be page aligned.
+ * MAP_SHARED|MAP_ANON memory is shared with children across fork.
+ */
+int sys_mmap(void *addr, size_t len, int prot, int flags, int fd,
+             off_t offset, int32_t *retval) {
+    struct file *file;
+    struct vnode *vn = NULL;
+    struct memobj *object = NULL;
+    vaddr_t vaddr;
+    int result;
+
+    if ((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0 ||
+        (flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_FIXED | MAP_ANON)) != 0 ||
+        ((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0)) {
+        return EINVAL;
+    }
+    if (len == 0 || (offset & ~(off_t)PAGE_FRAME) != 0 || offset < 0) {
+        return EINVAL;
+    }
+
+    if (flags & MAP_ANON) {
+        if (flags & MAP_SHARED) {
+            object = memobj_anon();
+            if (object == NULL) {
+                return ENOMEM;
+            }
+        }
+    }
+    else {
+        if (fd >= OPEN_MAX || fd < 0) {
+            return EBADF;
+        }
+        lock_acquire(curproc->filetable->lock);
+        file = curproc->filetable->file[fd];
+        if (file == NULL) {
+            lock_release(curproc->filetable->lock);
+            return EBADF;
+        }
+        if ((file->flags & O_ACCMODE) == O_WRONLY ||
+            ((flags & MAP_SHARED) && (prot & PROT_WRITE) &&
+             (file->flags & O_ACCMODE) != O_RDWR)) {
+            lock_release(curproc->filetable->lock);
+            return EACCES;
+        }
+        vn = file->vn;
+        VOP_INCREF(vn);
+        lock_release(curproc->filetable->lock);
+
+        result = VOP_MMAP(vn, offset, len);
+        if (result) {
+            VOP_DECREF(vn);
+            return result;
+        }
+        if (flags & MAP_SHARED) {
+            object = memobj_get(vn);
+            VOP_DECREF(vn);
+            vn = NULL;
+            if (object == NULL) {
+                return ENOMEM;
+            }
+        }
+    }
+
+    /* The mapping takes over our reference to the object */
+    result = as_mmap(proc_getas(), (vaddr_t)addr, len, prot, flags, vn,
+                     object, offset, &vaddr);
+    if (vn != NULL) {
+        VOP_DECREF(vn);
+    }
+    if (result) {
+        return result;
+    }
+
+    *retval = (int32_t)vaddr;
+    return 0;
+}
+
+int sys_munmap(void *addr, size_t len) {
+    return as_munmap(proc_getas(), (vaddr_t)addr, len);
+}
+
+/*
+ * shm_attach: map the shared memory segment called NAME, creating it
+ * LEN bytes long (zero-filled) if there isn't one yet. The segment
+ * stays around after its last mapping until shm_unlink, so unrelated
+ * processes can attach it by name one after another. Detach with
+ * munmap.
+ */
+int sys_shm_attach(const char *name, size_t len, int prot, int32_t *retval) {
+    char kname[NAME_MAX + 1];
+    struct memobj *object;
+    vaddr_t vaddr;
+    int result;
+
+    if ((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0 || len == 0) {
+        return EINVAL;
+    }
+    result = copyinstr((const_userptr_t)name, kname, sizeof(kname), NULL);
+    if (result) {
+        return result;
+    }
+
+    result = memobj_attach(kname, len, &object);
+    if (result) {
+        return result;
+    }
+    result = as_mmap(proc_getas(), 0, len, prot, MAP_SHARED | MAP_ANON,
+                     NULL, object, 0, &vaddr);
+    if (result) {
+        return result;
+    }
+
+    *retval = (int32_t)vaddr;
+    return 0;
+}
+
+/*
+ * shm_unlink: remove the name NAME. Processes that have the segment
+ * mapped keep it until they unmap it.
+ */
+int sys_shm_unlink(const char *name) {
+    char kname[NAME_MAX + 1];
+    int result;
+
+    result = copyinstr((const_userptr_t)name, kname, sizeof(kname), NULL);
+    if (result) {
+        return result;
+    }
+    return memobj_unlink(kname);
+}
+
+int sys_madvise(void *addr, size_t len, int advice) {
+    return as_madvise(proc_getas(), (vaddr_t)addr, len, advice);
+}
+
+/*
+ * mincore: store in VEC, a byte per page of [ADDR, ADDR+LEN), whether
+ * the page is resident.
+ */
+int sys_mincore(void *addr, size_t len, unsigned char *vec) {
+    return as_mincore(proc_getas(), (vaddr_t)addr, len, (userptr_t)vec);
+}
+
+/*
+ * mlock: keep the pages in [ADDR, ADDR+LEN) in memory, faulting them
+ * in now. Locks aren't inherited by fork or kept across exec.
+ */
+int sys_mlock(const void *addr, size_t len) {
+    return as_mlock(proc_getas(), (vaddr_t)addr, len);
+}
+
+int sys_munlock(const void *addr, size_t len) {
+    return as_munlock(proc_getas(), (vaddr_t)addr, len);
+}
+
+int sys_munlockall(void) {
+    as_munlockall(proc_getas());
     return 0;
 }
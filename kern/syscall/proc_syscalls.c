@@ -58,6 +58,8 @@ int sys_fork(struct trapframe *tf, pid_t *retval) {
     proctable->proc[curpid]->exit_signal = cv_create("");
     proctable->proc[curpid]->exited = 0;
     proctable->proc[curpid]->parent_pid = curproc->pid;
+    proctable->proc[curpid]->rss_limit = curproc->rss_limit;
+    proctable->proc[curpid]->memlock_limit = curproc->memlock_limit;
 
     /* Copy, tweak trapframe and copy kernel thread */
     struct trapframe * tf_new = kmalloc(sizeof (struct trapframe));
@@ -403,3 +405,79 @@ void sys__exit(int exitcode) {
 
     thread_exit();
 }
+
+/*
+ * The limits on RESOURCE that P has, or NULL for those that aren't
+ * enforced. Caller must hold P's lock.
+ */
+static struct rlimit *proc_rlimit(struct proc *p, int resource) {
+    switch (resource) {
+        case RLIMIT_MEMLOCK:
+            return &p->memlock_limit;
+        case RLIMIT_RSS:
+            return &p->rss_limit;
+        default:
+            return NULL;
+    }
+}
+
+/*
+ * getrlimit: return the limits on RESOURCE. Only RLIMIT_MEMLOCK and
+ * RLIMIT_RSS are enforced; the others are always unlimited.
+ */
+int sys_getrlimit(int resource, struct rlimit *rlp) {
+    struct rlimit rl, *cur;
+
+    if (resource < 0 || resource >= __RLIMIT_NUM) {
+        return EINVAL;
+    }
+
+    rl.rlim_cur = RLIM_INFINITY;
+    rl.rlim_max = RLIM_INFINITY;
+    lock_acquire(curproc->lock);
+    cur = proc_rlimit(curproc, resource);
+    if (cur != NULL) {
+        rl = *cur;
+    }
+    lock_release(curproc->lock);
+
+    return copyout(&rl, (userptr_t)rlp, sizeof(rl));
+}
+
+/*
+ * setrlimit: set the limits on RESOURCE. The soft limit can't be
+ * above the hard one, and the hard one can only be lowered. A
+ * process over a lowered RLIMIT_RSS gives up pages as it faults;
+ * memory already locked stays locked under a lowered RLIMIT_MEMLOCK.
+ */
+int sys_setrlimit(int resource, const struct rlimit *rlp) {
+    struct rlimit rl, *cur;
+    int result;
+
+    if (resource < 0 || resource >= __RLIMIT_NUM) {
+        return EINVAL;
+    }
+
+    result = copyin((const_userptr_t)rlp, &rl, sizeof(rl));
+    if (result) {
+        return result;
+    }
+    if (rl.rlim_cur > rl.rlim_max) {
+        return EINVAL;
+    }
+
+    lock_acquire(curproc->lock);
+    cur = proc_rlimit(curproc, resource);
+    if (cur == NULL) {
+        lock_release(curproc->lock);
+        /* Can't limit what isn't enforced. */
+        return rl.rlim_cur == RLIM_INFINITY ? 0 : EINVAL;
+    }
+    if (rl.rlim_max > cur->rlim_max) {
+        lock_release(curproc->lock);
+        return EPERM;
+    }
+    *cur = rl;
+    lock_release(curproc->lock);
+    return 0;
+}
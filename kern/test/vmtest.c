@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Tests and benchmarks for the VM system's physical page allocator.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <vm.h>
+#include <test.h>
+
+////////////////////////////////////////////////////////////
+// cmb
+
+/*
+ * Coremap allocation benchmark.
+ *
+ * Runs a fixed alloc/free pattern (a ring of outstanding blocks of
+ * 1-4 pages, oldest freed first) straight through the buddy allocator
+ * with coremap_getppages/coremap_freeppages (alloc_kpages would mostly
+ * measure the page magazines and the pageout check), then replays the
+ * same pattern against a model of the old coremap: a first-fit linear
+ * scan over one byte per page to allocate, and a walk from page 0 to
+ * find the block on free. The model is sized and pre-filled to match
+ * the real coremap so the scans cover the same ground.
+ */
+
+#define CMB_NTRIES	4000
+#define CMB_RING	64
+#define CMB_NSIZES	7
+
+static const unsigned cmb_sizes[CMB_NSIZES] = { 1, 1, 2, 1, 4, 1, 3 };
+
+/* Old-style coremap model: 0 free, 1 in use, 2 in use and end of block */
+static unsigned char *cmb_map;
+static unsigned cmb_npages;
+
+static
+int
+cmb_scan_alloc(unsigned npages)
+{
+	unsigned i, start = 0, sofar = 0;
+
+	for (i = 0; i < cmb_npages; i++) {
+		if (cmb_map[i] == 0) {
+			if (sofar == 0) {
+				start = i;
+			}
+			sofar++;
+			if (sofar == npages) {
+				break;
+			}
+		}
+		else {
+			sofar = 0;
+		}
+	}
+	if (sofar != npages) {
+		return -1;
+	}
+	for (i = start; i < start + npages; i++) {
+		cmb_map[i] = 1;
+	}
+	cmb_map[start + npages - 1] = 2;
+	return start;
+}
+
+static
+void
+cmb_scan_free(unsigned index)
+{
+	unsigned i;
+	int freeing = 0;
+
+	/* The old free_kpages walked the whole coremap from 0. */
+	for (i = 0; i < cmb_npages; i++) {
+		if (i == index) {
+			freeing = 1;
+		}
+		if (freeing) {
+			if (cmb_map[i] == 2) {
+				freeing = 0;
+			}
+			cmb_map[i] = 0;
+		}
+	}
+}
+
+static
+uint64_t
+cmb_elapsed(const struct timespec *before)
+{
+	struct timespec after, duration;
+
+	gettime(&after);
+	timespec_sub(&after, before, &duration);
+	return (uint64_t)duration.tv_sec * 1000000000 + duration.tv_nsec;
+}
+
+static
+void
+cmb_report(const char *name, unsigned ops, uint64_t ns)
+{
+	if (ns == 0) {
+		ns = 1;
+	}
+	kprintf("cmb: %-8s %u ops in %llu us, %llu ops/sec\n", name, ops,
+		(unsigned long long)(ns / 1000),
+		(unsigned long long)((uint64_t)ops * 1000000000 / ns));
+}
+
+int
+coremapbench(int nargs, char **args)
+{
+	paddr_t ring[CMB_RING];
+	int scanring[CMB_RING];
+	struct timespec before;
+	unsigned ntries, i, used, slot, nfree;
+	uint64_t ns;
+
+	ntries = CMB_NTRIES;
+	if (nargs == 2) {
+		ntries = atoi(args[1]);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: cmb [iterations]\n");
+		return EINVAL;
+	}
+
+	cmb_npages = coremap_npages();
+	used = cmb_npages - coremap_nfree();
+	cmb_map = kmalloc(cmb_npages);
+	if (cmb_map == NULL) {
+		kprintf("cmb: out of memory for coremap model\n");
+		return ENOMEM;
+	}
+	kprintf("cmb: %u pages, %u in use, %u iterations\n",
+		cmb_npages, used, ntries);
+
+	/*
+	 * Buddy allocator. Only its own free count is compared after:
+	 * the magazines and zero pool come and go as other cpus run.
+	 */
+	nfree = coremap_nbuddy();
+	for (i = 0; i < CMB_RING; i++) {
+		ring[i] = 0;
+	}
+	gettime(&before);
+	for (i = 0; i < ntries; i++) {
+		slot = i % CMB_RING;
+		if (ring[slot] != 0) {
+			coremap_freeppages(ring[slot]);
+		}
+		ring[slot] = coremap_getppages(cmb_sizes[i % CMB_NSIZES]);
+		if (ring[slot] == 0) {
+			kprintf("cmb: coremap_getppages failed at %u\n", i);
+			break;
+		}
+	}
+	for (i = 0; i < CMB_RING; i++) {
+		if (ring[i] != 0) {
+			coremap_freeppages(ring[i]);
+		}
+	}
+	ns = cmb_elapsed(&before);
+	cmb_report("buddy", ntries * 2, ns);
+	if (coremap_nbuddy() != nfree) {
+		kprintf("cmb: buddy free pages %u before, %u after\n",
+			nfree, coremap_nbuddy());
+	}
+
+	/* Linear-scan model, pre-filled to the same occupancy. */
+	for (i = 0; i < cmb_npages; i++) {
+		cmb_map[i] = i < used ? 1 : 0;
+	}
+	for (i = 0; i < CMB_RING; i++) {
+		scanring[i] = -1;
+	}
+	gettime(&before);
+	for (i = 0; i < ntries; i++) {
+		slot = i % CMB_RING;
+		if (scanring[slot] >= 0) {
+			cmb_scan_free(scanring[slot]);
+		}
+		scanring[slot] = cmb_scan_alloc(cmb_sizes[i % CMB_NSIZES]);
+		if (scanring[slot] < 0) {
+			kprintf("cmb: scan model full at %u\n", i);
+			break;
+		}
+	}
+	for (i = 0; i < CMB_RING; i++) {
+		if (scanring[i] >= 0) {
+			cmb_scan_free(scanring[i]);
+		}
+	}
+	ns = cmb_elapsed(&before);
+	cmb_report("scan", ntries * 2, ns);
+
+	kfree(cmb_map);
+	cmb_map = NULL;
+	return 0;
+}
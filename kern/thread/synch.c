@@ -200,6 +200,24 @@ lock_acquire(struct lock *lock)
     spinlock_release(&lock->lk_spinlock);
 }
 
+bool
+lock_tryacquire(struct lock *lock)
+{
+    bool acquired = false;
+
+    KASSERT(lock != NULL);
+    KASSERT(lock->lk_holder != curthread);
+
+    spinlock_acquire(&lock->lk_spinlock);
+    if (lock->lk_holder == NULL) { //free, so take it
+        lock->lk_holder = curthread;
+        acquired = true;
+    }
+    spinlock_release(&lock->lk_spinlock);
+
+    return acquired;
+}
+
 void
 lock_release(struct lock *lock)
 {
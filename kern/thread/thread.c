@@ -48,6 +48,7 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <mainbus.h>
 #include <vnode.h>
 
@@ -187,6 +188,9 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	pagemag_init(&c->c_pagemag);
+	c->c_asid_cache = ASID_FIRST_VERSION;
+	c->c_asid = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -194,6 +198,7 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_gen = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -234,6 +239,24 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Number of cpus.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+/*
+ * Get a cpu by its software number.
+ */
+struct cpu *
+cpu_get(unsigned num)
+{
+	return cpuarray_get(&allcpus, num);
+}
+
 /*
  * Destroy a thread.
  *
@@ -644,6 +667,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
+			/*
+			 * Zero a few pages ahead of time, then idle as
+			 * usual: interrupts are off until cpu_idle, so
+			 * only one chunk is done per wakeup.
+			 */
+			vm_zeropool_idle();
 			cpu_idle();
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
@@ -1200,26 +1229,58 @@ ipi_broadcast(int code)
 	}
 }
 
-void
+unsigned
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
+	return ipi_tlbshootdown_batch(target, mapping, 1);
+}
+
+unsigned
+ipi_tlbshootdown_batch(struct cpu *target,
+		       const struct tlbshootdown *mappings, unsigned num)
+{
+	unsigned gen, i;
 	int n;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
+	gen = target->c_shootdown_gen;
+
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	if (n == TLBSHOOTDOWN_ALL || num > (unsigned)(TLBSHOOTDOWN_MAX - n)) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
 	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+		for (i=0; i<num; i++) {
+			target->c_shootdown[n+i] = mappings[i];
+		}
+		target->c_numshootdown = n+num;
 	}
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
+
+	return gen;
+}
+
+unsigned
+ipi_tlbshootdown_all(struct cpu *target)
+{
+	unsigned gen;
+
+	spinlock_acquire(&target->c_ipi_lock);
+
+	gen = target->c_shootdown_gen;
+	target->c_numshootdown = TLBSHOOTDOWN_ALL;
+
+	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+	mainbus_send_ipi(target);
+
+	spinlock_release(&target->c_ipi_lock);
+
+	return gen;
 }
 
 void
@@ -1264,8 +1325,14 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_gen++;
 	}
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	/* Outside the IPI lock, since this takes the coremap's. */
+	if (bits & (1U << IPI_PAGEMAG)) {
+		pagemag_flush();
+	}
 }
@@ -237,15 +237,17 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. Devices have no pages the VM system could map; mapping
+ * one would need device memory support that doesn't exist.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v, off_t offset, size_t len)
 {
 	(void)v;
-	return ENOSYS;
+	(void)offset;
+	(void)len;
+	return ENODEV;
 }
 
 /*
@@ -29,14 +29,23 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <synch.h>
 #include <proc.h>
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
+#include <vnode.h>
 #include <vm.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <imagecache.h>
+#include <memobj.h>
+#include <loadctl.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -44,10 +53,218 @@
  * used. The cheesy hack versions in dumbvm.c are used instead.
  */
 
+/*
+ * Region tree.
+ *
+ * Besides the list, which is kept sorted by address, an address
+ * space's regions form an AVL tree keyed on region_base, so the region
+ * for an address is found in O(log n). Faults mostly land in the same
+ * region as the last one, so as->last_region is checked first.
+ *
+ * Regions never overlap, so sorting by base sorts by end as well, and
+ * trimming a region (munmap) never reorders it.
+ */
+
+static
+int
+region_height(struct region *region)
+{
+    return region == NULL ? 0 : region->tree_height;
+}
+
+static
+void
+region_fixheight(struct region *region)
+{
+    int l = region_height(region->left_region);
+    int r = region_height(region->right_region);
+
+    region->tree_height = (l > r ? l : r) + 1;
+}
+
+static
+struct region *
+region_rotate_right(struct region *region)
+{
+    struct region *l = region->left_region;
+
+    region->left_region = l->right_region;
+    l->right_region = region;
+    region_fixheight(region);
+    region_fixheight(l);
+    return l;
+}
+
+static
+struct region *
+region_rotate_left(struct region *region)
+{
+    struct region *r = region->right_region;
+
+    region->right_region = r->left_region;
+    r->left_region = region;
+    region_fixheight(region);
+    region_fixheight(r);
+    return r;
+}
+
+/* Restore the AVL property at REGION; returns the subtree's new root. */
+static
+struct region *
+region_balance(struct region *region)
+{
+    struct region *l, *r;
+    int balance;
+
+    region_fixheight(region);
+    l = region->left_region;
+    r = region->right_region;
+    balance = region_height(l) - region_height(r);
+
+    if (balance > 1) {
+        if (region_height(l->left_region) < region_height(l->right_region)) {
+            region->left_region = region_rotate_left(l);
+        }
+        return region_rotate_right(region);
+    }
+    if (balance < -1) {
+        if (region_height(r->right_region) < region_height(r->left_region)) {
+            region->right_region = region_rotate_right(r);
+        }
+        return region_rotate_left(region);
+    }
+    return region;
+}
+
+static
+struct region *
+region_tree_insert(struct region *root, struct region *region)
+{
+    if (root == NULL) {
+        return region;
+    }
+    if (region->region_base < root->region_base) {
+        root->left_region = region_tree_insert(root->left_region, region);
+    }
+    else {
+        root->right_region = region_tree_insert(root->right_region, region);
+    }
+    return region_balance(root);
+}
+
+/* Unlink the lowest region under ROOT into *MIN. */
+static
+struct region *
+region_tree_removemin(struct region *root, struct region **min)
+{
+    if (root->left_region == NULL) {
+        *min = root;
+        return root->right_region;
+    }
+    root->left_region = region_tree_removemin(root->left_region, min);
+    return region_balance(root);
+}
+
+static
+struct region *
+region_tree_remove(struct region *root, struct region *region)
+{
+    struct region *min, *rest;
+
+    KASSERT(root != NULL);
+
+    if (region->region_base < root->region_base) {
+        root->left_region = region_tree_remove(root->left_region, region);
+    }
+    else if (region->region_base > root->region_base) {
+        root->right_region = region_tree_remove(root->right_region, region);
+    }
+    else {
+        KASSERT(root == region);
+        if (region->right_region == NULL) {
+            return region->left_region;
+        }
+        rest = region_tree_removemin(region->right_region, &min);
+        min->left_region = region->left_region;
+        min->right_region = rest;
+        return region_balance(min);
+    }
+    return region_balance(root);
+}
+
+/* Add REGION to AS's list and tree. */
+static
+void
+as_region_insert(struct addrspace *as, struct region *region)
+{
+    struct region *cur_region, *prev = NULL;
+
+    /* The list predecessor is the last node we go right from */
+    cur_region = as->region_root;
+    while (cur_region != NULL) {
+        if (region->region_base < cur_region->region_base) {
+            cur_region = cur_region->left_region;
+        }
+        else {
+            prev = cur_region;
+            cur_region = cur_region->right_region;
+        }
+    }
+
+    if (prev == NULL) {
+        region->next_region = as->first_region;
+        as->first_region = region;
+    }
+    else {
+        region->next_region = prev->next_region;
+        prev->next_region = region;
+    }
+
+    region->left_region = NULL;
+    region->right_region = NULL;
+    region->tree_height = 1;
+    as->region_root = region_tree_insert(as->region_root, region);
+}
+
+/* Take the region *PREVP points to out of AS's list and tree. */
+static
+void
+as_region_remove(struct addrspace *as, struct region **prevp)
+{
+    struct region *region = *prevp;
+
+    *prevp = region->next_region;
+    as->region_root = region_tree_remove(as->region_root, region);
+    if (as->last_region == region) {
+        as->last_region = NULL;
+    }
+}
+
+/* The lowest region ending at or above VADDR, or NULL. */
+static
+struct region *
+as_region_ceil(struct addrspace *as, vaddr_t vaddr)
+{
+    struct region *cur_region, *found = NULL;
+
+    cur_region = as->region_root;
+    while (cur_region != NULL) {
+        if (cur_region->region_end >= vaddr) {
+            found = cur_region;
+            cur_region = cur_region->left_region;
+        }
+        else {
+            cur_region = cur_region->right_region;
+        }
+    }
+    return found;
+}
+
 struct addrspace *
 as_create(void)
 {
 	struct addrspace *as;
+    unsigned i;
 
 	as = kmalloc(sizeof(struct addrspace));
 	if (as == NULL) {
@@ -58,59 +275,256 @@ as_create(void)
     as->stack_end = 0;
     as->heap_base = 0;
     as->heap_end = 0;
-    as->ptable = NULL;
     as->first_region = NULL;
+    as->region_root = NULL;
+    as->last_region = NULL;
+    as->loading = false;
+    as->heap_history.fh_next = 0;
+    as->heap_history.fh_window = 0;
+    as->heap_history.fh_advice = MADV_NORMAL;
+    as->heap_history.fh_behind = 0;
+    as->rss = 0;
+    as->rss_clock = 0;
+    as->ws_size = 0;
+    as->ws_samples = 0;
+    as->ws_suspended = false;
+    as->ws_next = NULL;
+    as->locked = NULL;
+    as->locked_pages = 0;
+    for (i = 0; i < MAXCPUS; i++) {
+        as->as_asid[i] = 0;
+    }
+
+    as->ptable = pt_create();
+    if (as->ptable == NULL) {
+        kfree(as);
+        return NULL;
+    }
+    as->lock = lock_create("addrspace");
+    if (as->lock == NULL) {
+        pt_destroy(as->ptable);
+        kfree(as);
+        return NULL;
+    }
+    loadctl_add(as);
 
 	return as;
 }
 
+/* Take the references a copy of a region holds. */
+static
+void
+as_region_ref(struct region *region)
+{
+    if (region->vn != NULL) {
+        VOP_INCREF(region->vn);
+    }
+    if (region->image != NULL) {
+        image_incref(region->image);
+    }
+    if (region->object != NULL) {
+        memobj_incref(region->object);
+    }
+}
+
+/* Drop a region's references and free it. */
+static
+void
+as_region_free(struct region *region)
+{
+    if (region->vn != NULL) {
+        VOP_DECREF(region->vn);
+    }
+    if (region->image != NULL) {
+        image_decref(region->image);
+    }
+    if (region->object != NULL) {
+        memobj_decref(region->object);
+    }
+    kfree(region);
+}
+
+/* pt_walk callback: share one page of the parent copy-on-write */
+static
+int
+as_copy_page(vaddr_t vaddr, pte_t *pte, void *data)
+{
+    struct addrspace *newas = data;
+    pte_t *newpte;
+
+    newpte = pt_lookup(newas->ptable, vaddr, true);
+    if (newpte == NULL) {
+        return ENOMEM;
+    }
+
+    if (*pte & PTE_SHARED) {
+        /* Program text and MAP_SHARED pages are shared already */
+        page_incref(*pte & PTE_FRAME);
+    }
+    else if ((*pte & PTE_VALID) && page_iszeroframe(*pte & PTE_FRAME)) {
+        /* Still untouched; the child maps the zero frame on its own */
+        *newpte = 0;
+        return 0;
+    }
+    else if (*pte & PTE_VALID) {
+        page_incref(*pte & PTE_FRAME);
+        *pte = (*pte & ~(PTE_DIRTY | PTE_PREFETCH | PTE_LAZYFREE)) |
+            PTE_COW;
+    }
+    else if (*pte & PTE_SWAPPED) {
+        /* Both share the swap copy; each pages in its own */
+        swap_incref(PTE_SLOT(*pte));
+    }
+    *newpte = *pte;
+    return 0;
+}
+
+/*
+ * Copy an address space for fork. Nothing is copied up front: every
+ * resident frame is shared read-only between parent and child with
+ * its reference count bumped, and whoever writes first gets a
+ * private copy in vm_fault.
+ */
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *newas;
+    struct region *old_region, *new_region;
+    int result;
 
 	newas = as_create();
 	if (newas==NULL) {
 		return ENOMEM;
 	}
-    *ret = newas;
 
-    /* Unimplemented */
-	(void)old;
+    lock_acquire(old->lock);
+
+    for (old_region = old->first_region; old_region;
+         old_region = old_region->next_region) {
+        new_region = kmalloc(sizeof(struct region));
+        if (new_region == NULL) {
+            lock_release(old->lock);
+            as_destroy(newas);
+            return ENOMEM;
+        }
+        *new_region = *old_region;
+        as_region_ref(new_region);
+        as_region_insert(newas, new_region);
+    }
+
+    newas->stack_base = old->stack_base;
+    newas->stack_end = old->stack_end;
+    newas->heap_base = old->heap_base;
+    newas->heap_end = old->heap_end;
+    newas->heap_history.fh_advice = old->heap_history.fh_advice;
+
+    result = pt_walk(old->ptable, 0, USERSPACETOP, as_copy_page, newas);
+
+    lock_release(old->lock);
+
+    /* TLBs may still hold writable entries for the parent's shared pages */
+    vm_tlb_drop_as(old);
+
+    if (result) {
+        as_destroy(newas);
+        return result;
+    }
+
+    *ret = newas;
 	return 0;
 }
 
+/* pt_walk callback: release the frame behind a PTE */
+static
+int
+as_free_page(vaddr_t vaddr, pte_t *pte, void *data)
+{
+    (void)vaddr;
+    (void)data;
+
+    if (*pte & PTE_VALID) {
+        page_free(*pte & PTE_FRAME);
+    }
+    else if (*pte & PTE_SWAPPED) {
+        swap_free(PTE_SLOT(*pte));
+    }
+    *pte = 0;
+    return 0;
+}
+
+/* pt_walk callback: write a page this process dirtied back to its file */
+static
+int
+as_writeback_page(vaddr_t vaddr, pte_t *pte, void *data)
+{
+    struct region *region = data;
+    int result;
+
+    if ((*pte & (PTE_SHARED | PTE_DIRTY)) == (PTE_SHARED | PTE_DIRTY)) {
+        result = memobj_writeback(region->object,
+                                  MEMOBJ_INDEX(region, vaddr));
+        if (result) {
+            kprintf("vm: writing back page at 0x%x: %s\n",
+                    vaddr, strerror(result));
+        }
+    }
+    return 0;
+}
+
+/* NPAGES of AS are no longer locked: give back their reservation */
+static
+void
+as_locked_drop(struct addrspace *as, unsigned npages)
+{
+    KASSERT(as->locked_pages >= npages);
+    as->locked_pages -= npages;
+    page_wire_unreserve(npages);
+}
+
 void
 as_destroy(struct addrspace *as)
 {
-    struct page_entry *cur_page = as->ptable->first_entry;
-    struct page_entry *tmp_page;
-    lock_destroy(as->ptable->lock);
-	while (cur_page) {
-        tmp_page = cur_page->next_page;
-        cur_page->next_page = NULL;
-        kfree(cur_page);
-        cur_page = tmp_page;
+    struct region *cur_region, *tmp_region;
+    struct lockrange *lr;
+
+    loadctl_remove(as);
+    vm_willneed_cancel(as);
+
+    /* Keep the page replacement code out while the frames go */
+    lock_acquire(as->lock);
+    for (cur_region = as->first_region; cur_region;
+         cur_region = cur_region->next_region) {
+        if (cur_region->object != NULL) {
+            pt_walk(as->ptable, cur_region->region_base,
+                    cur_region->region_end + 1, as_writeback_page,
+                    cur_region);
+        }
+    }
+    pt_walk(as->ptable, 0, USERSPACETOP, as_free_page, NULL);
+    KASSERT(as->rss == 0);
+    while ((lr = as->locked) != NULL) {
+        as->locked = lr->lr_next;
+        kfree(lr);
     }
+    as_locked_drop(as, as->locked_pages);
+    lock_release(as->lock);
+    vm_tlb_forget_as(as);
+    pt_destroy(as->ptable);
 
-    struct region *cur_region = as->first_region;
-    struct region *tmp_region;
+    cur_region = as->first_region;
 	while (cur_region) {
         tmp_region = cur_region->next_region;
-        lock_destroy(cur_region->lock);
-        cur_region->next_region = NULL;
-        kfree(cur_region);
+        as_region_free(cur_region);
         cur_region = tmp_region;
     }
 
+    lock_destroy(as->lock);
 	kfree(as);
 }
 
 void
 as_activate(void)
 {
-    /* Function from DUMBVM */
-    int i, spl;
 	struct addrspace *as;
 
 	as = proc_getas();
@@ -122,14 +536,8 @@ as_activate(void)
 		return;
 	}
 
-    /* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
-	splx(spl);
+    /* Tagged with an ASID, its TLB entries survive the switch */
+    vm_tlb_activate(as);
 }
 
 void
@@ -144,63 +552,1052 @@ as_deactivate(void)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment.
+ * Writes to a non-writeable region fault, except while loading.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
 {
-    struct region new_region;
+    struct region *new_region;
 
     sz += vaddr & ~(vaddr_t)PAGE_FRAME;
 	vaddr &= PAGE_FRAME;
 	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
 
+    if (sz == 0 || vaddr + sz > USERSPACETOP || vaddr + sz < vaddr) {
+        return EFAULT;
+    }
+
+    new_region = kmalloc(sizeof(struct region));
+    if (new_region == NULL) {
+        return ENOMEM;
+    }
+
     /* Initialize region values */
-    new_region.region_base = vaddr;
-    new_region.region_end = vaddr + sz - 1;
-    new_region.npages = sz / PAGE_SIZE;
-    new_region.next_region = NULL;
-    new_region.readable = readable;
-    new_region.writeable = writeable;
-    new_region.executable = executable;
-    new_region.lock = lock_create("");
-
-    /* Set first empty region spot to new region */
-    struct region *cur_region = as->first_region;
-    while (cur_region) {
-        cur_region = cur_region->next_region;
-    }
-    *cur_region = new_region;
+    new_region->region_base = vaddr;
+    new_region->region_end = vaddr + sz - 1;
+    new_region->npages = sz / PAGE_SIZE;
+    new_region->readable = readable;
+    new_region->writeable = writeable;
+    new_region->executable = executable;
+    new_region->vn = NULL;
+    new_region->file_base = 0;
+    new_region->file_size = 0;
+    new_region->file_offset = 0;
+    new_region->history.fh_next = 0;
+    new_region->history.fh_window = 0;
+    new_region->history.fh_advice = MADV_NORMAL;
+    new_region->history.fh_behind = 0;
+    new_region->image = NULL;
+    new_region->image_seg = 0;
+    new_region->map_flags = 0;
+    new_region->object = NULL;
+
+    as_region_insert(as, new_region);
 
 	return 0;
 }
 
+int
+as_define_backing(struct addrspace *as, vaddr_t vaddr, struct vnode *v,
+                  off_t offset, size_t filesize)
+{
+    struct region *region;
+
+    if (filesize == 0) {
+        return 0;
+    }
+
+    lock_acquire(as->lock);
+    region = as_find_region(as, vaddr);
+    if (region == NULL || vaddr + filesize - 1 > region->region_end ||
+        vaddr + filesize < vaddr) {
+        lock_release(as->lock);
+        return EFAULT;
+    }
+    if (region->vn != NULL) {
+        /* Only one file range per region */
+        lock_release(as->lock);
+        return EINVAL;
+    }
+
+    VOP_INCREF(v);
+    region->vn = v;
+    region->file_base = vaddr;
+    region->file_size = filesize;
+    region->file_offset = offset;
+    lock_release(as->lock);
+    return 0;
+}
+
+int
+as_define_image(struct addrspace *as, vaddr_t vaddr, struct image *im,
+                unsigned seg)
+{
+    struct region *region;
+
+    lock_acquire(as->lock);
+    region = as_find_region(as, vaddr);
+    if (region == NULL) {
+        lock_release(as->lock);
+        return EFAULT;
+    }
+    if (region->writeable || region->image != NULL) {
+        /* Only read-only pages can be shared */
+        lock_release(as->lock);
+        return EINVAL;
+    }
+
+    image_incref(im);
+    region->image = im;
+    region->image_seg = seg;
+    lock_release(as->lock);
+    return 0;
+}
+
+struct region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+    struct region *cur_region;
+
+    cur_region = as->last_region;
+    if (cur_region != NULL && vaddr >= cur_region->region_base &&
+        vaddr <= cur_region->region_end) {
+        return cur_region;
+    }
+
+    cur_region = as_region_ceil(as, vaddr);
+    if (cur_region == NULL || vaddr < cur_region->region_base) {
+        return NULL;
+    }
+    as->last_region = cur_region;
+    return cur_region;
+}
+
+/*
+ * Is [VADDR, VADDR+LEN) clear of every region and the heap? Caller
+ * holds the lock.
+ */
+static
+bool
+as_range_free(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+    struct region *cur_region;
+
+    if (vaddr + len > USERSPACETOP || vaddr + len < vaddr) {
+        return false;
+    }
+    if (vaddr < as->heap_end && vaddr + len > as->heap_base) {
+        return false;
+    }
+    cur_region = as_region_ceil(as, vaddr);
+    return cur_region == NULL || cur_region->region_base >= vaddr + len;
+}
+
+/*
+ * Find LEN free bytes between the heap and the stack, as high up as
+ * they go, so the heap keeps as much room to grow as it can. Caller
+ * holds the lock.
+ */
+static
+int
+as_find_free(struct addrspace *as, size_t len, vaddr_t *ret)
+{
+    struct region *cur_region;
+    vaddr_t lo, hi;
+    bool found = false;
+
+    /* Walk the gaps upwards from the heap, keeping the highest fit */
+    lo = ROUNDUP(as->heap_end, PAGE_SIZE);
+    for (cur_region = as_region_ceil(as, lo); lo < as->stack_end;
+         cur_region = cur_region->next_region) {
+        hi = as->stack_end;
+        if (cur_region != NULL && cur_region->region_base < hi) {
+            hi = cur_region->region_base;
+        }
+        if (hi >= lo && hi - lo >= len) {
+            *ret = hi - len;
+            found = true;
+        }
+        if (cur_region == NULL) {
+            break;
+        }
+        lo = cur_region->region_end + 1;
+    }
+
+    return found ? 0 : ENOMEM;
+}
+
+/*
+ * Map LEN bytes with protection PROT and MAP_* FLAGS. A MAP_SHARED
+ * mapping maps OBJECT, from OFFSET, and takes over the caller's
+ * reference to it (dropping it on failure). A MAP_PRIVATE mapping is
+ * of VN from OFFSET, or zero-fill if VN is NULL. With MAP_FIXED the
+ * mapping goes at VADDR, which must be page aligned and unused
+ * (existing mappings are not replaced); otherwise VADDR is ignored
+ * and a free range is picked. The address used is returned in *RET.
+ */
+int
+as_mmap(struct addrspace *as, vaddr_t vaddr, size_t len, int prot,
+        int flags, struct vnode *vn, struct memobj *object, off_t offset,
+        vaddr_t *ret)
+{
+    struct region *region;
+    struct stat st;
+    int result;
+
+    KASSERT((object != NULL) == ((flags & MAP_SHARED) != 0));
+    KASSERT(object == NULL || vn == NULL);
+
+    len = (len + PAGE_SIZE - 1) & PAGE_FRAME;
+    if (len == 0) {
+        result = EINVAL;
+        goto fail;
+    }
+    if (vn != NULL) {
+        /* Private pages past the end of the file are zero-fill */
+        result = VOP_STAT(vn, &st);
+        if (result) {
+            goto fail;
+        }
+    }
+
+    lock_acquire(as->lock);
+    if (flags & MAP_FIXED) {
+        result = 0;
+        if ((vaddr & ~(vaddr_t)PAGE_FRAME) != 0 ||
+            !as_range_free(as, vaddr, len)) {
+            result = EINVAL;
+        }
+    }
+    else {
+        result = as_find_free(as, len, &vaddr);
+    }
+    if (result == 0) {
+        result = as_define_region(as, vaddr, len, (prot & PROT_READ) != 0,
+                                  (prot & PROT_WRITE) != 0,
+                                  (prot & PROT_EXEC) != 0);
+    }
+    if (result) {
+        lock_release(as->lock);
+        goto fail;
+    }
+
+    region = as_find_region(as, vaddr);
+    KASSERT(region != NULL);
+    region->map_flags = flags;
+    region->file_base = vaddr;
+    region->file_offset = offset;
+    region->object = object;
+    if (vn != NULL) {
+        VOP_INCREF(vn);
+        region->vn = vn;
+        if (st.st_size > offset) {
+            region->file_size = st.st_size - offset < (off_t)len ?
+                (size_t)(st.st_size - offset) : len;
+        }
+    }
+    lock_release(as->lock);
+
+    *ret = vaddr;
+    return 0;
+
+ fail:
+    if (object != NULL) {
+        memobj_decref(object);
+    }
+    return result;
+}
+
+/* pt_walk callback: queue a page's translation to be shot down */
+static
+int
+as_shootdown_page(vaddr_t vaddr, pte_t *pte, void *data)
+{
+    struct tlb_batch *tb = data;
+
+    if (*pte & PTE_VALID) {
+        vm_tlb_batch_add(tb, vaddr);
+    }
+    return 0;
+}
+
+/* pt_walk callback: let a page that is no longer locked be paged out */
+static
+int
+as_unwire_page(vaddr_t vaddr, pte_t *pte, void *data)
+{
+    (void)vaddr;
+    (void)data;
+
+    if (*pte & PTE_VALID) {
+        page_unwire(*pte & PTE_FRAME);
+    }
+    return 0;
+}
+
+/*
+ * Take [START, END) out of AS's locked ranges and unwire its pages.
+ * Splitting a range needs memory; without it nothing changes and
+ * this returns ENOMEM.
+ */
+static
+int
+as_unlock_range(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+    struct lockrange *lr, **prevp, *tail;
+
+    KASSERT(lock_do_i_hold(as->lock));
+
+    prevp = &as->locked;
+    while ((lr = *prevp) != NULL && lr->lr_start < end) {
+        if (lr->lr_end <= start) {
+            prevp = &lr->lr_next;
+        }
+        else if (lr->lr_start < start && lr->lr_end > end) {
+            /* Unlocking the middle leaves two ranges */
+            tail = kmalloc(sizeof(struct lockrange));
+            if (tail == NULL) {
+                return ENOMEM;
+            }
+            tail->lr_start = end;
+            tail->lr_end = lr->lr_end;
+            tail->lr_next = lr->lr_next;
+            lr->lr_end = start;
+            lr->lr_next = tail;
+            as_locked_drop(as, (end - start) / PAGE_SIZE);
+            break;
+        }
+        else if (lr->lr_start < start) {
+            as_locked_drop(as, (lr->lr_end - start) / PAGE_SIZE);
+            lr->lr_end = start;
+            prevp = &lr->lr_next;
+        }
+        else if (lr->lr_end > end) {
+            as_locked_drop(as, (end - lr->lr_start) / PAGE_SIZE);
+            lr->lr_start = end;
+            break;
+        }
+        else {
+            as_locked_drop(as, (lr->lr_end - lr->lr_start) / PAGE_SIZE);
+            *prevp = lr->lr_next;
+            kfree(lr);
+        }
+    }
+
+    pt_walk(as->ptable, start, end, as_unwire_page, NULL);
+    return 0;
+}
+
+/*
+ * Unmap the pages in [START, END) of REGION (NULL for the heap): write
+ * back what this process dirtied in a shared mapping while the frames
+ * are still mapped, shoot the translations down in one batch, then
+ * free the frames.
+ */
+static
+void
+as_unmap_range(struct addrspace *as, struct region *region,
+               vaddr_t start, vaddr_t end)
+{
+    struct tlb_batch tb;
+
+    KASSERT(lock_do_i_hold(as->lock));
+
+    if (region != NULL && region->object != NULL) {
+        pt_walk(as->ptable, start, end, as_writeback_page, region);
+    }
+    vm_tlb_batch_init(&tb, as);
+    pt_walk(as->ptable, start, end, as_shootdown_page, &tb);
+    vm_tlb_batch_flush(&tb);
+    pt_walk(as->ptable, start, end, as_free_page, NULL);
+}
+
+/*
+ * Remove the mappings in [VADDR, VADDR+LEN), shrinking or splitting
+ * the regions they are in. Only memory from mmap can be unmapped;
+ * parts of the range with nothing mapped are fine.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+    struct region *region, **prevp, *tail;
+    vaddr_t start, end, top;
+
+    len = (len + PAGE_SIZE - 1) & PAGE_FRAME;
+    top = vaddr + len;
+    if ((vaddr & ~(vaddr_t)PAGE_FRAME) != 0 || len == 0 ||
+        top > USERSPACETOP || top < vaddr) {
+        return EINVAL;
+    }
+
+    lock_acquire(as->lock);
+
+    /* Check the whole range before changing anything */
+    for (region = as->first_region; region;
+         region = region->next_region) {
+        if (vaddr <= region->region_end && top > region->region_base &&
+            region->map_flags == 0) {
+            lock_release(as->lock);
+            return EINVAL;
+        }
+    }
+
+    /* Unmapped memory is unlocked too */
+    if (as_unlock_range(as, vaddr, top)) {
+        lock_release(as->lock);
+        return ENOMEM;
+    }
+
+    prevp = &as->first_region;
+    while ((region = *prevp) != NULL) {
+        if (vaddr > region->region_end || top <= region->region_base) {
+            prevp = &region->next_region;
+            continue;
+        }
+        start = vaddr > region->region_base ? vaddr : region->region_base;
+        end = top < region->region_end + 1 ? top : region->region_end + 1;
+
+        /* Unmapping the middle leaves two regions */
+        tail = NULL;
+        if (start > region->region_base && end <= region->region_end) {
+            tail = kmalloc(sizeof(struct region));
+            if (tail == NULL) {
+                lock_release(as->lock);
+                return ENOMEM;
+            }
+        }
+
+        as_unmap_range(as, region, start, end);
+
+        if (start == region->region_base && end == region->region_end + 1) {
+            as_region_remove(as, prevp);
+            as_region_free(region);
+            continue;
+        }
+        if (tail != NULL) {
+            *tail = *region;
+            as_region_ref(tail);
+            tail->region_base = end;
+            tail->npages = (tail->region_end + 1 - end) / PAGE_SIZE;
+            region->region_end = start - 1;
+            as_region_insert(as, tail);
+        }
+        else if (start == region->region_base) {
+            region->region_base = end;
+        }
+        else {
+            region->region_end = start - 1;
+        }
+        region->npages =
+            (region->region_end + 1 - region->region_base) / PAGE_SIZE;
+        prevp = &region->next_region;
+    }
+
+    lock_release(as->lock);
+    return 0;
+}
+
+/*
+ * Move the end of the heap by AMOUNT bytes and return the old end in
+ * *RET. Growing only reserves the addresses; vm_fault fills the pages
+ * on first touch. Shrinking frees every page wholly above the new end.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *ret)
+{
+    vaddr_t old_end, new_end, start, end;
+
+    lock_acquire(as->lock);
+    old_end = as->heap_end;
+    new_end = old_end + amount;
+
+    if (amount < 0) {
+        if (new_end > old_end || new_end < as->heap_base) {
+            lock_release(as->lock);
+            return EINVAL;
+        }
+        start = ROUNDUP(new_end, PAGE_SIZE);
+        end = ROUNDUP(old_end, PAGE_SIZE);
+        if (start < end) {
+            if (as_unlock_range(as, start, end)) {
+                lock_release(as->lock);
+                return ENOMEM;
+            }
+            as_unmap_range(as, NULL, start, end);
+        }
+    }
+    else if (amount > 0) {
+        /* Must not run into the stack or an mmap region */
+        start = ROUNDUP(old_end, PAGE_SIZE);
+        if (new_end < old_end ||
+            (new_end > start && !as_range_free(as, start, new_end - start))) {
+            lock_release(as->lock);
+            return ENOMEM;
+        }
+    }
+
+    as->heap_end = new_end;
+    lock_release(as->lock);
+
+    *ret = old_end;
+    return 0;
+}
+
+/* pt_walk callback: let the pageout code discard a page (MADV_FREE) */
+static
+int
+as_lazyfree_page(vaddr_t vaddr, pte_t *pte, void *data)
+{
+    struct tlb_batch *tb = data;
+
+    if (*pte & PTE_SWAPPED) {
+        /* Nobody needs the swap copy any more */
+        swap_free(PTE_SLOT(*pte));
+        *pte = 0;
+    }
+    else if ((*pte & PTE_VALID) && !(*pte & (PTE_COW | PTE_SHARED))) {
+        /*
+         * Write-protect it so a store brings it back through vm_fault,
+         * and make it the clock's next choice.
+         */
+        *pte = (*pte & ~(PTE_DIRTY | PTE_REF)) | PTE_LAZYFREE;
+        vm_tlb_batch_add(tb, vaddr);
+    }
+    return 0;
+}
+
+/* Take access pattern ADVICE for the memory FH covers */
+static
+void
+as_set_advice(struct fault_history *fh, int advice)
+{
+    fh->fh_advice = advice;
+    fh->fh_window = advice == MADV_SEQUENTIAL ? VM_FAULTAROUND_MAX : 0;
+    fh->fh_behind = 0;
+}
+
+/*
+ * madvise: take ADVICE about the pages in [VADDR, VADDR+LEN), all of
+ * which must be mapped (in a region or the heap).
+ *
+ * MADV_DONTNEED frees them now: anonymous pages read back as zeros,
+ * file pages are read in again, and dirty MAP_SHARED pages are written
+ * back first. MADV_FREE, for anonymous memory only, says the contents
+ * no longer matter: the pages stay mapped, and unless they are written
+ * again the pageout code drops them rather than swapping them.
+ * Neither can be used on locked pages.
+ *
+ * MADV_WILLNEED has the pages brought in in the background (see
+ * vm_willneed). MADV_RANDOM and MADV_SEQUENTIAL say how the memory
+ * will be used, and so how much fault-around should map (see
+ * vm_fault), and MADV_NORMAL goes back to guessing from the faults.
+ * Like the rest of the fault history, they apply to whole regions:
+ * every region the range touches, and the heap.
+ */
+int
+as_madvise(struct addrspace *as, vaddr_t vaddr, size_t len, int advice)
+{
+    struct region *region;
+    struct tlb_batch tb;
+    vaddr_t va, end, start, stop;
+
+    len = (len + PAGE_SIZE - 1) & PAGE_FRAME;
+    end = vaddr + len;
+    if ((vaddr & ~(vaddr_t)PAGE_FRAME) != 0 || end > USERSPACETOP ||
+        end < vaddr) {
+        return EINVAL;
+    }
+    switch (advice) {
+        case MADV_NORMAL:
+        case MADV_RANDOM:
+        case MADV_SEQUENTIAL:
+        case MADV_WILLNEED:
+        case MADV_DONTNEED:
+        case MADV_FREE:
+            break;
+        default:
+            return EINVAL;
+    }
+
+    lock_acquire(as->lock);
+
+    for (va = vaddr; va < end; va += PAGE_SIZE) {
+        region = as_find_region(as, va);
+        if (region == NULL && (va < as->heap_base || va >= as->heap_end)) {
+            lock_release(as->lock);
+            return ENOMEM;
+        }
+        if (advice == MADV_FREE && region != NULL &&
+            (region->vn != NULL || region->object != NULL ||
+             region->image != NULL)) {
+            lock_release(as->lock);
+            return EINVAL;
+        }
+        if ((advice == MADV_DONTNEED || advice == MADV_FREE) &&
+            as->locked != NULL && as_mlocked(as, va)) {
+            lock_release(as->lock);
+            return EINVAL;
+        }
+    }
+
+    if (advice == MADV_DONTNEED) {
+        for (region = as->first_region; region;
+             region = region->next_region) {
+            start = vaddr > region->region_base ?
+                vaddr : region->region_base;
+            stop = end < region->region_end + 1 ?
+                end : region->region_end + 1;
+            if (start < stop) {
+                as_unmap_range(as, region, start, stop);
+            }
+        }
+        start = vaddr > as->heap_base ? vaddr : as->heap_base;
+        stop = ROUNDUP(as->heap_end, PAGE_SIZE);
+        stop = end < stop ? end : stop;
+        if (start < stop) {
+            as_unmap_range(as, NULL, start, stop);
+        }
+    }
+    else if (advice == MADV_FREE) {
+        vm_tlb_batch_init(&tb, as);
+        pt_walk(as->ptable, vaddr, end, as_lazyfree_page, &tb);
+        vm_tlb_batch_flush(&tb);
+    }
+    else if (advice != MADV_WILLNEED) {
+        for (region = as->first_region; region;
+             region = region->next_region) {
+            if (vaddr <= region->region_end && end > region->region_base) {
+                as_set_advice(&region->history, advice);
+            }
+        }
+        if (vaddr < as->heap_end && end > as->heap_base) {
+            as_set_advice(&as->heap_history, advice);
+        }
+    }
+
+    lock_release(as->lock);
+
+    if (advice == MADV_WILLNEED) {
+        /* Not under our lock: the prefetch thread takes it. */
+        vm_willneed(as, vaddr, end);
+    }
+    return 0;
+}
+
+/* Whether every page in [START, END) is in a region or the heap */
+static
+bool
+as_range_mapped(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+    vaddr_t va;
+
+    for (va = start; va < end; va += PAGE_SIZE) {
+        if (as_find_region(as, va) == NULL &&
+            (va < as->heap_base || va >= as->heap_end)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * mincore: set a byte of VEC, in user space, for each page in
+ * [VADDR, VADDR+LEN), all of which must be mapped: 1 if the page is
+ * in memory, 0 if it is swapped out or was never touched. The answer
+ * is gathered a chunk at a time and copied out without our lock held,
+ * since VEC itself may have to be faulted in.
+ */
+int
+as_mincore(struct addrspace *as, vaddr_t vaddr, size_t len, userptr_t vec)
+{
+    unsigned char chunk[64];
+    vaddr_t va, end;
+    unsigned i;
+    pte_t *pte;
+    int result;
+
+    len = (len + PAGE_SIZE - 1) & PAGE_FRAME;
+    end = vaddr + len;
+    if ((vaddr & ~(vaddr_t)PAGE_FRAME) != 0 || end > USERSPACETOP ||
+        end < vaddr) {
+        return EINVAL;
+    }
+
+    for (va = vaddr; va < end; va += i * PAGE_SIZE) {
+        lock_acquire(as->lock);
+        for (i = 0; i < sizeof(chunk) && va + i * PAGE_SIZE < end; i++) {
+            if (!as_range_mapped(as, va + i * PAGE_SIZE,
+                                 va + (i + 1) * PAGE_SIZE)) {
+                lock_release(as->lock);
+                return ENOMEM;
+            }
+            pte = pt_lookup(as->ptable, va + i * PAGE_SIZE, false);
+            chunk[i] = pte != NULL && (*pte & PTE_VALID) ? 1 : 0;
+        }
+        lock_release(as->lock);
+
+        result = copyout(chunk, vec, i);
+        if (result) {
+            return result;
+        }
+        vec += i;
+    }
+    return 0;
+}
+
+bool
+as_mlocked(struct addrspace *as, vaddr_t vaddr)
+{
+    struct lockrange *lr;
+
+    KASSERT(lock_do_i_hold(as->lock));
+
+    for (lr = as->locked; lr != NULL && lr->lr_start <= vaddr;
+         lr = lr->lr_next) {
+        if (vaddr < lr->lr_end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Pages of [START, END) that AS has locked already */
+static
+unsigned
+as_locked_within(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+    struct lockrange *lr;
+    vaddr_t lo, hi;
+    unsigned n = 0;
+
+    for (lr = as->locked; lr != NULL && lr->lr_start < end;
+         lr = lr->lr_next) {
+        lo = start > lr->lr_start ? start : lr->lr_start;
+        hi = end < lr->lr_end ? end : lr->lr_end;
+        if (lo < hi) {
+            n += (hi - lo) / PAGE_SIZE;
+        }
+    }
+    return n;
+}
+
+/*
+ * Lock the parts of [START, END) that AS hasn't locked yet, each as a
+ * range of its own, and return a copy of them in *ADDEDP (an array of
+ * *NADDEDP). Left unmerged, any of them can be unlocked again without
+ * a split, so a failed mlock can always take back what it added.
+ * Returns ENOMEM, having changed nothing.
+ */
+static
+int
+as_lock_gaps(struct addrspace *as, vaddr_t start, vaddr_t end,
+             struct lockrange **addedp, unsigned *naddedp)
+{
+    struct lockrange *lr, **prevp, *added, *new, *spare = NULL;
+    vaddr_t va;
+    unsigned n = 0, i;
+
+    KASSERT(lock_do_i_hold(as->lock));
+
+    va = start;
+    for (lr = as->locked; lr != NULL && lr->lr_start < end;
+         lr = lr->lr_next) {
+        if (lr->lr_end <= va) {
+            continue;
+        }
+        if (lr->lr_start > va) {
+            n++;
+        }
+        va = lr->lr_end;
+    }
+    if (va < end) {
+        n++;
+    }
+    KASSERT(n > 0);
+
+    added = kmalloc(n * sizeof(struct lockrange));
+    if (added == NULL) {
+        return ENOMEM;
+    }
+    for (i = 0; i < n; i++) {
+        new = kmalloc(sizeof(struct lockrange));
+        if (new == NULL) {
+            while ((new = spare) != NULL) {
+                spare = new->lr_next;
+                kfree(new);
+            }
+            kfree(added);
+            return ENOMEM;
+        }
+        new->lr_next = spare;
+        spare = new;
+    }
+
+    i = 0;
+    va = start;
+    prevp = &as->locked;
+    while (va < end) {
+        lr = *prevp;
+        if (lr != NULL && lr->lr_end <= va) {
+            prevp = &lr->lr_next;
+            continue;
+        }
+        if (lr != NULL && lr->lr_start <= va) {
+            va = lr->lr_end;
+            prevp = &lr->lr_next;
+            continue;
+        }
+        new = spare;
+        spare = new->lr_next;
+        new->lr_start = va;
+        new->lr_end = lr != NULL && lr->lr_start < end ? lr->lr_start : end;
+        new->lr_next = lr;
+        *prevp = new;
+        prevp = &new->lr_next;
+        as->locked_pages += (new->lr_end - new->lr_start) / PAGE_SIZE;
+        added[i++] = *new;
+        va = new->lr_end;
+    }
+    KASSERT(i == n && spare == NULL);
+
+    *addedp = added;
+    *naddedp = n;
+    return 0;
+}
+
+/* Merge AS's locked ranges that touch */
+static
+void
+as_lock_merge(struct addrspace *as)
+{
+    struct lockrange *lr, *next;
+
+    KASSERT(lock_do_i_hold(as->lock));
+
+    for (lr = as->locked; lr != NULL; lr = lr->lr_next) {
+        while ((next = lr->lr_next) != NULL &&
+               next->lr_start == lr->lr_end) {
+            lr->lr_end = next->lr_end;
+            lr->lr_next = next->lr_next;
+            kfree(next);
+        }
+    }
+}
+
+/*
+ * mlock: lock [VADDR, VADDR+LEN), all of which must be mapped, in
+ * memory. The range is recorded first, so that vm_fault wires every
+ * frame it maps there from then on, and then each page is faulted in:
+ * as a write where writes are allowed to private memory, so that a
+ * copy-on-write fault can't need a new frame later. Shared frames
+ * (text, MAP_SHARED) are never paged out anyway, and PROT_NONE pages
+ * are left until they can be touched. If a page can't be brought in,
+ * the parts of the range this call locked are unlocked again; parts
+ * an earlier mlock locked stay locked.
+ *
+ * Each process can lock RLIMIT_MEMLOCK bytes (ENOMEM past that), and
+ * all of them together no more than 1/VM_WIRED_DIV of memory (EAGAIN),
+ * so that pinning can't leave the pageout code nothing to take. The
+ * pages are reserved against the global limit before they are locked.
+ */
+int
+as_mlock(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+    struct lockrange *added = NULL;
+    struct region *region;
+    vaddr_t va, end;
+    unsigned npages, nadded = 0, i;
+    rlim_t limit;
+    int faulttype, result;
+
+    KASSERT(as == proc_getas());
+
+    len = (len + PAGE_SIZE - 1) & PAGE_FRAME;
+    end = vaddr + len;
+    if ((vaddr & ~(vaddr_t)PAGE_FRAME) != 0 || end > USERSPACETOP ||
+        end < vaddr) {
+        return EINVAL;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    lock_acquire(curproc->lock);
+    limit = curproc->memlock_limit.rlim_cur / PAGE_SIZE;
+    lock_release(curproc->lock);
+
+    lock_acquire(as->lock);
+    if (!as_range_mapped(as, vaddr, end)) {
+        lock_release(as->lock);
+        return ENOMEM;
+    }
+    npages = len / PAGE_SIZE - as_locked_within(as, vaddr, end);
+    if (npages > 0) {
+        if (as->locked_pages + npages > limit) {
+            lock_release(as->lock);
+            return ENOMEM;
+        }
+        if (!page_wire_reserve(npages)) {
+            lock_release(as->lock);
+            return EAGAIN;
+        }
+        result = as_lock_gaps(as, vaddr, end, &added, &nadded);
+        if (result) {
+            page_wire_unreserve(npages);
+            lock_release(as->lock);
+            return result;
+        }
+    }
+    lock_release(as->lock);
+
+    for (va = vaddr; va < end; va += PAGE_SIZE) {
+        lock_acquire(as->lock);
+        region = as_find_region(as, va);
+        if (region != NULL && !region->readable && !region->writeable) {
+            lock_release(as->lock);
+            continue;
+        }
+        faulttype = region == NULL ||
+            (region->writeable && region->object == NULL) ?
+            VM_FAULT_WRITE : VM_FAULT_READ;
+        lock_release(as->lock);
+
+        result = vm_fault(faulttype, va);
+        if (result) {
+            /* Each added range is whole, so none needs a split */
+            lock_acquire(as->lock);
+            for (i = 0; i < nadded; i++) {
+                as_unlock_range(as, added[i].lr_start, added[i].lr_end);
+            }
+            lock_release(as->lock);
+            kfree(added);
+            /* Unmapped under us */
+            return result == EFAULT ? ENOMEM : result;
+        }
+    }
+
+    if (added != NULL) {
+        lock_acquire(as->lock);
+        as_lock_merge(as);
+        lock_release(as->lock);
+        kfree(added);
+    }
+    return 0;
+}
+
+/*
+ * munlock: unlock [VADDR, VADDR+LEN), all of which must be mapped.
+ * Parts of it that weren't locked are fine.
+ */
+int
+as_munlock(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+    vaddr_t end;
+    int result;
+
+    len = (len + PAGE_SIZE - 1) & PAGE_FRAME;
+    end = vaddr + len;
+    if ((vaddr & ~(vaddr_t)PAGE_FRAME) != 0 || end > USERSPACETOP ||
+        end < vaddr) {
+        return EINVAL;
+    }
+
+    lock_acquire(as->lock);
+    if (!as_range_mapped(as, vaddr, end)) {
+        lock_release(as->lock);
+        return ENOMEM;
+    }
+    result = as_unlock_range(as, vaddr, end);
+    lock_release(as->lock);
+    return result;
+}
+
+void
+as_munlockall(struct addrspace *as)
+{
+    struct lockrange *lr;
+
+    lock_acquire(as->lock);
+    while ((lr = as->locked) != NULL) {
+        pt_walk(as->ptable, lr->lr_start, lr->lr_end, as_unwire_page,
+                NULL);
+        as->locked = lr->lr_next;
+        kfree(lr);
+    }
+    as_locked_drop(as, as->locked_pages);
+    lock_release(as->lock);
+}
+
 int
 as_prepare_load(struct addrspace *as)
 {
-	/* Unimplemented */
-	(void)as;
+    /* Read-only segments stay writable until as_complete_load */
+    lock_acquire(as->lock);
+    as->loading = true;
+    lock_release(as->lock);
 	return 0;
 }
 
+/* pt_walk callback: write-protect a page again after loading */
+static
+int
+as_protect_page(vaddr_t vaddr, pte_t *pte, void *data)
+{
+    (void)vaddr;
+    (void)data;
+
+    *pte &= ~PTE_DIRTY;
+    return 0;
+}
+
 int
 as_complete_load(struct addrspace *as)
 {
-    /* Unimplemented */
-	(void)as;
+    struct region *cur_region;
+    vaddr_t top = 0;
+
+    lock_acquire(as->lock);
+    as->loading = false;
+
+    for (cur_region = as->first_region; cur_region;
+         cur_region = cur_region->next_region) {
+        if (!cur_region->writeable) {
+            pt_walk(as->ptable, cur_region->region_base,
+                    cur_region->region_end + 1, as_protect_page, NULL);
+        }
+        if (cur_region->region_end + 1 > top) {
+            top = cur_region->region_end + 1;
+        }
+    }
+
+    /* The heap starts empty just above the highest segment */
+    as->heap_base = top;
+    as->heap_end = top;
+    lock_release(as->lock);
+
+    /* Drop any writable TLB entries left over from loading */
+    vm_tlb_drop_as(as);
 	return 0;
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
+    int result;
+
+    /* The stack region is populated on demand as it grows down */
+    as->stack_base = USERSTACK;
+    as->stack_end = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
+    result = as_define_region(as, as->stack_end,
+                              VM_STACKPAGES * PAGE_SIZE, 1, 1, 0);
+    if (result) {
+        return result;
+    }
+
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
 
-    /* Unimplemented */
-    (void)as;
 	return 0;
 }
@@ -0,0 +1,390 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vnode.h>
+#include <elf.h>
+#include <vm.h>
+#include <imagecache.h>
+
+/*
+ * Executable image cache. See imagecache.h.
+ *
+ * image_lock covers the cache list, every image's reference count and
+ * every is_frames slot. It is taken after an address space lock, never
+ * before, and nothing allocates memory while holding it, so the
+ * reclaim path can try-lock it from inside an allocation.
+ *
+ * Each frame in an is_frames slot holds one reference for the cache.
+ * The only other ways to get a reference are image_getpage, under the
+ * lock, and fork sharing a mapping that already holds one; so under
+ * the lock a frame with one reference is mapped by nobody and stays
+ * that way.
+ */
+
+static struct lock *image_lock;
+static struct image *image_list;	/* most recently used first */
+
+/* Statistics */
+static unsigned image_nhits;		/* execs that found their image */
+static unsigned image_nmisses;		/* execs that parsed the headers */
+static unsigned image_nshared;		/* faults given a shared frame */
+static unsigned image_nfilled;		/* frames read in and cached */
+static unsigned image_nreclaimed;	/* frames given back */
+
+void
+image_bootstrap(void)
+{
+	image_lock = lock_create("imagecache");
+	if (image_lock == NULL) {
+		panic("image_bootstrap: out of memory\n");
+	}
+}
+
+struct image *
+image_create(struct vnode *vn, vaddr_t entry, unsigned maxsegs)
+{
+	struct image *im;
+
+	im = kmalloc(sizeof(*im));
+	if (im == NULL) {
+		return NULL;
+	}
+	im->im_segs = kmalloc(maxsegs * sizeof(im->im_segs[0]));
+	if (im->im_segs == NULL && maxsegs > 0) {
+		kfree(im);
+		return NULL;
+	}
+	VOP_INCREF(vn);
+	im->im_vn = vn;
+	im->im_entry = entry;
+	im->im_nsegs = 0;
+	im->im_refcount = 1;
+	im->im_cached = false;
+	im->im_next = NULL;
+	return im;
+}
+
+int
+image_addseg(struct image *im, vaddr_t vaddr, size_t memsize,
+	     size_t filesize, off_t offset, int flags)
+{
+	struct image_segment *is;
+	unsigned i;
+
+	KASSERT(!im->im_cached);
+
+	is = &im->im_segs[im->im_nsegs];
+	is->is_vaddr = vaddr;
+	is->is_memsize = memsize;
+	is->is_filesize = filesize;
+	is->is_offset = offset;
+	is->is_flags = flags;
+	is->is_npages = ((vaddr + memsize + PAGE_SIZE - 1) & PAGE_FRAME) -
+		(vaddr & PAGE_FRAME);
+	is->is_npages /= PAGE_SIZE;
+	is->is_frames = NULL;
+
+	if (!(flags & PF_W) && is->is_npages > 0) {
+		is->is_frames = kmalloc(is->is_npages * sizeof(paddr_t));
+		if (is->is_frames == NULL) {
+			return ENOMEM;
+		}
+		for (i = 0; i < is->is_npages; i++) {
+			is->is_frames[i] = 0;
+		}
+	}
+	im->im_nsegs++;
+	return 0;
+}
+
+/* Free an image nobody refers to any more. */
+static
+void
+image_destroy(struct image *im)
+{
+	struct image_segment *is;
+	unsigned i, j;
+
+	KASSERT(im->im_refcount == 0);
+	KASSERT(!im->im_cached);
+
+	for (i = 0; i < im->im_nsegs; i++) {
+		is = &im->im_segs[i];
+		if (is->is_frames == NULL) {
+			continue;
+		}
+		for (j = 0; j < is->is_npages; j++) {
+			if (is->is_frames[j] != 0) {
+				page_free(is->is_frames[j]);
+			}
+		}
+		kfree(is->is_frames);
+	}
+	VOP_DECREF(im->im_vn);
+	kfree(im->im_segs);
+	kfree(im);
+}
+
+/* Take IM off the cache list and return it if that was its last reference. */
+static
+struct image *
+image_uncache(struct image *im, struct image **prevp)
+{
+	KASSERT(lock_do_i_hold(image_lock));
+	KASSERT(*prevp == im && im->im_cached);
+
+	*prevp = im->im_next;
+	im->im_next = NULL;
+	im->im_cached = false;
+	im->im_refcount--;
+	return im->im_refcount == 0 ? im : NULL;
+}
+
+void
+image_insert(struct image **imp)
+{
+	struct image *im = *imp, *cur, **prevp, *drop = NULL, *next;
+	unsigned n;
+
+	lock_acquire(image_lock);
+	for (cur = image_list; cur != NULL; cur = cur->im_next) {
+		if (cur->im_vn == im->im_vn) {
+			/* Lost a race with another exec; use theirs. */
+			cur->im_refcount++;
+			lock_release(image_lock);
+			image_decref(im);
+			*imp = cur;
+			return;
+		}
+	}
+
+	im->im_refcount++;
+	im->im_cached = true;
+	im->im_next = image_list;
+	image_list = im;
+
+	/* Past the limit, drop the oldest images nobody is running. */
+	n = 0;
+	prevp = &image_list;
+	while ((cur = *prevp) != NULL) {
+		n++;
+		if (n > IMAGE_CACHESIZE && cur->im_refcount == 1) {
+			cur = image_uncache(cur, prevp);
+			cur->im_next = drop;
+			drop = cur;
+			continue;
+		}
+		prevp = &cur->im_next;
+	}
+	lock_release(image_lock);
+
+	for (; drop != NULL; drop = next) {
+		next = drop->im_next;
+		image_destroy(drop);
+	}
+}
+
+struct image *
+image_lookup(struct vnode *vn)
+{
+	struct image *im, **prevp;
+
+	lock_acquire(image_lock);
+	for (prevp = &image_list; (im = *prevp) != NULL;
+	     prevp = &im->im_next) {
+		if (im->im_vn == vn) {
+			/* Move to the front. */
+			*prevp = im->im_next;
+			im->im_next = image_list;
+			image_list = im;
+			im->im_refcount++;
+			image_nhits++;
+			lock_release(image_lock);
+			return im;
+		}
+	}
+	image_nmisses++;
+	lock_release(image_lock);
+	return NULL;
+}
+
+void
+image_incref(struct image *im)
+{
+	lock_acquire(image_lock);
+	KASSERT(im->im_refcount > 0);
+	im->im_refcount++;
+	lock_release(image_lock);
+}
+
+void
+image_decref(struct image *im)
+{
+	unsigned refs;
+
+	lock_acquire(image_lock);
+	KASSERT(im->im_refcount > 0);
+	refs = --im->im_refcount;
+	lock_release(image_lock);
+
+	if (refs == 0) {
+		image_destroy(im);
+	}
+}
+
+/* Index of VADDR's page in segment IS. */
+static
+unsigned
+image_pageindex(struct image_segment *is, vaddr_t vaddr)
+{
+	unsigned index;
+
+	index = ((vaddr & PAGE_FRAME) - (is->is_vaddr & PAGE_FRAME)) /
+		PAGE_SIZE;
+	KASSERT(index < is->is_npages);
+	return index;
+}
+
+paddr_t
+image_getpage(struct image *im, unsigned seg, vaddr_t vaddr)
+{
+	struct image_segment *is;
+	paddr_t paddr;
+
+	KASSERT(seg < im->im_nsegs);
+	is = &im->im_segs[seg];
+	KASSERT(is->is_frames != NULL);
+
+	lock_acquire(image_lock);
+	paddr = is->is_frames[image_pageindex(is, vaddr)];
+	if (paddr != 0) {
+		page_incref(paddr);
+		image_nshared++;
+	}
+	lock_release(image_lock);
+	return paddr;
+}
+
+bool
+image_putpage(struct image *im, unsigned seg, vaddr_t vaddr,
+	      paddr_t *paddr)
+{
+	struct image_segment *is;
+	paddr_t *slot, ours = 0;
+
+	KASSERT(seg < im->im_nsegs);
+	is = &im->im_segs[seg];
+	KASSERT(is->is_frames != NULL);
+
+	lock_acquire(image_lock);
+	if (!im->im_cached) {
+		lock_release(image_lock);
+		return false;
+	}
+	slot = &is->is_frames[image_pageindex(is, vaddr)];
+	if (*slot == 0) {
+		/* One reference for the cache, one for the caller. */
+		*slot = *paddr;
+		page_incref(*paddr);
+		image_nfilled++;
+	}
+	else {
+		ours = *paddr;
+		*paddr = *slot;
+		page_incref(*paddr);
+		image_nshared++;
+	}
+	lock_release(image_lock);
+
+	if (ours != 0) {
+		page_free(ours);
+	}
+	return true;
+}
+
+void
+image_invalidate(struct vnode *vn)
+{
+	struct image *im, **prevp, *drop = NULL;
+
+	lock_acquire(image_lock);
+	for (prevp = &image_list; (im = *prevp) != NULL;
+	     prevp = &im->im_next) {
+		if (im->im_vn == vn) {
+			drop = image_uncache(im, prevp);
+			break;
+		}
+	}
+	lock_release(image_lock);
+
+	if (drop != NULL) {
+		image_destroy(drop);
+	}
+}
+
+bool
+image_reclaim(void)
+{
+	paddr_t freed[VM_EVICT_CLUSTER];
+	struct image_segment *is;
+	struct image *im;
+	unsigned pass, i, j, n = 0;
+
+	if (image_lock == NULL || lock_do_i_hold(image_lock) ||
+	    !lock_tryacquire(image_lock)) {
+		return false;
+	}
+
+	/* First images nobody is running, then the rest. */
+	for (pass = 0; pass < 2 && n < VM_EVICT_CLUSTER; pass++) {
+		for (im = image_list; im != NULL && n < VM_EVICT_CLUSTER;
+		     im = im->im_next) {
+			if (pass == 0 && im->im_refcount > 1) {
+				continue;
+			}
+			for (i = 0; i < im->im_nsegs; i++) {
+				is = &im->im_segs[i];
+				if (is->is_frames == NULL) {
+					continue;
+				}
+				for (j = 0; j < is->is_npages &&
+					     n < VM_EVICT_CLUSTER; j++) {
+					if (is->is_frames[j] != 0 &&
+					    page_refcount(is->is_frames[j]) == 1) {
+						freed[n++] = is->is_frames[j];
+						is->is_frames[j] = 0;
+					}
+				}
+			}
+		}
+	}
+	image_nreclaimed += n;
+	lock_release(image_lock);
+
+	for (i = 0; i < n; i++) {
+		page_free(freed[i]);
+	}
+	return n > 0;
+}
+
+void
+image_printstats(void)
+{
+	struct image *im;
+	unsigned n = 0;
+
+	if (image_lock == NULL) {
+		return;
+	}
+	lock_acquire(image_lock);
+	for (im = image_list; im != NULL; im = im->im_next) {
+		n++;
+	}
+	lock_release(image_lock);
+
+	kprintf("images: %u cached, %u exec hits, %u misses\n",
+		n, image_nhits, image_nmisses);
+	kprintf("images: %u frames read, %u faults shared, %u reclaimed\n",
+		image_nfilled, image_nshared, image_nreclaimed);
+}
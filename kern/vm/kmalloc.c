@@ -31,6 +31,10 @@
 #include <lib.h>
 #include <spinlock.h>
 #include <vm.h>
+#include "opt-dumbvm.h"
+#if !OPT_DUMBVM
+#include <vmalloc.h>
+#endif
 
 /*
  * Kernel malloc.
@@ -1158,7 +1162,10 @@ subpage_kfree(void *ptr)
 
 /*
  * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
- * alloc_kpages depending on how big SZ is.
+ * alloc_kpages depending on how big SZ is. Blocks of more than a page
+ * come from alloc_kpages only if a contiguous run is free already;
+ * otherwise they are mapped into kseg2 by vmalloc (see vmalloc.h)
+ * rather than paging things out in the hope of making a run.
  */
 void *
 kmalloc(size_t sz)
@@ -1183,7 +1190,19 @@ kmalloc(size_t sz)
 
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
+#if OPT_DUMBVM
 		address = alloc_kpages(npages);
+#else
+		if (npages == 1) {
+			address = alloc_kpages(1);
+		}
+		else {
+			address = alloc_kpages_nowait(npages);
+			if (address == 0) {
+				address = (vaddr_t)vmalloc(npages);
+			}
+		}
+#endif
 		if (address==0) {
 			return NULL;
 		}
@@ -1210,6 +1229,10 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
+#if !OPT_DUMBVM
+	} else if ((vaddr_t)ptr >= VMALLOC_BASE) {
+		vfree(ptr);
+#endif
 	} else if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
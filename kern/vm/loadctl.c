@@ -0,0 +1,400 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <wchan.h>
+#include <thread.h>
+#include <clock.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <memobj.h>
+#include <loadctl.h>
+
+/*
+ * Working sets and load control. See loadctl.h.
+ *
+ * loadctl_lock covers the list of address spaces and their ws_
+ * fields. It is held across a whole pass, so nothing on the list can
+ * be destroyed under the controller; address space locks are only
+ * try-locked inside it, as the clock does, so a pass never waits on a
+ * fault in progress. ws_suspended is also covered by loadctl_splk,
+ * which suspended faults sleep on.
+ */
+
+static struct lock *loadctl_lock;
+static struct addrspace *loadctl_list;
+static unsigned loadctl_seq;		/* next ws_seq */
+static struct spinlock loadctl_splk = SPINLOCK_INITIALIZER;
+static struct wchan *loadctl_wchan;	/* suspended faults wait here */
+
+/* Statistics */
+static unsigned loadctl_npasses;	/* samples taken */
+static unsigned loadctl_nsuspends;	/* processes suspended */
+static unsigned loadctl_nresumes;	/* processes let back in */
+static unsigned loadctl_nswapped;	/* frames swapped out suspending */
+static unsigned loadctl_nstalls;	/* faults that slept suspended */
+static unsigned loadctl_nunmapped;	/* file pages unmapped for pageout */
+static unsigned loadctl_wstotal;	/* running working sets, last pass */
+static unsigned loadctl_capacity;	/* room for them, last pass */
+
+void
+loadctl_add(struct addrspace *as)
+{
+	lock_acquire(loadctl_lock);
+	as->ws_seq = loadctl_seq++;
+	as->ws_next = loadctl_list;
+	loadctl_list = as;
+	lock_release(loadctl_lock);
+}
+
+void
+loadctl_remove(struct addrspace *as)
+{
+	struct addrspace **prevp;
+
+	lock_acquire(loadctl_lock);
+	for (prevp = &loadctl_list; *prevp != as;
+	     prevp = &(*prevp)->ws_next) {
+		KASSERT(*prevp != NULL);
+	}
+	*prevp = as->ws_next;
+	lock_release(loadctl_lock);
+}
+
+void
+loadctl_wait(struct addrspace *as)
+{
+	spinlock_acquire(&loadctl_splk);
+	if (as->ws_suspended) {
+		loadctl_nstalls++;
+		while (as->ws_suspended) {
+			wchan_sleep(loadctl_wchan, &loadctl_splk);
+		}
+	}
+	spinlock_release(&loadctl_splk);
+}
+
+struct loadctl_sample {
+	struct tlb_batch ls_tb;		/* translations to drop */
+	unsigned ls_count;		/* pages in the working set */
+};
+
+static
+int
+loadctl_sample_page(vaddr_t vaddr, pte_t *pte, void *data)
+{
+	struct loadctl_sample *ls = data;
+	unsigned age;
+
+	if ((*pte & (PTE_VALID | PTE_SHARED)) != PTE_VALID ||
+	    page_iszeroframe(*pte & PTE_FRAME)) {
+		return 0;
+	}
+	if (*pte & PTE_REF) {
+		*pte &= ~(PTE_REF | PTE_AGE);
+		vm_tlb_batch_add(&ls->ls_tb, vaddr);
+		ls->ls_count++;
+		return 0;
+	}
+	age = *pte & PTE_AGE;
+	if (age < LOADCTL_WINDOW) {
+		age++;
+		*pte = (*pte & ~PTE_AGE) | age;
+		if (age < LOADCTL_WINDOW) {
+			ls->ls_count++;
+		}
+	}
+	return 0;
+}
+
+/* Update AS's working set, unless it is busy; then the old one stands. */
+static
+void
+loadctl_sample(struct addrspace *as)
+{
+	struct loadctl_sample ls;
+
+	if (!lock_tryacquire(as->lock)) {
+		return;
+	}
+	ls.ls_count = 0;
+	vm_tlb_batch_init(&ls.ls_tb, as);
+	pt_walk(as->ptable, 0, USERSPACETOP, loadctl_sample_page, &ls);
+	vm_tlb_batch_flush(&ls.ls_tb);
+	lock_release(as->lock);
+
+	as->ws_size = ls.ls_count;
+}
+
+struct loadctl_trim {
+	struct addrspace *lt_as;
+	struct tlb_batch lt_tb;		/* translations to drop */
+	unsigned lt_count;		/* pages looked at */
+	unsigned lt_unmapped;		/* pages unmapped */
+};
+
+static
+int
+loadctl_trim_page(vaddr_t vaddr, pte_t *pte, void *data)
+{
+	struct loadctl_trim *lt = data;
+
+	if (!(*pte & PTE_VALID) || as_mlocked(lt->lt_as, vaddr)) {
+		return 0;
+	}
+	KASSERT(*pte & PTE_SHARED);
+	lt->lt_count++;
+	if (*pte & PTE_REF) {
+		*pte &= ~PTE_REF;
+		vm_tlb_batch_add(&lt->lt_tb, vaddr);
+		return 0;
+	}
+	/* The object has recorded any store; it keeps the frame. */
+	vm_tlb_shootdown(lt->lt_as, vaddr);
+	page_free(*pte & PTE_FRAME);
+	*pte = 0;
+	lt->lt_unmapped++;
+	return 0;
+}
+
+/* Second-chance pass over AS's mappings of files' memory objects. */
+static
+void
+loadctl_trim(struct addrspace *as, struct loadctl_trim *lt)
+{
+	struct region *region;
+
+	if (!lock_tryacquire(as->lock)) {
+		return;
+	}
+	lt->lt_as = as;
+	vm_tlb_batch_init(&lt->lt_tb, as);
+	for (region = as->first_region; region != NULL;
+	     region = region->next_region) {
+		if (region->object != NULL && region->object->mo_vn != NULL) {
+			pt_walk(as->ptable, region->region_base,
+				region->region_end + 1, loadctl_trim_page, lt);
+		}
+	}
+	vm_tlb_batch_flush(&lt->lt_tb);
+	lock_release(as->lock);
+}
+
+unsigned
+loadctl_trim_shared(void)
+{
+	struct loadctl_trim lt;
+	struct addrspace *as;
+
+	/* A pass may be waiting on the pageout daemon; don't wait for it. */
+	if (loadctl_lock == NULL || !lock_tryacquire(loadctl_lock)) {
+		return 0;
+	}
+	lt.lt_count = 0;
+	lt.lt_unmapped = 0;
+	for (as = loadctl_list; as != NULL; as = as->ws_next) {
+		loadctl_trim(as, &lt);
+	}
+	loadctl_nunmapped += lt.lt_unmapped;
+	lock_release(loadctl_lock);
+	return lt.lt_count;
+}
+
+static
+bool
+loadctl_suspend(struct addrspace *as)
+{
+	unsigned n;
+
+	if (!lock_tryacquire(as->lock)) {
+		return false;
+	}
+	spinlock_acquire(&loadctl_splk);
+	as->ws_suspended = true;
+	spinlock_release(&loadctl_splk);
+
+	n = vm_swapout(as);
+	/* Shared text may still be in TLBs; the next refill catches it. */
+	vm_tlb_drop_as(as);
+	lock_release(as->lock);
+
+	as->ws_samples = 0;
+	loadctl_nsuspends++;
+	loadctl_nswapped += n;
+	return true;
+}
+
+static
+void
+loadctl_resume(struct addrspace *as)
+{
+	spinlock_acquire(&loadctl_splk);
+	as->ws_suspended = false;
+	wchan_wakeall(loadctl_wchan, &loadctl_splk);
+	spinlock_release(&loadctl_splk);
+
+	as->ws_samples = 0;
+	loadctl_nresumes++;
+}
+
+/*
+ * The running process to suspend next: the newest that has had
+ * LOADCTL_MINRUN samples to run since it was last let in.
+ */
+static
+struct addrspace *
+loadctl_victim(void)
+{
+	struct addrspace *as, *victim = NULL;
+
+	for (as = loadctl_list; as != NULL; as = as->ws_next) {
+		if (as->ws_suspended || as->ws_samples < LOADCTL_MINRUN) {
+			continue;
+		}
+		if (victim == NULL || as->ws_seq > victim->ws_seq) {
+			victim = as;
+		}
+	}
+	return victim;
+}
+
+/*
+ * The suspended process to let in next: any that has waited
+ * LOADCTL_MAXSUSPEND samples, else the oldest. *OVERDUE says which.
+ */
+static
+struct addrspace *
+loadctl_next(bool *overdue)
+{
+	struct addrspace *as, *next = NULL;
+
+	*overdue = false;
+	for (as = loadctl_list; as != NULL; as = as->ws_next) {
+		if (!as->ws_suspended) {
+			continue;
+		}
+		if (as->ws_samples >= LOADCTL_MAXSUSPEND) {
+			*overdue = true;
+			return as;
+		}
+		if (next == NULL || as->ws_seq < next->ws_seq) {
+			next = as;
+		}
+	}
+	return next;
+}
+
+static
+void
+loadctl_pass(void)
+{
+	struct addrspace *as;
+	unsigned total = 0, owned = 0, nrunning = 0, reserve, capacity;
+	bool overdue;
+
+	lock_acquire(loadctl_lock);
+	for (as = loadctl_list; as != NULL; as = as->ws_next) {
+		owned += as->rss;
+		as->ws_samples++;
+		if (as->ws_suspended) {
+			continue;
+		}
+		loadctl_sample(as);
+		total += as->ws_size;
+		nrunning++;
+	}
+
+	/* What the running processes could have between them. */
+	reserve = coremap_npages() / VM_FREEHIGH_DIV;
+	capacity = coremap_nfree() + owned;
+	capacity = capacity > reserve ? capacity - reserve : 0;
+
+	if (swap_enabled()) {
+		while (total > capacity && nrunning > 1) {
+			as = loadctl_victim();
+			if (as == NULL || !loadctl_suspend(as)) {
+				break;
+			}
+			total -= as->ws_size;
+			nrunning--;
+		}
+	}
+	while ((as = loadctl_next(&overdue)) != NULL) {
+		if (!overdue && total + as->ws_size > capacity) {
+			break;
+		}
+		loadctl_resume(as);
+		total += as->ws_size;
+		nrunning++;
+	}
+
+	loadctl_wstotal = total;
+	loadctl_capacity = capacity;
+	loadctl_npasses++;
+	lock_release(loadctl_lock);
+}
+
+static
+void
+loadctl_thread(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(LOADCTL_INTERVAL);
+		loadctl_pass();
+	}
+}
+
+void
+loadctl_bootstrap(void)
+{
+	int result;
+
+	loadctl_lock = lock_create("loadctl");
+	loadctl_wchan = wchan_create("loadctl");
+	if (loadctl_lock == NULL || loadctl_wchan == NULL) {
+		panic("loadctl_bootstrap: out of memory\n");
+	}
+	result = thread_fork("loadctl", NULL, loadctl_thread, NULL, 0);
+	if (result) {
+		panic("loadctl_bootstrap: thread_fork: %s\n",
+		      strerror(result));
+	}
+}
+
+void
+loadctl_printstats(void)
+{
+	struct addrspace *as;
+	unsigned nrunning = 0, nsuspended = 0;
+
+	if (loadctl_lock == NULL) {
+		return;
+	}
+	lock_acquire(loadctl_lock);
+	for (as = loadctl_list; as != NULL; as = as->ws_next) {
+		if (as->ws_suspended) {
+			nsuspended++;
+		}
+		else {
+			nrunning++;
+		}
+	}
+	lock_release(loadctl_lock);
+
+	kprintf("loadctl: %u samples, working sets %u of %u pages\n",
+		loadctl_npasses, loadctl_wstotal, loadctl_capacity);
+	kprintf("loadctl: %u running, %u suspended; %u suspensions, "
+		"%u resumptions, %u frames swapped out\n", nrunning,
+		nsuspended, loadctl_nsuspends, loadctl_nresumes,
+		loadctl_nswapped);
+	kprintf("loadctl: %u faults slept while suspended\n",
+		loadctl_nstalls);
+	kprintf("loadctl: %u file pages unmapped for the pageout daemon\n",
+		loadctl_nunmapped);
+}
@@ -0,0 +1,624 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vm.h>
+#include <imagecache.h>
+#include <memobj.h>
+
+/*
+ * Memory objects. See memobj.h.
+ *
+ * memobj_lock covers the object list and everything in every object.
+ * It is taken after an address space lock, never before, and is only
+ * held briefly: a page being read in or written back is marked busy
+ * instead and the lock dropped for the I/O. Anyone else who wants that
+ * page waits on memobj_cv until it is done, so two faults on the same
+ * page can't both read it in, while faults on other pages go ahead.
+ * Walks of the object list hold a reference to the current object,
+ * so they can drop the lock too.
+ */
+
+static struct lock *memobj_lock;
+static struct cv *memobj_cv;		/* busy pages are waited for here */
+static struct memobj *memobj_list;
+
+/* Statistics */
+static unsigned memobj_nreads;		/* pages read in */
+static unsigned memobj_nwrites;		/* pages written back */
+static unsigned memobj_nreclaimed;	/* unmapped frames given back */
+
+void
+memobj_bootstrap(void)
+{
+	memobj_lock = lock_create("memobj");
+	memobj_cv = cv_create("memobj");
+	if (memobj_lock == NULL || memobj_cv == NULL) {
+		panic("memobj_bootstrap: out of memory\n");
+	}
+}
+
+/*
+ * Make an object for VN (NULL for anonymous memory) with one reference
+ * and put it on the list. Caller holds the lock.
+ */
+static
+struct memobj *
+memobj_create(struct vnode *vn)
+{
+	struct memobj *mo;
+
+	KASSERT(lock_do_i_hold(memobj_lock));
+
+	mo = kmalloc(sizeof(*mo));
+	if (mo == NULL) {
+		return NULL;
+	}
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	mo->mo_vn = vn;
+	mo->mo_name = NULL;
+	mo->mo_size = 0;
+	mo->mo_npages = 0;
+	mo->mo_frames = NULL;
+	mo->mo_dirty = NULL;
+	mo->mo_busy = NULL;
+	mo->mo_refcount = 1;
+	mo->mo_next = memobj_list;
+	memobj_list = mo;
+	return mo;
+}
+
+struct memobj *
+memobj_get(struct vnode *vn)
+{
+	struct memobj *mo;
+
+	lock_acquire(memobj_lock);
+	for (mo = memobj_list; mo != NULL; mo = mo->mo_next) {
+		if (mo->mo_vn == vn) {
+			mo->mo_refcount++;
+			lock_release(memobj_lock);
+			return mo;
+		}
+	}
+
+	mo = memobj_create(vn);
+	lock_release(memobj_lock);
+	return mo;
+}
+
+struct memobj *
+memobj_anon(void)
+{
+	struct memobj *mo;
+
+	lock_acquire(memobj_lock);
+	mo = memobj_create(NULL);
+	lock_release(memobj_lock);
+	return mo;
+}
+
+int
+memobj_attach(const char *name, size_t len, struct memobj **ret)
+{
+	struct memobj *mo;
+
+	lock_acquire(memobj_lock);
+	for (mo = memobj_list; mo != NULL; mo = mo->mo_next) {
+		if (mo->mo_name != NULL && !strcmp(mo->mo_name, name)) {
+			if (len > mo->mo_size) {
+				lock_release(memobj_lock);
+				return EINVAL;
+			}
+			mo->mo_refcount++;
+			lock_release(memobj_lock);
+			*ret = mo;
+			return 0;
+		}
+	}
+
+	mo = memobj_create(NULL);
+	if (mo == NULL) {
+		lock_release(memobj_lock);
+		return ENOMEM;
+	}
+	mo->mo_name = kstrdup(name);
+	if (mo->mo_name == NULL) {
+		lock_release(memobj_lock);
+		memobj_decref(mo);
+		return ENOMEM;
+	}
+	mo->mo_size = len;
+	/* One for the name, one for the caller. */
+	mo->mo_refcount++;
+	lock_release(memobj_lock);
+
+	*ret = mo;
+	return 0;
+}
+
+int
+memobj_unlink(const char *name)
+{
+	struct memobj *mo;
+
+	lock_acquire(memobj_lock);
+	for (mo = memobj_list; mo != NULL; mo = mo->mo_next) {
+		if (mo->mo_name != NULL && !strcmp(mo->mo_name, name)) {
+			break;
+		}
+	}
+	if (mo == NULL) {
+		lock_release(memobj_lock);
+		return ENOENT;
+	}
+	kfree(mo->mo_name);
+	mo->mo_name = NULL;
+	lock_release(memobj_lock);
+
+	/* Drop the name's reference. */
+	memobj_decref(mo);
+	return 0;
+}
+
+void
+memobj_incref(struct memobj *mo)
+{
+	lock_acquire(memobj_lock);
+	KASSERT(mo->mo_refcount > 0);
+	mo->mo_refcount++;
+	lock_release(memobj_lock);
+}
+
+/* Wait until page INDEX is not busy. Caller holds the lock. */
+static
+void
+memobj_wait(struct memobj *mo, unsigned index)
+{
+	KASSERT(lock_do_i_hold(memobj_lock));
+
+	while (index < mo->mo_npages && mo->mo_busy[index]) {
+		cv_wait(memobj_cv, memobj_lock);
+	}
+}
+
+/* Finish with busy page INDEX. Caller holds the lock. */
+static
+void
+memobj_unbusy(struct memobj *mo, unsigned index)
+{
+	KASSERT(lock_do_i_hold(memobj_lock));
+	KASSERT(mo->mo_busy[index]);
+
+	mo->mo_busy[index] = false;
+	cv_broadcast(memobj_cv, memobj_lock);
+}
+
+/*
+ * Write frame PADDR, page INDEX, to the file. The caller has made the
+ * page busy, or holds the last reference to the object, and does not
+ * hold the lock.
+ */
+static
+int
+memobj_write(struct memobj *mo, unsigned index, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	off_t pos;
+	size_t len;
+	int result;
+
+	KASSERT(!lock_do_i_hold(memobj_lock));
+	KASSERT(paddr != 0);
+
+	if (mo->mo_vn == NULL) {
+		return 0;
+	}
+
+	/* Mapping a file never makes it longer. */
+	result = VOP_STAT(mo->mo_vn, &st);
+	if (result) {
+		return result;
+	}
+	pos = (off_t)index * PAGE_SIZE;
+	if (pos >= st.st_size) {
+		return 0;
+	}
+	len = PAGE_SIZE;
+	if (st.st_size - pos < (off_t)len) {
+		len = st.st_size - pos;
+	}
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr),
+		  len, pos, UIO_WRITE);
+	result = VOP_WRITE(mo->mo_vn, &ku);
+	if (result) {
+		return result;
+	}
+	image_invalidate(mo->mo_vn);
+	memobj_nwrites++;
+	return 0;
+}
+
+void
+memobj_decref(struct memobj *mo)
+{
+	struct memobj **prevp;
+	unsigned i;
+	int result;
+
+	lock_acquire(memobj_lock);
+	KASSERT(mo->mo_refcount > 0);
+	if (--mo->mo_refcount > 0) {
+		lock_release(memobj_lock);
+		return;
+	}
+
+	for (prevp = &memobj_list; *prevp != mo; prevp = &(*prevp)->mo_next) {
+		KASSERT(*prevp != NULL);
+	}
+	*prevp = mo->mo_next;
+	lock_release(memobj_lock);
+
+	/* Nobody else can get at it now. */
+	for (i = 0; i < mo->mo_npages; i++) {
+		KASSERT(!mo->mo_busy[i]);
+		if (mo->mo_frames[i] == 0) {
+			continue;
+		}
+		if (mo->mo_dirty[i]) {
+			result = memobj_write(mo, i, mo->mo_frames[i]);
+			if (result) {
+				kprintf("memobj: writing back page %u: %s\n",
+					i, strerror(result));
+			}
+		}
+		page_free(mo->mo_frames[i]);
+	}
+
+	KASSERT(mo->mo_name == NULL);
+	if (mo->mo_vn != NULL) {
+		VOP_DECREF(mo->mo_vn);
+	}
+	kfree(mo->mo_frames);
+	kfree(mo->mo_dirty);
+	kfree(mo->mo_busy);
+	kfree(mo);
+}
+
+/* Make room for page INDEX. Caller holds the lock. */
+static
+int
+memobj_grow(struct memobj *mo, unsigned index)
+{
+	paddr_t *frames;
+	bool *dirty, *busy;
+	unsigned n, i;
+
+	KASSERT(lock_do_i_hold(memobj_lock));
+
+	if (index < mo->mo_npages) {
+		return 0;
+	}
+	n = mo->mo_npages * 2;
+	if (n <= index) {
+		n = index + 1;
+	}
+	frames = kmalloc(n * sizeof(frames[0]));
+	dirty = kmalloc(n * sizeof(dirty[0]));
+	busy = kmalloc(n * sizeof(busy[0]));
+	if (frames == NULL || dirty == NULL || busy == NULL) {
+		kfree(frames);
+		kfree(dirty);
+		kfree(busy);
+		return ENOMEM;
+	}
+	for (i = 0; i < n; i++) {
+		frames[i] = i < mo->mo_npages ? mo->mo_frames[i] : 0;
+		dirty[i] = i < mo->mo_npages ? mo->mo_dirty[i] : false;
+		busy[i] = i < mo->mo_npages ? mo->mo_busy[i] : false;
+	}
+	kfree(mo->mo_frames);
+	kfree(mo->mo_dirty);
+	kfree(mo->mo_busy);
+	mo->mo_frames = frames;
+	mo->mo_dirty = dirty;
+	mo->mo_busy = busy;
+	mo->mo_npages = n;
+	return 0;
+}
+
+int
+memobj_getpage(struct memobj *mo, unsigned index, bool wait, paddr_t *ret)
+{
+	struct iovec iov;
+	struct uio ku;
+	paddr_t paddr;
+	int result;
+
+	lock_acquire(memobj_lock);
+	result = memobj_grow(mo, index);
+	if (result) {
+		lock_release(memobj_lock);
+		return result;
+	}
+	memobj_wait(mo, index);
+
+	paddr = mo->mo_frames[index];
+	if (paddr == 0) {
+		mo->mo_busy[index] = true;
+		lock_release(memobj_lock);
+
+		paddr = wait ? page_alloc() : page_alloc_nowait();
+		if (paddr == 0) {
+			result = ENOMEM;
+		}
+		else if (mo->mo_vn != NULL) {
+			/* Past the end of the file is zeros. */
+			uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr),
+				  PAGE_SIZE, (off_t)index * PAGE_SIZE, UIO_READ);
+			result = VOP_READ(mo->mo_vn, &ku);
+			if (result) {
+				page_free(paddr);
+			}
+			else {
+				memobj_nreads++;
+			}
+		}
+
+		lock_acquire(memobj_lock);
+		memobj_unbusy(mo, index);
+		if (result) {
+			lock_release(memobj_lock);
+			return result;
+		}
+		mo->mo_frames[index] = paddr;
+		mo->mo_dirty[index] = false;
+	}
+	page_incref(paddr);
+	lock_release(memobj_lock);
+
+	*ret = paddr;
+	return 0;
+}
+
+void
+memobj_dirty(struct memobj *mo, unsigned index)
+{
+	lock_acquire(memobj_lock);
+	KASSERT(index < mo->mo_npages && mo->mo_frames[index] != 0);
+	mo->mo_dirty[index] = true;
+	lock_release(memobj_lock);
+}
+
+/*
+ * Write page INDEX back and clear its mark. A mapping may still be
+ * writable and store to the page without faulting again, so the mark
+ * stays until the object's own reference is the only one left. New
+ * mappings start in memobj_getpage, so that can't change while we
+ * hold the lock; the mark is cleared before the write, and a mapping
+ * made and stored through meanwhile just sets it again. Caller holds
+ * the lock and the page is resident and not busy; the lock is dropped
+ * for the write.
+ */
+static
+int
+memobj_clean(struct memobj *mo, unsigned index)
+{
+	paddr_t paddr;
+	bool mapped;
+	int result;
+
+	KASSERT(mo->mo_frames[index] != 0 && !mo->mo_busy[index]);
+
+	paddr = mo->mo_frames[index];
+	mapped = page_refcount(paddr) > 1;
+	if (!mapped) {
+		mo->mo_dirty[index] = false;
+	}
+	mo->mo_busy[index] = true;
+	lock_release(memobj_lock);
+
+	result = memobj_write(mo, index, paddr);
+
+	lock_acquire(memobj_lock);
+	memobj_unbusy(mo, index);
+	if (result && !mapped) {
+		mo->mo_dirty[index] = true;
+	}
+	return result;
+}
+
+int
+memobj_writeback(struct memobj *mo, unsigned index)
+{
+	int result = 0;
+
+	lock_acquire(memobj_lock);
+	memobj_wait(mo, index);
+	if (index < mo->mo_npages && mo->mo_frames[index] != 0) {
+		result = memobj_clean(mo, index);
+	}
+	lock_release(memobj_lock);
+	return result;
+}
+
+/*
+ * Step from MO, which the caller holds a reference to, to the next
+ * object on the list, and return that with a reference of its own
+ * (NULL at the end). Caller holds the lock; it is dropped to let MO go.
+ */
+static
+struct memobj *
+memobj_next(struct memobj *mo)
+{
+	struct memobj *next;
+
+	next = mo->mo_next;
+	if (next != NULL) {
+		next->mo_refcount++;
+	}
+	lock_release(memobj_lock);
+	memobj_decref(mo);
+	lock_acquire(memobj_lock);
+	return next;
+}
+
+void
+memobj_sync(void)
+{
+	struct memobj *mo;
+	unsigned i;
+	int result;
+
+	lock_acquire(memobj_lock);
+	mo = memobj_list;
+	if (mo != NULL) {
+		mo->mo_refcount++;
+	}
+	for (; mo != NULL; mo = memobj_next(mo)) {
+		for (i = 0; i < mo->mo_npages; i++) {
+			memobj_wait(mo, i);
+			if (mo->mo_frames[i] == 0 || !mo->mo_dirty[i]) {
+				continue;
+			}
+			result = memobj_clean(mo, i);
+			if (result) {
+				kprintf("memobj: sync: page %u: %s\n",
+					i, strerror(result));
+			}
+		}
+	}
+	lock_release(memobj_lock);
+}
+
+/* Whether page INDEX is resident, not busy, and mapped by nobody. */
+static
+bool
+memobj_unmapped(struct memobj *mo, unsigned index)
+{
+	return mo->mo_frames[index] != 0 && !mo->mo_busy[index] &&
+		page_refcount(mo->mo_frames[index]) == 1;
+}
+
+/*
+ * Write back and free up to VM_EVICT_CLUSTER dirty pages of the first
+ * file with some that nothing maps. Caller holds the lock; it is
+ * dropped for the writes. Returns the number of frames freed.
+ */
+static
+unsigned
+memobj_reclaim_dirty(void)
+{
+	struct memobj *mo;
+	unsigned i = 0, n = 0, tries = 0;
+
+	for (mo = memobj_list; mo != NULL; mo = mo->mo_next) {
+		if (mo->mo_vn == NULL) {
+			continue;
+		}
+		for (i = 0; i < mo->mo_npages; i++) {
+			if (mo->mo_dirty[i] && memobj_unmapped(mo, i)) {
+				break;
+			}
+		}
+		if (i < mo->mo_npages) {
+			break;
+		}
+	}
+	if (mo == NULL) {
+		return 0;
+	}
+
+	/* Keep it while the lock is dropped. */
+	mo->mo_refcount++;
+	for (; i < mo->mo_npages && tries < VM_EVICT_CLUSTER; i++) {
+		if (!mo->mo_dirty[i] || !memobj_unmapped(mo, i)) {
+			continue;
+		}
+		tries++;
+		if (memobj_clean(mo, i) == 0 && !mo->mo_dirty[i] &&
+		    memobj_unmapped(mo, i)) {
+			page_free(mo->mo_frames[i]);
+			mo->mo_frames[i] = 0;
+			n++;
+		}
+	}
+	lock_release(memobj_lock);
+	memobj_decref(mo);
+	lock_acquire(memobj_lock);
+	return n;
+}
+
+bool
+memobj_reclaim(bool writeback)
+{
+	paddr_t freed[VM_EVICT_CLUSTER];
+	struct memobj *mo;
+	unsigned i, n = 0, nwritten = 0;
+
+	if (memobj_lock == NULL || lock_do_i_hold(memobj_lock) ||
+	    !lock_tryacquire(memobj_lock)) {
+		return false;
+	}
+
+	/* Clean pages can just go: the file has them. */
+	for (mo = memobj_list; mo != NULL && n < VM_EVICT_CLUSTER;
+	     mo = mo->mo_next) {
+		if (mo->mo_vn == NULL) {
+			continue;
+		}
+		for (i = 0; i < mo->mo_npages && n < VM_EVICT_CLUSTER; i++) {
+			if (!mo->mo_dirty[i] && memobj_unmapped(mo, i)) {
+				freed[n++] = mo->mo_frames[i];
+				mo->mo_frames[i] = 0;
+			}
+		}
+	}
+	if (n == 0 && writeback) {
+		nwritten = memobj_reclaim_dirty();
+	}
+	memobj_nreclaimed += n + nwritten;
+	lock_release(memobj_lock);
+
+	for (i = 0; i < n; i++) {
+		page_free(freed[i]);
+	}
+	return n + nwritten > 0;
+}
+
+void
+memobj_printstats(void)
+{
+	struct memobj *mo;
+	unsigned nfile = 0, nanon = 0, nnamed = 0;
+
+	if (memobj_lock == NULL) {
+		return;
+	}
+	lock_acquire(memobj_lock);
+	for (mo = memobj_list; mo != NULL; mo = mo->mo_next) {
+		if (mo->mo_vn != NULL) {
+			nfile++;
+		}
+		else if (mo->mo_name != NULL) {
+			nnamed++;
+		}
+		else {
+			nanon++;
+		}
+	}
+	lock_release(memobj_lock);
+
+	kprintf("memobj: %u file, %u anonymous, %u named objects\n",
+		nfile, nanon, nnamed);
+	kprintf("memobj: %u pages read, %u written back, %u reclaimed\n",
+		memobj_nreads, memobj_nwrites, memobj_nreclaimed);
+}
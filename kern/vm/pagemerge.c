@@ -0,0 +1,384 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <clock.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <pagemerge.h>
+
+/*
+ * Same-page merging. See pagemerge.h.
+ *
+ * Only the merging thread changes the trees; pagemerge_lock keeps
+ * pagemerge_printstats out while it does. Address space locks are
+ * only try-locked under it, as the clock does. Nothing is allocated
+ * with an address space lock held, since the allocation could evict
+ * the very page being merged: each frame looked at may use up the
+ * one spare node, which is replaced before the next.
+ */
+
+struct pagemerge_node {
+	uint32_t pn_hash;		/* of the contents */
+	paddr_t pn_paddr;		/* the frame, or 0 if stale */
+	struct pagemerge_node *pn_left;	/* smaller hashes */
+	struct pagemerge_node *pn_right; /* larger or equal hashes */
+	struct pagemerge_node *pn_next;	/* every node in the tree */
+};
+
+struct pagemerge_tree {
+	struct pagemerge_node *pt_root;
+	struct pagemerge_node *pt_all;
+};
+
+static struct lock *pagemerge_lock;
+static struct pagemerge_tree pagemerge_stable;
+static struct pagemerge_tree pagemerge_unstable;
+static struct pagemerge_node *pagemerge_spare;
+static unsigned pagemerge_hand;		/* next coremap index */
+
+/* Statistics */
+static unsigned pagemerge_nsweeps;	/* sweeps of the coremap finished */
+static unsigned pagemerge_nscanned;	/* frames hashed */
+static unsigned pagemerge_nmerged;	/* mappings moved to stable frames */
+static unsigned pagemerge_nunmerged;	/* stable frames nobody mapped */
+
+/* FNV-1a, a word at a time. */
+static
+uint32_t
+pagemerge_hash(paddr_t paddr)
+{
+	const uint32_t *p = (const uint32_t *)PADDR_TO_KVADDR(paddr);
+	uint32_t hash = 2166136261U;
+	unsigned i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(*p); i++) {
+		hash = (hash ^ p[i]) * 16777619U;
+	}
+	return hash;
+}
+
+static
+bool
+pagemerge_same(paddr_t a, paddr_t b)
+{
+	const uint32_t *p = (const uint32_t *)PADDR_TO_KVADDR(a);
+	const uint32_t *q = (const uint32_t *)PADDR_TO_KVADDR(b);
+	unsigned i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(*p); i++) {
+		if (p[i] != q[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static
+struct pagemerge_node *
+pagemerge_find(struct pagemerge_tree *pt, uint32_t hash)
+{
+	struct pagemerge_node *pn = pt->pt_root;
+
+	while (pn != NULL && pn->pn_hash != hash) {
+		pn = hash < pn->pn_hash ? pn->pn_left : pn->pn_right;
+	}
+	return pn;
+}
+
+static
+void
+pagemerge_insert(struct pagemerge_tree *pt, struct pagemerge_node *pn)
+{
+	struct pagemerge_node **pp = &pt->pt_root;
+
+	while (*pp != NULL) {
+		pp = pn->pn_hash < (*pp)->pn_hash ?
+			&(*pp)->pn_left : &(*pp)->pn_right;
+	}
+	pn->pn_left = pn->pn_right = NULL;
+	*pp = pn;
+	pn->pn_next = pt->pt_all;
+	pt->pt_all = pn;
+}
+
+/* Use up the spare node for the frame at PADDR. */
+static
+void
+pagemerge_add(struct pagemerge_tree *pt, uint32_t hash, paddr_t paddr)
+{
+	struct pagemerge_node *pn = pagemerge_spare;
+
+	KASSERT(pn != NULL);
+	pagemerge_spare = NULL;
+	pn->pn_hash = hash;
+	pn->pn_paddr = paddr;
+	pagemerge_insert(pt, pn);
+}
+
+/*
+ * Freeze the page at VADDR in AS, whose lock we hold, for a compare.
+ * The lock alone doesn't stop writes: the refill handler loads any
+ * valid, referenced PTE that isn't copy-on-write, writable if it is
+ * dirty, without it. So, as the clock does, clear PTE_REF (and
+ * PTE_DIRTY) first, and then drop the translation; the next access
+ * goes to vm_fault and waits for the lock. Returns the bits cleared,
+ * for pagemerge_thaw.
+ */
+static
+pte_t
+pagemerge_freeze(struct addrspace *as, vaddr_t vaddr, pte_t *pte)
+{
+	pte_t saved;
+
+	saved = *pte & (PTE_REF | PTE_DIRTY);
+	*pte &= ~saved;
+	vm_tlb_shootdown(as, vaddr);
+	return saved;
+}
+
+/*
+ * Give a frozen page back the bits pagemerge_freeze took: both if it
+ * wasn't merged, and only PTE_REF once it's copy-on-write.
+ */
+static
+void
+pagemerge_thaw(pte_t *pte, pte_t saved)
+{
+	if (*pte & PTE_COW) {
+		saved &= ~PTE_DIRTY;
+	}
+	*pte |= saved;
+}
+
+/* Point the frozen page's PTE at the stable frame STABLE instead. */
+static
+void
+pagemerge_map(pte_t *pte, paddr_t stable)
+{
+	paddr_t old;
+
+	old = *pte & PTE_FRAME;
+	page_incref(stable);
+	*pte = stable | (*pte & ~(PTE_FRAME | PTE_DIRTY | PTE_PREFETCH)) |
+		PTE_COW;
+	page_free(old);
+	pagemerge_nmerged++;
+}
+
+/*
+ * Lock the owner of PADDR and return it and the page's PTE, if it is
+ * worth merging: owned, and not MADV_FREE garbage.
+ */
+static
+struct addrspace *
+pagemerge_lock_page(paddr_t paddr, vaddr_t *vaddr, pte_t **pte, bool *held)
+{
+	struct addrspace *as;
+
+	as = page_lockowner(paddr, vaddr, held);
+	if (as == NULL) {
+		return NULL;
+	}
+	*pte = pt_lookup(as->ptable, *vaddr, false);
+	KASSERT(*pte != NULL && (**pte & PTE_FRAME) == paddr);
+	if (**pte & PTE_LAZYFREE) {
+		if (!*held) {
+			lock_release(as->lock);
+		}
+		return NULL;
+	}
+	return as;
+}
+
+/*
+ * The frame at PADDR, mapped at VADDR by AS (whose lock we hold),
+ * hashed like the unstable frame at PN. Merge the two if they match.
+ */
+static
+void
+pagemerge_pair(struct addrspace *as, vaddr_t vaddr, pte_t *pte,
+	       paddr_t paddr, struct pagemerge_node *pn)
+{
+	struct addrspace *other;
+	vaddr_t othervaddr;
+	pte_t *otherpte, saved, othersaved;
+	bool held;
+
+	other = pagemerge_lock_page(pn->pn_paddr, &othervaddr, &otherpte,
+				    &held);
+	if (other == NULL) {
+		return;
+	}
+	saved = pagemerge_freeze(as, vaddr, pte);
+	othersaved = pagemerge_freeze(other, othervaddr, otherpte);
+
+	if (pagemerge_same(paddr, pn->pn_paddr)) {
+		/* Ours becomes the stable frame, with the tree's reference. */
+		page_incref(paddr);
+		*pte = (*pte & ~(PTE_DIRTY | PTE_PREFETCH)) | PTE_COW;
+		pagemerge_map(otherpte, paddr);
+		pagemerge_add(&pagemerge_stable, pagemerge_hash(paddr), paddr);
+		pn->pn_paddr = 0;
+	}
+	pagemerge_thaw(pte, saved);
+	pagemerge_thaw(otherpte, othersaved);
+
+	if (!held) {
+		lock_release(other->lock);
+	}
+}
+
+/* Look at the frame at PADDR. */
+static
+void
+pagemerge_scan(paddr_t paddr)
+{
+	struct pagemerge_node *pn;
+	struct addrspace *as;
+	vaddr_t vaddr;
+	uint32_t hash;
+	pte_t *pte, saved;
+	bool held;
+
+	as = pagemerge_lock_page(paddr, &vaddr, &pte, &held);
+	if (as == NULL) {
+		return;
+	}
+	KASSERT(!held);
+
+	hash = pagemerge_hash(paddr);
+	pagemerge_nscanned++;
+
+	pn = pagemerge_find(&pagemerge_stable, hash);
+	if (pn != NULL) {
+		saved = pagemerge_freeze(as, vaddr, pte);
+		if (pagemerge_same(paddr, pn->pn_paddr)) {
+			pagemerge_map(pte, pn->pn_paddr);
+		}
+		pagemerge_thaw(pte, saved);
+	}
+	else {
+		pn = pagemerge_find(&pagemerge_unstable, hash);
+		if (pn == NULL) {
+			pagemerge_add(&pagemerge_unstable, hash, paddr);
+		}
+		else if (pn->pn_paddr != 0 && pn->pn_paddr != paddr) {
+			pagemerge_pair(as, vaddr, pte, paddr, pn);
+		}
+	}
+
+	lock_release(as->lock);
+}
+
+/*
+ * End of a sweep: forget the unstable frames, and free the stable
+ * ones that only the tree refers to.
+ */
+static
+void
+pagemerge_endsweep(void)
+{
+	struct pagemerge_node *pn, *next;
+
+	for (pn = pagemerge_unstable.pt_all; pn != NULL; pn = next) {
+		next = pn->pn_next;
+		kfree(pn);
+	}
+	pagemerge_unstable.pt_root = pagemerge_unstable.pt_all = NULL;
+
+	pn = pagemerge_stable.pt_all;
+	pagemerge_stable.pt_root = pagemerge_stable.pt_all = NULL;
+	for (; pn != NULL; pn = next) {
+		next = pn->pn_next;
+		/* Nobody can get a new mapping of it but from us. */
+		if (page_refcount(pn->pn_paddr) == 1) {
+			page_free(pn->pn_paddr);
+			kfree(pn);
+			pagemerge_nunmerged++;
+			continue;
+		}
+		pagemerge_insert(&pagemerge_stable, pn);
+	}
+	pagemerge_nsweeps++;
+}
+
+static
+void
+pagemerge_thread(void *data1, unsigned long data2)
+{
+	unsigned i;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(PAGEMERGE_INTERVAL);
+		for (i = 0; i < PAGEMERGE_BATCH; i++) {
+			if (pagemerge_spare == NULL) {
+				pagemerge_spare = kmalloc(sizeof(*pagemerge_spare));
+				if (pagemerge_spare == NULL) {
+					break;
+				}
+			}
+
+			lock_acquire(pagemerge_lock);
+			pagemerge_scan(coremap_paddr(pagemerge_hand));
+			pagemerge_hand++;
+			if (pagemerge_hand == coremap_npages()) {
+				pagemerge_hand = 0;
+				pagemerge_endsweep();
+			}
+			lock_release(pagemerge_lock);
+
+			/* Only take time nobody else wants. */
+			thread_yield();
+		}
+	}
+}
+
+void
+pagemerge_bootstrap(void)
+{
+	int result;
+
+	pagemerge_lock = lock_create("pagemerge");
+	if (pagemerge_lock == NULL) {
+		panic("pagemerge_bootstrap: out of memory\n");
+	}
+	result = thread_fork("pagemerge", NULL, pagemerge_thread, NULL, 0);
+	if (result) {
+		panic("pagemerge_bootstrap: thread_fork: %s\n",
+		      strerror(result));
+	}
+}
+
+void
+pagemerge_printstats(void)
+{
+	struct pagemerge_node *pn;
+	unsigned nframes = 0, nmappings = 0, refs;
+
+	if (pagemerge_lock == NULL) {
+		return;
+	}
+	lock_acquire(pagemerge_lock);
+	for (pn = pagemerge_stable.pt_all; pn != NULL; pn = pn->pn_next) {
+		/* One reference is the tree's. */
+		refs = page_refcount(pn->pn_paddr);
+		if (refs > 1) {
+			nframes++;
+			nmappings += refs - 1;
+		}
+	}
+	lock_release(pagemerge_lock);
+
+	kprintf("pagemerge: %u sweeps, %u frames hashed, %u merged, "
+		"%u unmerged\n", pagemerge_nsweeps, pagemerge_nscanned,
+		pagemerge_nmerged, pagemerge_nunmerged);
+	kprintf("pagemerge: %u frames shared by %u mappings, %u pages "
+		"(%u KB) saved\n", nframes, nmappings, nmappings - nframes,
+		(nmappings - nframes) * (PAGE_SIZE / 1024));
+}
@@ -0,0 +1,97 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm.h>
+#include <pagetable.h>
+
+/*
+ * Two-level page table. See pagetable.h.
+ *
+ * Both the directory and the second-level tables are exactly one page,
+ * so they come straight from the page allocator and each table covers
+ * a naturally aligned 4M chunk of the address space.
+ */
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	KASSERT(sizeof(struct pagetable) == PAGE_SIZE);
+
+	pt = (struct pagetable *)alloc_kpages(1);
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < PT_NDIR; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i;
+
+	for (i = 0; i < PT_NDIR; i++) {
+		if (pt->pt_dir[i] != NULL) {
+			free_kpages((vaddr_t)pt->pt_dir[i]);
+		}
+	}
+	free_kpages((vaddr_t)pt);
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	pte_t *table;
+
+	table = pt->pt_dir[PT_DIRINDEX(vaddr)];
+	if (table == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		table = (pte_t *)alloc_kpages(1);
+		if (table == NULL) {
+			return NULL;
+		}
+		bzero(table, PAGE_SIZE);
+		pt->pt_dir[PT_DIRINDEX(vaddr)] = table;
+	}
+	return &table[PT_PTEINDEX(vaddr)];
+}
+
+int
+pt_walk(struct pagetable *pt, vaddr_t start, vaddr_t end,
+	pt_walkfn func, void *data)
+{
+	pte_t *table;
+	vaddr_t vaddr;
+	unsigned i;
+	int result;
+
+	KASSERT(end <= USERSPACETOP);
+
+	vaddr = start & PAGE_FRAME;
+	while (vaddr < end) {
+		table = pt->pt_dir[PT_DIRINDEX(vaddr)];
+		if (table == NULL) {
+			/* Skip to the start of the next table. */
+			vaddr = (vaddr + PT_DIRSPAN) & ~(vaddr_t)(PT_DIRSPAN - 1);
+			continue;
+		}
+		for (i = PT_PTEINDEX(vaddr); i < PT_NPTE && vaddr < end;
+		     i++, vaddr += PAGE_SIZE) {
+			if (table[i] == 0) {
+				continue;
+			}
+			result = func(vaddr, &table[i], data);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
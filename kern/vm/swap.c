@@ -0,0 +1,360 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <synch.h>
+#include <thread.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <vm.h>
+#include <swap.h>
+#include <zswap.h>
+
+/*
+ * Swap space on a raw disk. See swap.h.
+ *
+ * swap_lock covers the slot bitmap, the reference counts, the busy
+ * flags and the page-out queue; it is taken before zswap's lock,
+ * never after. A slot whose page-out is still in flight stays
+ * allocated in the bitmap even if its last reference goes away, so
+ * it can't be handed out again until the write is done.
+ *
+ * If a page-out can't be written, the frame is kept instead: it is
+ * left busy, so nothing else takes it, and recorded in swap_held as
+ * the slot's contents. Page-ins of the slot copy from it, and it is
+ * freed when the slot is, or when the slot is given new contents.
+ * By the time the write fails the PTE already names the slot, and
+ * its owner may have gone, so the frame can't simply be mapped back.
+ */
+
+struct swap_request {
+	paddr_t sr_paddr;		/* frame being written */
+	unsigned sr_slot;		/* where it goes */
+};
+
+static struct vnode *swap_vn;
+static unsigned swap_nslots;
+static unsigned swap_nused;
+static struct bitmap *swap_map;		/* slots in use */
+static uint16_t *swap_refs;		/* references per slot */
+static bool *swap_busy;			/* page-out in flight per slot */
+static paddr_t *swap_held;		/* frame kept after a failed write */
+static struct lock *swap_lock;
+static struct cv *swap_workcv;		/* writer waits for requests */
+static struct cv *swap_donecv;		/* a page-out finished */
+
+static struct swap_request swap_queue[SWAP_QUEUE];
+static unsigned swap_qhead, swap_qcount;
+static unsigned swap_inflight;		/* queued or being written */
+
+/* Statistics */
+static unsigned swap_npageins;
+static unsigned swap_npageouts;
+static unsigned swap_nsyncouts;
+static unsigned swap_nfailed;		/* page-outs kept in memory */
+
+/* Move one page between the frame at PADDR and SLOT. */
+static
+int
+swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(slot < swap_nslots);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vn, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vn, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+/* Release the frame kept for SLOT, if any. Caller holds the lock. */
+static
+void
+swap_drop_held(unsigned slot)
+{
+	KASSERT(lock_do_i_hold(swap_lock));
+
+	if (swap_held[slot] != 0) {
+		vm_pageout_done(swap_held[slot]);
+		swap_held[slot] = 0;
+	}
+}
+
+/*
+ * Write out one page and release the frame. If the write fails the
+ * frame is kept as the slot's contents instead.
+ */
+static
+void
+swap_write(unsigned slot, paddr_t paddr)
+{
+	int result;
+
+	result = swap_io(slot, paddr, UIO_WRITE);
+	if (result) {
+		kprintf("swap: writing slot %u: %s; keeping the page\n",
+			slot, strerror(result));
+	}
+	else {
+		vm_pageout_done(paddr);
+	}
+
+	lock_acquire(swap_lock);
+	KASSERT(swap_busy[slot] && swap_held[slot] == 0);
+	swap_busy[slot] = false;
+	if (result) {
+		swap_held[slot] = paddr;
+		swap_nfailed++;
+	}
+	if (swap_refs[slot] == 0) {
+		swap_drop_held(slot);
+		bitmap_unmark(swap_map, slot);
+		swap_nused--;
+	}
+	swap_inflight--;
+	swap_npageouts++;
+	cv_broadcast(swap_donecv, swap_lock);
+	lock_release(swap_lock);
+}
+
+/* The swap writer thread: drains the page-out queue forever. */
+static
+void
+swap_writer(void *data1, unsigned long data2)
+{
+	struct swap_request req;
+
+	(void)data1;
+	(void)data2;
+
+	lock_acquire(swap_lock);
+	while (1) {
+		while (swap_qcount == 0) {
+			cv_wait(swap_workcv, swap_lock);
+		}
+		req = swap_queue[swap_qhead];
+		swap_qhead = (swap_qhead + 1) % SWAP_QUEUE;
+		swap_qcount--;
+		lock_release(swap_lock);
+
+		swap_write(req.sr_slot, req.sr_paddr);
+
+		lock_acquire(swap_lock);
+	}
+}
+
+void
+swap_bootstrap(void)
+{
+	char path[] = SWAP_DEVICE;
+	struct vnode *vn;
+	struct stat st;
+	unsigned i;
+	int result;
+
+	result = vfs_open(path, O_RDWR, 0, &vn);
+	if (result) {
+		kprintf("swap: %s: %s; paging disabled\n", SWAP_DEVICE,
+			strerror(result));
+		return;
+	}
+	result = VOP_STAT(vn, &st);
+	if (result || st.st_size < PAGE_SIZE) {
+		kprintf("swap: %s: no usable space; paging disabled\n",
+			SWAP_DEVICE);
+		vfs_close(vn);
+		return;
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	swap_map = bitmap_create(swap_nslots);
+	swap_refs = kmalloc(swap_nslots * sizeof(swap_refs[0]));
+	swap_busy = kmalloc(swap_nslots * sizeof(swap_busy[0]));
+	swap_held = kmalloc(swap_nslots * sizeof(swap_held[0]));
+	swap_lock = lock_create("swap");
+	swap_workcv = cv_create("swapwork");
+	swap_donecv = cv_create("swapdone");
+	if (swap_map == NULL || swap_refs == NULL || swap_busy == NULL ||
+	    swap_held == NULL || swap_lock == NULL || swap_workcv == NULL ||
+	    swap_donecv == NULL) {
+		panic("swap_bootstrap: out of memory\n");
+	}
+	for (i = 0; i < swap_nslots; i++) {
+		swap_refs[i] = 0;
+		swap_busy[i] = false;
+		swap_held[i] = 0;
+	}
+	zswap_bootstrap(swap_nslots);
+
+	result = thread_fork("swapwriter", NULL, swap_writer, NULL, 0);
+	if (result) {
+		panic("swap_bootstrap: thread_fork: %s\n", strerror(result));
+	}
+
+	/* Turns paging on. */
+	swap_vn = vn;
+	kprintf("swap: %u pages on %s\n", swap_nslots, SWAP_DEVICE);
+}
+
+bool
+swap_enabled(void)
+{
+	return swap_vn != NULL;
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	lock_acquire(swap_lock);
+	result = bitmap_alloc(swap_map, slot);
+	if (result) {
+		lock_release(swap_lock);
+		return ENOSPC;
+	}
+	KASSERT(swap_refs[*slot] == 0 && !swap_busy[*slot]);
+	swap_refs[*slot] = 1;
+	swap_nused++;
+	lock_release(swap_lock);
+	return 0;
+}
+
+void
+swap_incref(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	lock_acquire(swap_lock);
+	KASSERT(swap_refs[slot] > 0 && swap_refs[slot] < 0xffff);
+	swap_refs[slot]++;
+	lock_release(swap_lock);
+}
+
+unsigned
+swap_refcount(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+	return swap_refs[slot];
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	lock_acquire(swap_lock);
+	KASSERT(swap_refs[slot] > 0);
+	swap_refs[slot]--;
+	if (swap_refs[slot] == 0 && !swap_busy[slot]) {
+		swap_drop_held(slot);
+		zswap_invalidate(slot);
+		bitmap_unmark(swap_map, slot);
+		swap_nused--;
+	}
+	lock_release(swap_lock);
+}
+
+int
+swap_pagein(unsigned slot, paddr_t paddr)
+{
+	lock_acquire(swap_lock);
+	KASSERT(swap_refs[slot] > 0);
+	while (swap_busy[slot]) {
+		cv_wait(swap_donecv, swap_lock);
+	}
+	swap_npageins++;
+	if (swap_held[slot] != 0) {
+		/* It never made it to the disk. */
+		memcpy((void *)PADDR_TO_KVADDR(paddr),
+		       (const void *)PADDR_TO_KVADDR(swap_held[slot]),
+		       PAGE_SIZE);
+		lock_release(swap_lock);
+		return 0;
+	}
+	lock_release(swap_lock);
+
+	if (zswap_load(slot, paddr) == 0) {
+		return 0;
+	}
+	return swap_io(slot, paddr, UIO_READ);
+}
+
+void
+swap_pageout(unsigned slot, paddr_t paddr)
+{
+	/* New contents; whatever a failed write left is stale. */
+	lock_acquire(swap_lock);
+	swap_drop_held(slot);
+	lock_release(swap_lock);
+
+	/* Most pages never need to reach the disk. */
+	if (zswap_store(slot, paddr) == 0) {
+		vm_pageout_done(paddr);
+		return;
+	}
+
+	lock_acquire(swap_lock);
+	KASSERT(swap_refs[slot] > 0 && !swap_busy[slot]);
+	swap_busy[slot] = true;
+	swap_inflight++;
+	if (swap_qcount < SWAP_QUEUE) {
+		swap_queue[(swap_qhead + swap_qcount) % SWAP_QUEUE].sr_paddr =
+			paddr;
+		swap_queue[(swap_qhead + swap_qcount) % SWAP_QUEUE].sr_slot =
+			slot;
+		swap_qcount++;
+		cv_signal(swap_workcv, swap_lock);
+		lock_release(swap_lock);
+		return;
+	}
+
+	/* The writer is backed up; do it ourselves. */
+	swap_nsyncouts++;
+	lock_release(swap_lock);
+	swap_write(slot, paddr);
+}
+
+bool
+swap_wait(void)
+{
+	lock_acquire(swap_lock);
+	if (swap_inflight == 0) {
+		lock_release(swap_lock);
+		return false;
+	}
+	cv_wait(swap_donecv, swap_lock);
+	lock_release(swap_lock);
+	return true;
+}
+
+void
+swap_printstats(void)
+{
+	if (!swap_enabled()) {
+		kprintf("swap: disabled\n");
+		return;
+	}
+	kprintf("swap: %u/%u slots used, %u in flight\n",
+		swap_nused, swap_nslots, swap_inflight);
+	kprintf("swap: %u page-ins, %u page-outs (%u synchronous, "
+		"%u failed and kept in memory)\n", swap_npageins,
+		swap_npageouts, swap_nsyncouts, swap_nfailed);
+}
@@ -1,157 +1,2613 @@
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
 #include <lib.h>
+#include <uio.h>
+#include <vnode.h>
 #include <spl.h>
 #include <spinlock.h>
 #include <proc.h>
 #include <current.h>
+#include <clock.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <mips/vm.h>
 #include <mainbus.h>
+#include <cpu.h>
+#include <synch.h>
+#include <thread.h>
+#include <wchan.h>
+#include <platform/maxcpus.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <imagecache.h>
+#include <memobj.h>
+#include <loadctl.h>
+#include <pagemerge.h>
+#include <vmalloc.h>
 
 static struct spinlock coremap_splk = SPINLOCK_INITIALIZER;
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 static struct coremap_entry *coremap;
-static int coremap_entries;
+static unsigned coremap_entries;
+static unsigned coremap_freecount;
+static unsigned coremap_clock;		/* page replacement clock hand */
+static unsigned coremap_nwired;		/* CM_WIRED frames */
+static unsigned coremap_nlocked;	/* pages mlock has reserved */
+static paddr_t vm_zeroframe;		/* shared by untouched anon pages */
 paddr_t firstpaddr;
 paddr_t lastpaddr;
 
+/* Read by mips_utlb_handler; see <mips/vm.h>. */
+struct vm_refill vm_refill[MAXCPUS];
+static struct pagetable vm_nullpt;	/* refills from here all miss */
+
+/*
+ * Buddy free lists.
+ *
+ * A block of order k is 2^k pages whose first page index is a
+ * multiple of 2^k. The list link lives in the first bytes of the
+ * free block itself (through kseg0), and the head page's coremap
+ * entry carries CM_FREE and the order so buddies can be found and
+ * merged without searching.
+ */
+struct buddy_link {
+	struct buddy_link *bl_next;
+	struct buddy_link *bl_prev;
+};
+
+static struct buddy_link buddy_lists[BUDDY_MAXORDER + 1];
+
+static
+struct buddy_link *
+buddy_link(unsigned index)
+{
+	return (struct buddy_link *)
+		PADDR_TO_KVADDR(firstpaddr + index * PAGE_SIZE);
+}
+
+static
+unsigned
+buddy_index(struct buddy_link *bl)
+{
+	return (KVADDR_TO_PADDR((vaddr_t)bl) - firstpaddr) / PAGE_SIZE;
+}
+
+/* Put the block at INDEX on the free list for ORDER. */
+static
+void
+buddy_push(unsigned index, unsigned order)
+{
+	struct buddy_link *bl, *head;
+
+	KASSERT(spinlock_do_i_hold(&coremap_splk));
+	KASSERT(index % (1U << order) == 0);
+
+	head = &buddy_lists[order];
+	bl = buddy_link(index);
+	bl->bl_next = head->bl_next;
+	bl->bl_prev = head;
+	head->bl_next->bl_prev = bl;
+	head->bl_next = bl;
+
+	coremap[index].cm_flags = CM_FREE | (order << CM_ORDER_SHIFT);
+	coremap_freecount += 1U << order;
+}
+
+/* Take the free block at INDEX off its free list. */
+static
+void
+buddy_remove(unsigned index)
+{
+	struct buddy_link *bl;
+
+	KASSERT(spinlock_do_i_hold(&coremap_splk));
+	KASSERT(coremap[index].cm_flags & CM_FREE);
+
+	bl = buddy_link(index);
+	bl->bl_prev->bl_next = bl->bl_next;
+	bl->bl_next->bl_prev = bl->bl_prev;
+
+	coremap_freecount -= 1U << CM_ORDER(coremap[index].cm_flags);
+	coremap[index].cm_flags = 0;
+}
+
+/*
+ * Find a free block of exactly ORDER, splitting a larger one if
+ * needed. Returns nonzero if nothing big enough is free.
+ */
+static
+int
+buddy_alloc(unsigned order, unsigned *ret)
+{
+	unsigned k, index;
+
+	for (k = order; k <= BUDDY_MAXORDER; k++) {
+		if (buddy_lists[k].bl_next != &buddy_lists[k]) {
+			break;
+		}
+	}
+	if (k > BUDDY_MAXORDER) {
+		return ENOMEM;
+	}
+
+	index = buddy_index(buddy_lists[k].bl_next);
+	buddy_remove(index);
+
+	/* Split, handing the upper halves back. */
+	while (k > order) {
+		k--;
+		buddy_push(index + (1U << k), k);
+	}
+
+	*ret = index;
+	return 0;
+}
+
+/* Free the block at INDEX of ORDER, merging with free buddies. */
+static
+void
+buddy_free(unsigned index, unsigned order)
+{
+	unsigned buddy;
+
+	while (order < BUDDY_MAXORDER) {
+		buddy = index ^ (1U << order);
+		if (buddy >= coremap_entries ||
+		    !(coremap[buddy].cm_flags & CM_FREE) ||
+		    CM_ORDER(coremap[buddy].cm_flags) != order) {
+			break;
+		}
+		buddy_remove(buddy);
+		if (buddy < index) {
+			index = buddy;
+		}
+		order++;
+	}
+	buddy_push(index, order);
+}
+
+/*
+ * Free an arbitrary run of NPAGES pages starting at INDEX by breaking
+ * it into the largest aligned blocks that fit.
+ */
+static
+void
+buddy_free_range(unsigned index, unsigned npages)
+{
+	unsigned order;
+
+	while (npages > 0) {
+		order = 0;
+		while (order < BUDDY_MAXORDER &&
+		       index % (2U << order) == 0 &&
+		       (2U << order) <= npages) {
+			order++;
+		}
+		buddy_free(index, order);
+		index += 1U << order;
+		npages -= 1U << order;
+	}
+}
+
+/* Smallest order whose block holds NPAGES pages. */
 static
+unsigned
+buddy_order(unsigned long npages)
+{
+	unsigned order = 0;
+
+	while (order <= BUDDY_MAXORDER && (1UL << order) < npages) {
+		order++;
+	}
+	return order;
+}
+
 paddr_t
-getppages(unsigned long npages)
+coremap_getppages(unsigned long npages)
 {
 	paddr_t addr;
-    /* If coremap not initialized, steal memory from ram */
-    if (!coremap) {
+	unsigned order, index, i;
+
+	/* If coremap not initialized, steal memory from ram */
+	if (!coremap) {
 		spinlock_acquire(&stealmem_lock);
 		addr = ram_stealmem(npages);
 		spinlock_release(&stealmem_lock);
 		return addr;
 	}
 
+	order = buddy_order(npages);
+	if (npages == 0 || order > BUDDY_MAXORDER) {
+		return 0;
+	}
+
 	spinlock_acquire(&coremap_splk);
 
-	int start = -1;
-	unsigned pagesSoFar = 0;
-    /* Find a contiguous block of free pages in coremap */
-	for (int i = 0; i < coremap_entries; i++) {
-		if (coremap[i].freecount == 0) {
-			if (start == -1) {
-				start = i;
-			}
-			pagesSoFar++;
+	if (buddy_alloc(order, &index)) {
+		spinlock_release(&coremap_splk);
+		return 0;
+	}
+
+	/* Give back the tail of the block that wasn't asked for. */
+	if (npages < (1UL << order)) {
+		buddy_free_range(index + npages, (1U << order) - npages);
+	}
+
+	for (i = index; i < index + npages; i++) {
+		coremap[i].cm_flags = CM_ALLOC;
+	}
+	coremap[index + npages - 1].cm_flags |= CM_LAST;
+
+	spinlock_release(&coremap_splk);
+
+	return firstpaddr + index * PAGE_SIZE;
+}
+
+/*
+ * Per-cpu page magazines.
+ */
+
+void
+pagemag_init(struct page_magazine *pm)
+{
+	pm->pm_count = 0;
+	pm->pm_hits = 0;
+	pm->pm_misses = 0;
+}
+
+/* Move up to PAGEMAG_BATCH single pages from the coremap into PM. */
+static
+void
+pagemag_refill(struct page_magazine *pm)
+{
+	unsigned index;
+
+	spinlock_acquire(&coremap_splk);
+	while (pm->pm_count < PAGEMAG_BATCH) {
+		if (buddy_alloc(0, &index)) {
+			break;
 		}
-		else {
-			start = -1;
-			pagesSoFar = 0;
+		coremap[index].cm_flags = CM_ALLOC | CM_LAST;
+		pm->pm_pages[pm->pm_count++] = firstpaddr + index * PAGE_SIZE;
+	}
+	spinlock_release(&coremap_splk);
+}
+
+/* Give PAGEMAG_BATCH pages from PM back to the coremap. */
+static
+void
+pagemag_drain(struct page_magazine *pm)
+{
+	unsigned index, i;
+
+	spinlock_acquire(&coremap_splk);
+	for (i = 0; i < PAGEMAG_BATCH && pm->pm_count > 0; i++) {
+		index = (pm->pm_pages[--pm->pm_count] - firstpaddr) / PAGE_SIZE;
+		coremap[index].cm_flags = 0;
+		buddy_free(index, 0);
+	}
+	spinlock_release(&coremap_splk);
+}
+
+static
+paddr_t
+pagemag_alloc(void)
+{
+	struct page_magazine *pm;
+	paddr_t pa;
+	int spl;
+
+	/* splhigh keeps us on this cpu and out of interrupt handlers. */
+	spl = splhigh();
+	pm = &curcpu->c_pagemag;
+	if (pm->pm_count > 0) {
+		pm->pm_hits++;
+	}
+	else {
+		pm->pm_misses++;
+		pagemag_refill(pm);
+		if (pm->pm_count == 0) {
+			splx(spl);
+			return 0;
 		}
-		if (pagesSoFar == npages) {
-			break;
+	}
+	pa = pm->pm_pages[--pm->pm_count];
+	splx(spl);
+	return pa;
+}
+
+static
+void
+pagemag_free(paddr_t pa)
+{
+	struct page_magazine *pm;
+	int spl;
+
+	spl = splhigh();
+	pm = &curcpu->c_pagemag;
+	if (pm->pm_count == PAGEMAG_SIZE) {
+		pagemag_drain(pm);
+	}
+	pm->pm_pages[pm->pm_count++] = pa;
+	splx(spl);
+}
+
+bool
+pagemag_flush(void)
+{
+	struct page_magazine *pm;
+	bool any;
+	int spl;
+
+	spl = splhigh();
+	pm = &curcpu->c_pagemag;
+	any = pm->pm_count > 0;
+	while (pm->pm_count > 0) {
+		pagemag_drain(pm);
+	}
+	splx(spl);
+	return any;
+}
+
+/*
+ * Out of memory: empty this cpu's magazine, and ask the other cpus
+ * with pages in theirs to empty them too. Returns false if every
+ * magazine was empty.
+ */
+static
+bool
+pagemag_reclaim(void)
+{
+	struct cpu *c;
+	unsigned i;
+	bool any;
+
+	any = pagemag_flush();
+	for (i = 0; i < cpu_count(); i++) {
+		c = cpu_get(i);
+		if (c != curcpu && c->c_pagemag.pm_count > 0) {
+			ipi_send(c, IPI_PAGEMAG);
+			any = true;
 		}
 	}
+	return any;
+}
 
-	if (pagesSoFar != npages || start == -1) {
-		spinlock_release(&coremap_splk);
-		return 0;
+static bool vm_reclaim(void);
+static void vm_pageout_poke(void);
+
+/*
+ * Pre-zeroed page pool.
+ *
+ * User frames are handed out zeroed, and zeroing the page is most of
+ * the cost of a zero-fill fault. So idle cpus zero frames ahead of
+ * time into a pool that page_zalloc takes from first. The idle loop
+ * runs with interrupts off, so a cpu zeroes at most VM_ZEROPOOL_CHUNK
+ * pages and then waits in cpu_idle, which lets interrupts in, before
+ * it does any more. Refilling starts when the pool drops below
+ * zeropool_low and goes on until it reaches zeropool_high; both can
+ * be set from the kernel menu (zp). Pooled frames count as free:
+ * vm_reclaim hands them back before it pages anything out, and then
+ * refilling stops for VM_ZEROPOOL_HOLDOFF seconds so that idle cpus
+ * don't take the memory straight back.
+ */
+static struct spinlock zeropool_splk = SPINLOCK_INITIALIZER;
+static paddr_t zeropool[VM_ZEROPOOL_MAX];
+static unsigned zeropool_count;
+static bool zeropool_filling;		/* between low and high water */
+static unsigned zeropool_low = VM_ZEROPOOL_LOW;
+static unsigned zeropool_high = VM_ZEROPOOL_HIGH;
+static bool zeropool_held;		/* refilling stopped after a drain */
+static struct timespec zeropool_drained;	/* when */
+
+/* Statistics */
+static unsigned zeropool_nhits;		/* zeroed allocs served from it */
+static unsigned zeropool_nmisses;	/* zeroed allocs that had to bzero */
+static unsigned zeropool_nzeroed;	/* pages zeroed while idle */
+
+void
+vm_zeropool_idle(void)
+{
+	paddr_t pages[VM_ZEROPOOL_CHUNK];
+	struct timespec now, since;
+	unsigned i, n, want;
+	vaddr_t kva;
+
+	if (coremap == NULL) {
+		return;
+	}
+
+	if (zeropool_held) {
+		gettime(&now);
+		spinlock_acquire(&zeropool_splk);
+		timespec_sub(&now, &zeropool_drained, &since);
+		if (since.tv_sec < VM_ZEROPOOL_HOLDOFF) {
+			spinlock_release(&zeropool_splk);
+			return;
+		}
+		zeropool_held = false;
+		spinlock_release(&zeropool_splk);
+	}
+
+	spinlock_acquire(&zeropool_splk);
+	if (zeropool_count < zeropool_low) {
+		zeropool_filling = true;
+	}
+	else if (zeropool_count >= zeropool_high) {
+		zeropool_filling = false;
+	}
+	want = zeropool_filling ? zeropool_high - zeropool_count : 0;
+	spinlock_release(&zeropool_splk);
+
+	if (want == 0) {
+		return;
+	}
+	if (want > VM_ZEROPOOL_CHUNK) {
+		want = VM_ZEROPOOL_CHUNK;
 	}
 
-    /* Set values for block */
-	for (unsigned i = start; i < npages + start; i++) {
-		if (i == (unsigned)start) {
-			coremap[i].block_start = 1;
+	for (n = 0; n < want; n++) {
+		kva = alloc_kpages_nowait(1);
+		if (kva == 0) {
+			break;
 		}
-		if (i == npages + start - 1){
-			coremap[i].block_end = 1;
+		bzero((void *)kva, PAGE_SIZE);
+		pages[n] = KVADDR_TO_PADDR(kva);
+	}
+
+	spinlock_acquire(&zeropool_splk);
+	if (n < want) {
+		/* Out of free memory; don't keep trying. */
+		zeropool_filling = false;
+	}
+	for (i = 0; i < n && zeropool_count < VM_ZEROPOOL_MAX; i++) {
+		zeropool[zeropool_count++] = pages[i];
+	}
+	zeropool_nzeroed += i;
+	spinlock_release(&zeropool_splk);
+
+	/* Someone lowered the watermarks meanwhile. */
+	for (; i < n; i++) {
+		free_kpages(PADDR_TO_KVADDR(pages[i]));
+	}
+}
+
+/* Take a zeroed frame from the pool, or return 0. */
+static
+paddr_t
+zeropool_get(void)
+{
+	paddr_t paddr = 0;
+
+	spinlock_acquire(&zeropool_splk);
+	if (zeropool_count > 0) {
+		paddr = zeropool[--zeropool_count];
+		zeropool_nhits++;
+	}
+	else {
+		zeropool_nmisses++;
+	}
+	spinlock_release(&zeropool_splk);
+	return paddr;
+}
+
+/*
+ * Give the whole pool back, and hold off refilling it for a while.
+ * Returns false if it was empty.
+ */
+static
+bool
+zeropool_drain(void)
+{
+	struct timespec now;
+	paddr_t paddr;
+	bool any = false;
+
+	gettime(&now);
+	for (;;) {
+		spinlock_acquire(&zeropool_splk);
+		zeropool_filling = false;
+		zeropool_held = true;
+		zeropool_drained = now;
+		paddr = zeropool_count > 0 ? zeropool[--zeropool_count] : 0;
+		spinlock_release(&zeropool_splk);
+		if (paddr == 0) {
+			return any;
 		}
-		coremap[i].freecount = 1;
+		free_kpages(PADDR_TO_KVADDR(paddr));
+		any = true;
 	}
+}
 
-    spinlock_release(&coremap_splk);
+void
+vm_zeropool_setwater(unsigned low, unsigned high)
+{
+	if (high > VM_ZEROPOOL_MAX) {
+		high = VM_ZEROPOOL_MAX;
+	}
+	if (low > high) {
+		low = high;
+	}
+	spinlock_acquire(&zeropool_splk);
+	zeropool_low = low;
+	zeropool_high = high;
+	spinlock_release(&zeropool_splk);
+}
 
-	return firstpaddr + start * PAGE_SIZE;
+void
+vm_zeropool_printstats(void)
+{
+	kprintf("zero pool: %u pages, refill below %u up to %u (max %u)\n",
+		zeropool_count, zeropool_low, zeropool_high, VM_ZEROPOOL_MAX);
+	kprintf("zero pool: %u hits, %u misses, %u pages zeroed idle\n",
+		zeropool_nhits, zeropool_nmisses, zeropool_nzeroed);
 }
 
 vaddr_t
-alloc_kpages(unsigned npages)
+alloc_kpages_nowait(unsigned npages)
 {
 	paddr_t pa;
-	pa = getppages(npages);
+
+	if (npages == 1 && coremap != NULL) {
+		pa = pagemag_alloc();
+	}
+	else {
+		pa = coremap_getppages(npages);
+	}
 	if (pa == 0) {
 		return 0;
 	}
 	return PADDR_TO_KVADDR(pa);
 }
 
+vaddr_t
+alloc_kpages(unsigned npages)
+{
+	vaddr_t va;
+	unsigned tries;
+
+	vm_pageout_poke();
+	for (tries = 0; ; tries++) {
+		va = alloc_kpages_nowait(npages);
+		if (va != 0) {
+			return va;
+		}
+		/* Out of memory; try paging something out. */
+		if (tries == VM_RECLAIM_TRIES || !vm_reclaim()) {
+			return 0;
+		}
+	}
+}
+
 void
 free_kpages(vaddr_t addr)
 {
-    /* Leaks memory if it is not included in coremap */
-    if (PADDR_TO_KVADDR(firstpaddr) <= addr) {
-        int freeBlock = 0;
-        int start_index = (addr - PADDR_TO_KVADDR(firstpaddr)) / PAGE_SIZE;
-
-    	spinlock_acquire(&coremap_splk);
-    	for (int i = 0; i < coremap_entries; i++) {
-    		if (i == start_index) {
-    			freeBlock = 1;
-                coremap[i].block_start = 0;
-    		}
-    		if (freeBlock) {
-    			coremap[i].freecount = 0;
-    			if (coremap[i].block_end == 1) {
-    				freeBlock = 0;
-                    coremap[i].block_end = 0;
-    			}
-    		}
-    	}
-    	spinlock_release(&coremap_splk);
-    }
+	unsigned index;
+
+	/* Leaks memory if it is not included in coremap */
+	if (coremap == NULL || addr < PADDR_TO_KVADDR(firstpaddr)) {
+		return;
+	}
+
+	index = (KVADDR_TO_PADDR(addr) - firstpaddr) / PAGE_SIZE;
+	KASSERT(index < coremap_entries);
+	KASSERT(coremap[index].cm_flags & CM_ALLOC);
+
+	/*
+	 * We own the allocation, so its coremap entries can't change
+	 * under us; a single page goes to the magazine without
+	 * touching the lock.
+	 */
+	if (coremap[index].cm_flags & CM_LAST) {
+		pagemag_free(KVADDR_TO_PADDR(addr));
+		return;
+	}
+	coremap_freeppages(KVADDR_TO_PADDR(addr));
+}
+
+void
+coremap_freeppages(paddr_t paddr)
+{
+	unsigned index, i;
+
+	index = (paddr - firstpaddr) / PAGE_SIZE;
+	KASSERT(paddr >= firstpaddr && index < coremap_entries);
+	KASSERT(coremap[index].cm_flags & CM_ALLOC);
+
+	spinlock_acquire(&coremap_splk);
+
+	/* The allocation runs up to the page marked CM_LAST. */
+	i = index;
+	while (!(coremap[i].cm_flags & CM_LAST)) {
+		coremap[i].cm_flags = 0;
+		i++;
+		KASSERT(i < coremap_entries);
+		KASSERT(coremap[i].cm_flags & CM_ALLOC);
+	}
+	coremap[i].cm_flags = 0;
+
+	buddy_free_range(index, i - index + 1);
+	spinlock_release(&coremap_splk);
+}
+
+/*
+ * User page frames.
+ */
+
+static
+unsigned
+page_index(paddr_t paddr)
+{
+	unsigned index;
+
+	KASSERT(paddr >= firstpaddr);
+	index = (paddr - firstpaddr) / PAGE_SIZE;
+	KASSERT(index < coremap_entries);
+	return index;
 }
 
+/* Set up the coremap entry for a newly allocated user frame. */
+static
 void
-vm_bootstrap(void)
+page_init(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+
+	cme = &coremap[page_index(paddr)];
+	cme->cm_refcount = 1;
+	cme->cm_as = NULL;
+	cme->cm_vaddr = 0;
+	cme->cm_slot = SWAP_NOSLOT;
+}
+
+static
+paddr_t
+page_zalloc(bool wait)
+{
+	vaddr_t kva;
+	paddr_t paddr;
+
+	paddr = zeropool_get();
+	if (paddr != 0) {
+		page_init(paddr);
+		return paddr;
+	}
+
+	kva = wait ? alloc_kpages(1) : alloc_kpages_nowait(1);
+	if (kva == 0) {
+		return 0;
+	}
+	bzero((void *)kva, PAGE_SIZE);
+	paddr = KVADDR_TO_PADDR(kva);
+	page_init(paddr);
+	return paddr;
+}
+
+paddr_t
+page_alloc(void)
+{
+	return page_zalloc(true);
+}
+
+paddr_t
+page_alloc_nowait(void)
+{
+	return page_zalloc(false);
+}
+
+paddr_t
+page_copy(paddr_t src)
 {
-    firstpaddr = ram_getfirst();
-	lastpaddr = ram_getsize() - 1;
-	paddr_t size = lastpaddr - firstpaddr;
-	int npages = size / PAGE_SIZE;
-    spinlock_acquire(&coremap_splk);
-	coremap = (struct coremap_entry*)PADDR_TO_KVADDR(firstpaddr);
-    coremap_entries = npages;
-    /* Coremap memory is initalized to free */
-	for (int i = 0; i < npages; i++) {
-        coremap[i].freecount = 0;
-        coremap[i].block_start = 0;
-        coremap[i].block_end = 0;
+	vaddr_t kva;
+	paddr_t paddr;
+
+	kva = alloc_kpages(1);
+	if (kva == 0) {
+		return 0;
 	}
-    /* Steal memory from RAM for coremap */
-    spinlock_acquire(&stealmem_lock);
-    ram_stealmem(npages);
-    spinlock_release(&stealmem_lock);
-    spinlock_release(&coremap_splk);
+	memcpy((void *)kva, (const void *)PADDR_TO_KVADDR(src), PAGE_SIZE);
+	paddr = KVADDR_TO_PADDR(kva);
+	page_init(paddr);
+	return paddr;
 }
 
 void
-vm_tlbshootdown_all(void)
+page_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr,
+	      unsigned slot)
+{
+	struct coremap_entry *cme;
+
+	cme = &coremap[page_index(paddr)];
+	spinlock_acquire(&coremap_splk);
+	KASSERT(cme->cm_refcount == 1);
+	KASSERT(cme->cm_slot == SWAP_NOSLOT);
+	cme->cm_as = as;
+	cme->cm_vaddr = vaddr;
+	cme->cm_slot = slot;
+	cme->cm_flags |= CM_USER;
+	as->rss++;
+	spinlock_release(&coremap_splk);
+}
+
+struct addrspace *
+page_lockowner(paddr_t paddr, vaddr_t *vaddr, bool *held)
 {
-	/* Unimplemented */
+	struct coremap_entry *cme;
+	struct addrspace *as;
+
+	cme = &coremap[page_index(paddr)];
+	spinlock_acquire(&coremap_splk);
+	if ((cme->cm_flags & (CM_USER | CM_BUSY | CM_WIRED)) != CM_USER) {
+		spinlock_release(&coremap_splk);
+		return NULL;
+	}
+	/* As in vm_clock_select, the owner can't go while it owns this. */
+	as = cme->cm_as;
+	*held = lock_do_i_hold(as->lock);
+	if (!*held && !lock_tryacquire(as->lock)) {
+		spinlock_release(&coremap_splk);
+		return NULL;
+	}
+	*vaddr = cme->cm_vaddr;
+	spinlock_release(&coremap_splk);
+	return as;
 }
 
+/* The frame at CME is no longer its owner's; uncount it. */
+static
 void
-vm_tlbshootdown(const struct tlbshootdown *ts)
+page_clearowner(struct coremap_entry *cme)
 {
-	/* Unimplemented */
-	(void) ts;
+	KASSERT(spinlock_do_i_hold(&coremap_splk));
+
+	if (cme->cm_as != NULL) {
+		KASSERT(cme->cm_as->rss > 0);
+		cme->cm_as->rss--;
+		cme->cm_as = NULL;
+	}
+	if (cme->cm_flags & CM_WIRED) {
+		KASSERT(coremap_nwired > 0);
+		cme->cm_flags &= ~CM_WIRED;
+		coremap_nwired--;
+	}
 }
 
-int
-vm_fault(int faulttype, vaddr_t faultaddress)
+void
+page_wire(paddr_t paddr)
 {
-	/* Unimplemented */
-	(void) faulttype;
-	(void) faultaddress;
+	struct coremap_entry *cme;
+
+	cme = &coremap[page_index(paddr)];
+	spinlock_acquire(&coremap_splk);
+	if ((cme->cm_flags & (CM_USER | CM_WIRED)) == CM_USER) {
+		cme->cm_flags |= CM_WIRED;
+		coremap_nwired++;
+	}
+	spinlock_release(&coremap_splk);
+}
+
+void
+page_unwire(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+
+	cme = &coremap[page_index(paddr)];
+	spinlock_acquire(&coremap_splk);
+	if (cme->cm_flags & CM_WIRED) {
+		KASSERT(coremap_nwired > 0);
+		cme->cm_flags &= ~CM_WIRED;
+		coremap_nwired--;
+	}
+	spinlock_release(&coremap_splk);
+}
+
+bool
+page_wire_reserve(unsigned npages)
+{
+	bool ok;
+
+	spinlock_acquire(&coremap_splk);
+	ok = coremap_nlocked + npages <= coremap_entries / VM_WIRED_DIV;
+	if (ok) {
+		coremap_nlocked += npages;
+	}
+	spinlock_release(&coremap_splk);
+	return ok;
+}
+
+void
+page_wire_unreserve(unsigned npages)
+{
+	spinlock_acquire(&coremap_splk);
+	KASSERT(coremap_nlocked >= npages);
+	coremap_nlocked -= npages;
+	spinlock_release(&coremap_splk);
+}
+
+void
+page_incref(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+	unsigned slot;
+
+	cme = &coremap[page_index(paddr)];
+	spinlock_acquire(&coremap_splk);
+	KASSERT(cme->cm_refcount > 0 && cme->cm_refcount < 0xffff);
+	cme->cm_refcount++;
+
+	/*
+	 * A shared frame has no single owner to evict it from, and
+	 * the sharers' PTEs lose their dirty bits, so its swap copy
+	 * can't be trusted to be clean any more either.
+	 */
+	cme->cm_flags &= ~CM_USER;
+	page_clearowner(cme);
+	slot = cme->cm_slot;
+	cme->cm_slot = SWAP_NOSLOT;
+	spinlock_release(&coremap_splk);
+
+	if (slot != SWAP_NOSLOT) {
+		swap_free(slot);
+	}
+}
+
+unsigned
+page_refcount(paddr_t paddr)
+{
+	return coremap[page_index(paddr)].cm_refcount;
+}
+
+bool
+page_iszeroframe(paddr_t paddr)
+{
+	return paddr == vm_zeroframe;
+}
+
+void
+page_free(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+	unsigned refs, slot = SWAP_NOSLOT;
+
+	cme = &coremap[page_index(paddr)];
+
+	/*
+	 * The clock hand reads the owner fields, so they are cleared
+	 * under the coremap lock even when this is the last mapping.
+	 */
+	spinlock_acquire(&coremap_splk);
+	KASSERT(cme->cm_refcount > 0);
+	KASSERT((cme->cm_flags & CM_BUSY) == 0);
+	refs = --cme->cm_refcount;
+	if (refs == 0) {
+		cme->cm_flags &= ~CM_USER;
+		page_clearowner(cme);
+		slot = cme->cm_slot;
+		cme->cm_slot = SWAP_NOSLOT;
+	}
+	spinlock_release(&coremap_splk);
+
+	if (refs == 0) {
+		if (slot != SWAP_NOSLOT) {
+			swap_free(slot);
+		}
+		free_kpages(PADDR_TO_KVADDR(paddr));
+	}
+}
+
+void
+vm_pageout_done(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+
+	cme = &coremap[page_index(paddr)];
+	spinlock_acquire(&coremap_splk);
+	KASSERT(cme->cm_flags & CM_BUSY);
+	KASSERT(cme->cm_slot == SWAP_NOSLOT);
+	cme->cm_flags &= ~(CM_USER | CM_BUSY);
+	page_clearowner(cme);
+	cme->cm_refcount = 0;
+	spinlock_release(&coremap_splk);
+
+	free_kpages(PADDR_TO_KVADDR(paddr));
+}
+
+/*
+ * Page replacement.
+ *
+ * A clock hand sweeps the coremap looking for owned user frames. The
+ * reference bit is emulated: a frame whose PTE has PTE_REF gets a
+ * second chance, with PTE_REF cleared and the translation dropped
+ * from this cpu's TLB so the next use faults and sets it again. (A
+ * stale entry in another cpu's TLB can make a page look colder than
+ * it is; the eviction itself does a full shootdown.)
+ *
+ * Looking at a victim's PTE needs its address space lock. The
+ * evicting thread may already hold one, that of the process whose
+ * fault got us here; any other is only try-locked, so eviction never
+ * waits on a fault in progress.
+ *
+ * The victim takes along the unreferenced pages that follow it in
+ * the same address space, up to VM_EVICT_CLUSTER in all, so that one
+ * batched shootdown covers the lot.
+ *
+ * A dirty victim, or one without a copy in swap, is queued for
+ * page-out and its frame is freed when the write finishes. A clean
+ * one is just dropped: its PTE goes back to the swap copy, or to 0
+ * for pages of a read-only region, which the next fault rebuilds
+ * from the executable. A page given up with MADV_FREE and not
+ * written since is dropped for good, along with any swap copy, and
+ * comes back zero-filled.
+ *
+ * A process at its RLIMIT_RSS replaces locally: before a fault gives
+ * it another frame it evicts a cluster of its own, so its limit is
+ * not paid for by anyone else. The victim is found by a hand of its
+ * own (rss_clock, an address) going round its page table, so the
+ * search costs in proportion to the process rather than to memory. Its RSS counts the frames it owns, those the clock could
+ * take from it; shared frames are charged to nobody. Load control
+ * (loadctl.h) swaps out a suspended process the same way, until it
+ * owns nothing. A second chance resets the page's working-set age
+ * too, so the reference isn't lost to load control's sampling.
+ */
+
+static unsigned vm_nevicted;		/* frames queued for page-out */
+static unsigned vm_ndropped;		/* clean frames just freed */
+static unsigned vm_nlazyfreed;		/* MADV_FREE frames discarded */
+static unsigned vm_nrsslocal;		/* evictions at an RSS limit */
+static unsigned vm_nshootdowns;		/* TLB shootdown batches */
+static unsigned vm_nshootpages;		/* pages in them */
+static unsigned vm_nshootipis;		/* IPIs sent for them */
+static unsigned vm_nprefetched;		/* pages mapped by fault-around */
+static unsigned vm_nprefetchhits;	/* of those, faulted on later */
+static unsigned vm_nprefetchunused;	/* of those, evicted still marked */
+static unsigned vm_nzeromapped;		/* read faults given the zero frame */
+static unsigned vm_nzerowritten;	/* zero frame mappings written */
+static unsigned vm_ndroppedbehind;	/* pages MADV_SEQUENTIAL let go */
+static unsigned vm_nwillneed;		/* pages MADV_WILLNEED brought in */
+
+/*
+ * Pick a victim among all owned frames. On success the frame is
+ * marked CM_BUSY and the owner's lock is held; *HELD says whether we
+ * held it already.
+ */
+static
+int
+vm_clock_select(unsigned *ret_index, struct addrspace **ret_as,
+		bool *ret_held)
+{
+	struct coremap_entry *cme;
+	struct addrspace *as;
+	unsigned n, index;
+	bool held;
+	pte_t *pte;
+
+	spinlock_acquire(&coremap_splk);
+	for (n = 0; n < 2 * coremap_entries; n++) {
+		index = coremap_clock;
+		coremap_clock = (index + 1) % coremap_entries;
+
+		cme = &coremap[index];
+		if ((cme->cm_flags & (CM_USER | CM_BUSY | CM_WIRED)) !=
+		    CM_USER) {
+			continue;
+		}
+		as = cme->cm_as;
+		held = lock_do_i_hold(as->lock);
+		if (!held && !lock_tryacquire(as->lock)) {
+			continue;
+		}
+
+		pte = pt_lookup(as->ptable, cme->cm_vaddr, false);
+		KASSERT(pte != NULL && (*pte & PTE_VALID));
+		KASSERT((*pte & PTE_FRAME) == firstpaddr + index * PAGE_SIZE);
+
+		if (*pte & PTE_REF) {
+			/* Still counts for the working set (loadctl.h). */
+			*pte &= ~(PTE_REF | PTE_AGE);
+			vm_tlb_invalidate(as, cme->cm_vaddr);
+			if (!held) {
+				lock_release(as->lock);
+			}
+			continue;
+		}
+
+		cme->cm_flags |= CM_BUSY;
+		spinlock_release(&coremap_splk);
+		*ret_index = index;
+		*ret_as = as;
+		*ret_held = held;
+		return 0;
+	}
+	spinlock_release(&coremap_splk);
+	return ENOMEM;
+}
+
+struct vm_clock_local {
+	struct addrspace *cl_as;
+	unsigned cl_index;		/* the victim found */
+	vaddr_t cl_vaddr;		/* and its address */
+};
+
+/* pt_walk callback for vm_clock_select_local; nonzero to stop. */
+static
+int
+vm_clock_local_page(vaddr_t vaddr, pte_t *pte, void *data)
+{
+	struct vm_clock_local *cl = data;
+	struct coremap_entry *cme;
+	unsigned index;
+
+	if ((*pte & (PTE_VALID | PTE_SHARED)) != PTE_VALID) {
+		return 0;
+	}
+	index = ((*pte & PTE_FRAME) - firstpaddr) / PAGE_SIZE;
+	cme = &coremap[index];
+
+	spinlock_acquire(&coremap_splk);
+	if ((cme->cm_flags & (CM_USER | CM_BUSY | CM_WIRED)) != CM_USER ||
+	    cme->cm_as != cl->cl_as || cme->cm_vaddr != vaddr) {
+		/* Not its own: copy-on-write from another, say. */
+		spinlock_release(&coremap_splk);
+		return 0;
+	}
+	if (*pte & PTE_REF) {
+		/* Still counts for the working set (loadctl.h). */
+		*pte &= ~(PTE_REF | PTE_AGE);
+		vm_tlb_invalidate(cl->cl_as, vaddr);
+		spinlock_release(&coremap_splk);
+		return 0;
+	}
+	cme->cm_flags |= CM_BUSY;
+	spinlock_release(&coremap_splk);
+
+	cl->cl_index = index;
+	cl->cl_vaddr = vaddr;
+	return 1;
+}
+
+/*
+ * Pick a victim among AS's own frames, whose lock the caller holds,
+ * going round its page table from its own hand. On success the frame
+ * is marked CM_BUSY.
+ */
+static
+int
+vm_clock_select_local(struct addrspace *as, unsigned *ret_index)
+{
+	struct vm_clock_local cl;
+	unsigned pass;
+	vaddr_t hand;
+	int found;
+
+	KASSERT(lock_do_i_hold(as->lock));
+
+	cl.cl_as = as;
+	hand = as->rss_clock;
+	/* Twice round, so that second chances can come back around. */
+	for (pass = 0; pass < 4; pass++) {
+		if (pass % 2 == 0) {
+			found = pt_walk(as->ptable, hand, USERSPACETOP,
+					vm_clock_local_page, &cl);
+		}
+		else {
+			found = pt_walk(as->ptable, 0, hand,
+					vm_clock_local_page, &cl);
+		}
+		if (found) {
+			as->rss_clock = cl.cl_vaddr + PAGE_SIZE;
+			if (as->rss_clock >= USERSPACETOP) {
+				as->rss_clock = 0;
+			}
+			*ret_index = cl.cl_index;
+			return 0;
+		}
+	}
+	return ENOMEM;
+}
+
+/*
+ * Gather up to VM_EVICT_CLUSTER - 1 pages following the victim at
+ * INDEX that are just as ready to go: resident, unreferenced, owned
+ * by the same address space and not already busy. They are marked
+ * CM_BUSY and their coremap indexes stored after the victim's in
+ * INDEXES. Returns the size of the cluster, victim included.
+ */
+static
+unsigned
+vm_evict_cluster(struct addrspace *as, unsigned *indexes)
+{
+	struct coremap_entry *cme;
+	unsigned n, index;
+	vaddr_t vaddr;
+	pte_t *pte;
+
+	KASSERT(lock_do_i_hold(as->lock));
+
+	vaddr = coremap[indexes[0]].cm_vaddr;
+	for (n = 1; n < VM_EVICT_CLUSTER; n++) {
+		vaddr += PAGE_SIZE;
+		if (vaddr >= USERSPACETOP) {
+			break;
+		}
+		pte = pt_lookup(as->ptable, vaddr, false);
+		if (pte == NULL ||
+		    (*pte & (PTE_VALID | PTE_REF | PTE_COW)) != PTE_VALID) {
+			break;
+		}
+		index = ((*pte & PTE_FRAME) - firstpaddr) / PAGE_SIZE;
+
+		spinlock_acquire(&coremap_splk);
+		cme = &coremap[index];
+		if ((cme->cm_flags & (CM_USER | CM_BUSY | CM_WIRED)) !=
+		    CM_USER || cme->cm_as != as || cme->cm_vaddr != vaddr) {
+			spinlock_release(&coremap_splk);
+			break;
+		}
+		cme->cm_flags |= CM_BUSY;
+		spinlock_release(&coremap_splk);
+		indexes[n] = index;
+	}
+	return n;
+}
+
+/*
+ * Evict the busy page at INDEX, whose translations are already gone.
+ * On failure the page is left mapped and no longer busy.
+ */
+static
+int
+vm_evict_page(struct addrspace *as, unsigned index)
+{
+	struct coremap_entry *cme;
+	struct region *region;
+	unsigned slot;
+	paddr_t paddr;
+	vaddr_t vaddr;
+	pte_t *pte;
+	int result;
+
+	cme = &coremap[index];
+	paddr = firstpaddr + index * PAGE_SIZE;
+	vaddr = cme->cm_vaddr;
+	pte = pt_lookup(as->ptable, vaddr, false);
+
+	if (*pte & PTE_PREFETCH) {
+		vm_nprefetchunused++;
+	}
+
+	slot = cme->cm_slot;
+	region = as_find_region(as, vaddr);
+	if ((*pte & (PTE_LAZYFREE | PTE_DIRTY)) == PTE_LAZYFREE) {
+		if (slot != SWAP_NOSLOT) {
+			swap_free(slot);
+			cme->cm_slot = SWAP_NOSLOT;
+		}
+		*pte = 0;
+		vm_pageout_done(paddr);
+		vm_nlazyfreed++;
+	}
+	else if (!(*pte & PTE_DIRTY) && slot != SWAP_NOSLOT) {
+		/* Swap already has it. */
+		cme->cm_slot = SWAP_NOSLOT;
+		*pte = PTE_MKSWAP(slot);
+		vm_pageout_done(paddr);
+		vm_ndropped++;
+	}
+	else if (!(*pte & PTE_DIRTY) && region != NULL &&
+		 !region->writeable) {
+		*pte = 0;
+		vm_pageout_done(paddr);
+		vm_ndropped++;
+	}
+	else {
+		if (slot != SWAP_NOSLOT && swap_refcount(slot) > 1) {
+			/* Someone else still needs the old contents. */
+			swap_free(slot);
+			slot = SWAP_NOSLOT;
+			cme->cm_slot = SWAP_NOSLOT;
+		}
+		if (slot == SWAP_NOSLOT) {
+			result = swap_alloc(&slot);
+			if (result) {
+				spinlock_acquire(&coremap_splk);
+				cme->cm_flags &= ~CM_BUSY;
+				spinlock_release(&coremap_splk);
+				return result;
+			}
+		}
+		/* The page-out may finish after AS is gone. */
+		spinlock_acquire(&coremap_splk);
+		cme->cm_slot = SWAP_NOSLOT;
+		page_clearowner(cme);
+		spinlock_release(&coremap_splk);
+		*pte = PTE_MKSWAP(slot);
+		swap_pageout(slot, paddr);
+		vm_nevicted++;
+	}
+	return 0;
+}
+
+/*
+ * Evict the next victim, from ONLY if that is set, and whatever
+ * cluster of its neighbours can go with it, shooting them all down
+ * in one batch.
+ */
+static
+int
+vm_evict(struct addrspace *only)
+{
+	unsigned indexes[VM_EVICT_CLUSTER];
+	struct tlb_batch tb;
+	struct addrspace *as;
+	unsigned i, j, n;
+	bool held;
+	int result;
+
+	if (only != NULL) {
+		result = vm_clock_select_local(only, &indexes[0]);
+		as = only;
+		held = true;
+	}
+	else {
+		result = vm_clock_select(&indexes[0], &as, &held);
+	}
+	if (result) {
+		return result;
+	}
+	n = vm_evict_cluster(as, indexes);
+
+	/* Nobody may write the frames while they're being copied out. */
+	vm_tlb_batch_init(&tb, as);
+	for (i = 0; i < n; i++) {
+		vm_tlb_batch_add(&tb, coremap[indexes[i]].cm_vaddr);
+	}
+	vm_tlb_batch_flush(&tb);
+
+	for (i = 0; i < n; i++) {
+		result = vm_evict_page(as, indexes[i]);
+		if (result) {
+			break;
+		}
+	}
+	/* Out of swap: leave the rest where they are. */
+	for (j = i + 1; j < n; j++) {
+		spinlock_acquire(&coremap_splk);
+		coremap[indexes[j]].cm_flags &= ~CM_BUSY;
+		spinlock_release(&coremap_splk);
+	}
+
+	if (!held) {
+		lock_release(as->lock);
+	}
+	/* Evicting any of them is progress. */
+	return i > 0 ? 0 : result;
+}
+
+unsigned
+vm_swapout(struct addrspace *as)
+{
+	unsigned rss;
+
+	KASSERT(lock_do_i_hold(as->lock));
+
+	rss = as->rss;
+	if (!swap_enabled()) {
+		return 0;
+	}
+	while (as->rss > 0 && vm_evict(as) == 0) {
+		/* nothing */
+	}
+	return rss - as->rss;
+}
+
+/* The current process's RLIMIT_RSS, in pages. */
+static
+unsigned
+vm_rss_limit(void)
+{
+	rlim_t limit;
+
+	limit = curproc->rss_limit.rlim_cur;
+	if (limit == RLIM_INFINITY || limit / PAGE_SIZE >= (unsigned)-1) {
+		return (unsigned)-1;
+	}
+	return limit / PAGE_SIZE;
+}
+
+/*
+ * AS is about to get another frame; if it is at its limit, make room
+ * among its own pages first. Without swap, or with nothing of its own
+ * that can go, it just goes over.
+ */
+static
+void
+vm_rss_enforce(struct addrspace *as)
+{
+	KASSERT(lock_do_i_hold(as->lock));
+
+	if (as->rss < vm_rss_limit() || !swap_enabled()) {
+		return;
+	}
+	if (vm_evict(as) == 0) {
+		vm_nrsslocal++;
+	}
+}
+
+/*
+ * Called when an allocation fails: make some memory free, or about
+ * to be. Returns false if that can't be done here.
+ */
+static
+bool
+vm_reclaim(void)
+{
+	/* Pre-zeroed frames are free memory in all but name. */
+	if (coremap != NULL && zeropool_drain()) {
+		return true;
+	}
+	/* So are the frames cached in the magazines. */
+	if (coremap != NULL && pagemag_reclaim()) {
+		return true;
+	}
+
+	/* Eviction sleeps, so only from thread context without spinlocks */
+	if (coremap == NULL || !swap_enabled() || curthread == NULL ||
+	    curthread->t_in_interrupt || curcpu->c_spinlocks > 0) {
+		return false;
+	}
+
+	/*
+	 * Cached program text and file pages nobody maps are cheapest
+	 * to give back; writing dirty file pages is left to the daemon.
+	 */
+	if (image_reclaim() || memobj_reclaim(false) || vm_evict(NULL) == 0) {
+		return true;
+	}
+	/* Nothing evictable right now; wait for a page-out to finish. */
+	return swap_wait();
+}
+
+/*
+ * Pageout daemon.
+ *
+ * Allocations that may sleep check free memory first (coremap_nfree,
+ * which counts the zero pool and magazines). Below vm_freelow they
+ * wake the daemon, which gives back cached text and unmapped file
+ * pages and evicts clusters until vm_freehigh pages are free or
+ * nothing more can go (trimming MAP_SHARED mappings first), waiting
+ * for the page-outs it queued after every VM_PAGEOUT_BATCH clusters
+ * so that what it counts as free actually is. Above vm_freemin the
+ * allocation then goes ahead; below it, the allocating thread sleeps
+ * until the daemon has got through another batch. If an allocation
+ * still fails it reclaims for itself with vm_reclaim, as before.
+ */
+static struct spinlock pageout_splk = SPINLOCK_INITIALIZER;
+static struct wchan *pageout_wchan;	/* the daemon waits for work */
+static struct wchan *pageout_waitchan;	/* allocations wait for the daemon */
+static struct thread *pageout_thread;
+static bool pageout_wanted;
+static unsigned pageout_gen;		/* batches done */
+static unsigned vm_freemin, vm_freelow, vm_freehigh;
+
+/* Statistics */
+static unsigned pageout_nwakeups;	/* times the daemon was woken */
+static unsigned pageout_nreclaims;	/* clusters/text reclaims it did */
+static unsigned pageout_nstalls;	/* allocations that waited for it */
+
+static
+void
+vm_pageout_poke(void)
+{
+	unsigned nfree, gen;
+	bool wait;
+
+	if (pageout_thread == NULL || curthread == pageout_thread) {
+		return;
+	}
+	nfree = coremap_nfree();
+	if (nfree >= vm_freelow) {
+		return;
+	}
+	wait = nfree < vm_freemin && !curthread->t_in_interrupt &&
+		curcpu->c_spinlocks == 0;
+
+	spinlock_acquire(&pageout_splk);
+	if (!pageout_wanted) {
+		pageout_wanted = true;
+		wchan_wakeone(pageout_wchan, &pageout_splk);
+	}
+	if (wait) {
+		pageout_nstalls++;
+		gen = pageout_gen;
+		while (gen == pageout_gen) {
+			wchan_sleep(pageout_waitchan, &pageout_splk);
+		}
+	}
+	spinlock_release(&pageout_splk);
+}
+
+/* Let waiting allocations go and see how things stand. */
+static
+void
+vm_pageout_batchdone(void)
+{
+	spinlock_acquire(&pageout_splk);
+	pageout_gen++;
+	wchan_wakeall(pageout_waitchan, &pageout_splk);
+	spinlock_release(&pageout_splk);
+}
+
+static
+void
+vm_pageout_daemon(void *data1, unsigned long data2)
+{
+	unsigned i, ntrims;
+
+	(void)data1;
+	(void)data2;
+
+	pageout_thread = curthread;
+	while (1) {
+		spinlock_acquire(&pageout_splk);
+		while (!pageout_wanted) {
+			wchan_sleep(pageout_wchan, &pageout_splk);
+		}
+		spinlock_release(&pageout_splk);
+		pageout_nwakeups++;
+
+		ntrims = 0;
+		while (coremap_nfree() < vm_freehigh) {
+			for (i = 0; i < VM_PAGEOUT_BATCH; i++) {
+				if (!image_reclaim() && !memobj_reclaim(true) &&
+				    (!swap_enabled() || vm_evict(NULL) != 0)) {
+					break;
+				}
+				pageout_nreclaims++;
+			}
+			/* Let the writes land before counting again. */
+			while (swap_enabled() && swap_wait()) {
+				/* nothing */
+			}
+			vm_pageout_batchdone();
+			if (i == 0) {
+				/*
+				 * Nothing left we can take, unless mapped file
+				 * pages are let go. The first pass only clears
+				 * the reference bits of those in use.
+				 */
+				if (ntrims == 2 || loadctl_trim_shared() == 0) {
+					break;
+				}
+				ntrims++;
+			}
+		}
+
+		/* Pokes while we worked are answered by this pass. */
+		spinlock_acquire(&pageout_splk);
+		pageout_wanted = false;
+		spinlock_release(&pageout_splk);
+		vm_pageout_batchdone();
+	}
+}
+
+void
+vm_pageout_bootstrap(void)
+{
+	int result;
+
+	vm_freemin = coremap_entries / VM_FREEMIN_DIV;
+	vm_freelow = coremap_entries / VM_FREELOW_DIV;
+	vm_freehigh = coremap_entries / VM_FREEHIGH_DIV;
+
+	pageout_wchan = wchan_create("pageout");
+	pageout_waitchan = wchan_create("pageoutwait");
+	if (pageout_wchan == NULL || pageout_waitchan == NULL) {
+		panic("vm_pageout_bootstrap: out of memory\n");
+	}
+	result = thread_fork("pageout", NULL, vm_pageout_daemon, NULL, 0);
+	if (result) {
+		panic("vm_pageout_bootstrap: thread_fork: %s\n",
+		      strerror(result));
+	}
+}
+
+unsigned
+coremap_npages(void)
+{
+	return coremap_entries;
+}
+
+paddr_t
+coremap_paddr(unsigned index)
+{
+	KASSERT(index < coremap_entries);
+	return firstpaddr + index * PAGE_SIZE;
+}
+
+/*
+ * Free pages, counting those sitting in page magazines and the zero
+ * pool. The magazine counts are read without their cpus' cooperation,
+ * so this is only a snapshot.
+ */
+unsigned
+coremap_nfree(void)
+{
+	unsigned i, n;
+
+	n = coremap_freecount + zeropool_count;
+	for (i = 0; i < cpu_count(); i++) {
+		n += cpu_get(i)->c_pagemag.pm_count;
+	}
+	return n;
+}
+
+unsigned
+coremap_nbuddy(void)
+{
+	return coremap_freecount;
+}
+
+unsigned
+coremap_wired(void)
+{
+	return coremap_nwired;
+}
+
+void
+vm_printstats(void)
+{
+	struct page_magazine *pm;
+	unsigned i;
+
+	kprintf("coremap: %u pages, %u free in coremap, %u wired, "
+		"%u locked\n", coremap_entries, coremap_freecount,
+		coremap_nwired, coremap_nlocked);
+	kprintf("paging: %u evicted, %u dropped clean, %u lazily freed, "
+		"%u at RSS limits\n", vm_nevicted, vm_ndropped, vm_nlazyfreed,
+		vm_nrsslocal);
+	kprintf("tlb: %u shootdowns of %u pages, %u IPIs\n",
+		vm_nshootdowns, vm_nshootpages, vm_nshootipis);
+	kprintf("fault-around: %u pages prefetched, %u faulted on later, "
+		"%u evicted unused\n",
+		vm_nprefetched, vm_nprefetchhits, vm_nprefetchunused);
+	kprintf("madvise: %u pages dropped behind, %u brought in early\n",
+		vm_ndroppedbehind, vm_nwillneed);
+	kprintf("zero frame: %u mappings, %u read faults, %u written\n",
+		page_refcount(vm_zeroframe) - 1, vm_nzeromapped,
+		vm_nzerowritten);
+	kprintf("pageout: free %u/%u/%u (min/low/high), %u wakeups, "
+		"%u reclaims, %u stalls\n", vm_freemin, vm_freelow,
+		vm_freehigh, pageout_nwakeups, pageout_nreclaims,
+		pageout_nstalls);
+	vm_zeropool_printstats();
+	swap_printstats();
+	image_printstats();
+	memobj_printstats();
+	loadctl_printstats();
+	pagemerge_printstats();
+	vmalloc_printstats();
+	for (i = 0; i < cpu_count(); i++) {
+		pm = &cpu_get(i)->c_pagemag;
+		kprintf("cpu%u magazine: %u cached, %u hits, %u misses\n",
+			i, pm->pm_count, pm->pm_hits, pm->pm_misses);
+		kprintf("cpu%u asid: generation %u\n",
+			i, cpu_get(i)->c_asid_cache / NUM_TLBPID);
+		kprintf("cpu%u refill: %u fast, %u slow\n", i,
+			vm_refill[i].vr_nrefill - vm_refill[i].vr_nslow,
+			vm_refill[i].vr_nslow);
+	}
+}
+
+void
+vm_bootstrap(void)
+{
+	struct coremap_entry *cm;
+	paddr_t cmpaddr, ramfirst, ramlast;
+	unsigned npages, cmpages, i;
+
+	ramfirst = ram_getfirst();
+	ramlast = ram_getsize();
+
+	/* Size the coremap for everything left and steal room for it. */
+	npages = (ramlast - ramfirst) / PAGE_SIZE;
+	cmpages = DIVROUNDUP(npages * sizeof(struct coremap_entry), PAGE_SIZE);
+	cmpaddr = ram_stealmem(cmpages);
+	if (cmpaddr == 0) {
+		panic("vm_bootstrap: no memory for coremap");
+	}
+
+	/* No more stealing after this; the coremap owns the rest. */
+	firstpaddr = ram_getfirstfree();
+	lastpaddr = ramlast;
+
+	cm = (struct coremap_entry *)PADDR_TO_KVADDR(cmpaddr);
+	npages = (lastpaddr - firstpaddr) / PAGE_SIZE;
+	for (i = 0; i < npages; i++) {
+		cm[i].cm_flags = 0;
+		cm[i].cm_refcount = 0;
+		cm[i].cm_as = NULL;
+		cm[i].cm_vaddr = 0;
+		cm[i].cm_slot = SWAP_NOSLOT;
+	}
+	for (i = 0; i < MAXCPUS; i++) {
+		vm_refill[i].vr_pt = &vm_nullpt;
+	}
+	for (i = 0; i <= BUDDY_MAXORDER; i++) {
+		buddy_lists[i].bl_next = &buddy_lists[i];
+		buddy_lists[i].bl_prev = &buddy_lists[i];
+	}
+
+	spinlock_acquire(&coremap_splk);
+	coremap = cm;
+	coremap_entries = npages;
+	coremap_freecount = 0;
+	buddy_free_range(0, coremap_entries);
+	spinlock_release(&coremap_splk);
+
+	/* Read faults on untouched anonymous memory all map this. */
+	vm_zeroframe = page_alloc();
+	if (vm_zeroframe == 0) {
+		panic("vm_bootstrap: no memory for the zero frame\n");
+	}
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+	vm_tlb_flush();
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	vm_tlb_invalidate(ts->ts_as, ts->ts_vaddr);
+}
+
+/*
+ * Address space IDs.
+ *
+ * Each cpu hands out ASIDs from its own counter, c_asid_cache: the
+ * low bits are the hardware ASID and the rest a generation number.
+ * An address space remembers the value it got on each cpu and keeps
+ * using it as long as the generation is current, so its entries stay
+ * in the TLB while other processes run. When the low bits wrap, the
+ * cpu flushes its TLB and starts a new generation, which retires
+ * every ASID it has handed out. ASID 0 is never handed out, so an
+ * as_asid value of 0 means none.
+ */
+
+static
+bool
+vm_asid_valid(uint32_t ctx)
+{
+	return ctx != 0 && ((ctx ^ curcpu->c_asid_cache) & ~ASID_MASK) == 0;
+}
+
+/* Make AS current on this cpu, getting it an ASID if need be. */
+static
+void
+vm_asid_load(struct addrspace *as)
+{
+	struct cpu *c = curcpu->c_self;
+	uint32_t ctx;
+
+	KASSERT(curthread->t_curspl > 0);
+
+	ctx = as->as_asid[c->c_number];
+	if (!vm_asid_valid(ctx)) {
+		ctx = ++c->c_asid_cache;
+		if ((ctx & ASID_MASK) == 0) {
+			/* Out of ASIDs: new generation. */
+			vm_tlb_flush();
+			ctx = ++c->c_asid_cache;
+		}
+		as->as_asid[c->c_number] = ctx;
+	}
+	c->c_asid = ctx & ASID_MASK;
+	tlb_setpid(c->c_asid);
+	vm_refill[c->c_number].vr_pt = as->ptable;
+}
+
+void
+vm_tlb_activate(struct addrspace *as)
+{
+	int spl;
+
+	spl = splhigh();
+	vm_asid_load(as);
+	splx(spl);
+}
+
+/*
+ * Forget all of AS's translations everywhere by giving up its ASIDs:
+ * whatever is left in the TLBs under the old ones can never match
+ * again. Only for the running process's own address space (or one
+ * that isn't running), since other cpus' slots are cleared without
+ * telling them.
+ */
+void
+vm_tlb_drop_as(struct addrspace *as)
+{
+	unsigned i;
+	int spl;
+
+	spl = splhigh();
+	for (i = 0; i < MAXCPUS; i++) {
+		as->as_asid[i] = 0;
+	}
+	if (as == proc_getas()) {
+		vm_asid_load(as);
+	}
+	splx(spl);
+}
+
+/*
+ * Stop refilling from AS's page table on any cpu, before it is freed.
+ * A cpu that still points at it isn't running AS and may be switching
+ * to another address space right now; if that store loses to ours,
+ * the worst case is that it takes the slow path until its next switch.
+ */
+void
+vm_tlb_forget_as(struct addrspace *as)
+{
+	unsigned i;
+	int spl;
+
+	spl = splhigh();
+	for (i = 0; i < MAXCPUS; i++) {
+		if (vm_refill[i].vr_pt == as->ptable) {
+			vm_refill[i].vr_pt = &vm_nullpt;
+		}
+	}
+	splx(spl);
+}
+
+/*
+ * TLB handling for the current cpu.
+ */
+
+void
+vm_tlb_flush(void)
+{
+	int i, spl;
+
+	spl = splhigh();
+	for (i = 0; i < NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setpid(curcpu->c_asid);
+	splx(spl);
+}
+
+void
+vm_tlb_load(vaddr_t vaddr, uint32_t pte)
+{
+	uint32_t entryhi, entrylo;
+	int spl, index;
+
+	entrylo = pte & PTE_TLBMASK;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	entryhi = (vaddr & TLBHI_VPAGE) | (curcpu->c_asid << TLBHI_PIDSHIFT);
+	/* Replace an existing entry (e.g. on a write to a clean page). */
+	index = tlb_probe(entryhi, 0);
+	if (index >= 0) {
+		tlb_write(entryhi, entrylo, index);
+	}
+	else {
+		tlb_random(entryhi, entrylo);
+	}
+	splx(spl);
+}
+
+void
+vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr)
+{
+	uint32_t ctx;
+	int spl, index;
+
+	spl = splhigh();
+	/* Global kseg2 translations match under whatever ASID is loaded. */
+	ctx = as != NULL ? as->as_asid[curcpu->c_number] : curcpu->c_asid;
+	if (as == NULL || vm_asid_valid(ctx)) {
+		index = tlb_probe((vaddr & TLBHI_VPAGE) |
+				  ((ctx & ASID_MASK) << TLBHI_PIDSHIFT), 0);
+		if (index >= 0) {
+			tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+		}
+		tlb_setpid(curcpu->c_asid);
+	}
+	splx(spl);
+}
+
+void
+vm_tlb_shootdown(struct addrspace *as, vaddr_t vaddr)
+{
+	struct tlb_batch tb;
+
+	vm_tlb_batch_init(&tb, as);
+	vm_tlb_batch_add(&tb, vaddr);
+	vm_tlb_batch_flush(&tb);
+}
+
+void
+vm_tlb_flush_all(void)
+{
+	struct tlb_batch tb;
+
+	vm_tlb_batch_init(&tb, NULL);
+	tb.tb_all = true;
+	vm_tlb_batch_flush(&tb);
+}
+
+/*
+ * Batched shootdown.
+ *
+ * A cpu can only have translations for an address space under the
+ * ASID it last gave it, so cpus whose as_asid slot is empty or from
+ * an old generation are left alone. The slots are read without the
+ * other cpus' cooperation; that's safe because a cpu only moves to a
+ * new generation by flushing its TLB, and any entries it loads after
+ * we look come from the already-updated page table.
+ *
+ * The IPIs all go out before we wait for any of them, so the targets
+ * work in parallel. We don't wait at splhigh, since another cpu may
+ * be waiting on us the same way.
+ */
+
+void
+vm_tlb_batch_init(struct tlb_batch *tb, struct addrspace *as)
+{
+	tb->tb_as = as;
+	tb->tb_count = 0;
+	tb->tb_all = false;
+}
+
+void
+vm_tlb_batch_add(struct tlb_batch *tb, vaddr_t vaddr)
+{
+	if (tb->tb_all) {
+		return;
+	}
+	if (tb->tb_count < TLBSHOOTDOWN_MAX) {
+		tb->tb_ts[tb->tb_count].ts_as = tb->tb_as;
+		tb->tb_ts[tb->tb_count].ts_vaddr = vaddr & PAGE_FRAME;
+		tb->tb_count++;
+	}
+	else {
+		tb->tb_all = true;
+	}
+}
+
+/* Might cpu C hold translations for AS? Every cpu has the kernel's. */
+static
+bool
+vm_asid_live(struct addrspace *as, struct cpu *c)
+{
+	uint32_t ctx;
+
+	if (as == NULL) {
+		return true;
+	}
+	ctx = as->as_asid[c->c_number];
+	return ctx != 0 && ((ctx ^ c->c_asid_cache) & ~ASID_MASK) == 0;
+}
+
+void
+vm_tlb_batch_flush(struct tlb_batch *tb)
+{
+	struct cpu *self, *c;
+	unsigned gen[MAXCPUS];
+	bool sent[MAXCPUS];
+	unsigned i, n;
+	int spl;
+
+	n = tb->tb_count;
+	if (n == 0 && !tb->tb_all) {
+		return;
+	}
+
+	/* Pin ourselves to this cpu until the requests are out. */
+	spl = splhigh();
+	self = curcpu->c_self;
+	if (tb->tb_all) {
+		vm_tlb_flush();
+	}
+	else {
+		for (i = 0; i < n; i++) {
+			vm_tlb_invalidate(tb->tb_as, tb->tb_ts[i].ts_vaddr);
+		}
+	}
+	for (i = 0; i < cpu_count(); i++) {
+		c = cpu_get(i);
+		sent[i] = c != self && vm_asid_live(tb->tb_as, c);
+		if (sent[i]) {
+			gen[i] = tb->tb_all ? ipi_tlbshootdown_all(c) :
+				ipi_tlbshootdown_batch(c, tb->tb_ts, n);
+			vm_nshootipis++;
+		}
+	}
+	splx(spl);
+
+	for (i = 0; i < cpu_count(); i++) {
+		if (sent[i]) {
+			c = cpu_get(i);
+			while (c->c_shootdown_gen == gen[i]) {
+				/* spin */
+			}
+		}
+	}
+	vm_nshootdowns++;
+	vm_nshootpages += n;
+	tb->tb_count = 0;
+	tb->tb_all = false;
+}
+
+/*
+ * Read the file-backed part, if any, of the page at VADDR in REGION
+ * into the (already zeroed) frame at PADDR.
+ */
+static
+int
+vm_fill_page(struct region *region, vaddr_t vaddr, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	int result;
+
+	if (region == NULL || region->vn == NULL) {
+		return 0;
+	}
+
+	start = vaddr;
+	end = vaddr + PAGE_SIZE;
+	if (start < region->file_base) {
+		start = region->file_base;
+	}
+	if (end > region->file_base + region->file_size) {
+		end = region->file_base + region->file_size;
+	}
+	if (start >= end) {
+		return 0;
+	}
+
+	uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(paddr) + (start - vaddr)),
+		  end - start,
+		  region->file_offset + (start - region->file_base), UIO_READ);
+	result = VOP_READ(region->vn, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		/* load_elf checked the size; someone truncated the file */
+		return EIO;
+	}
+	return 0;
+}
+
+/* True if the never-touched page at VADDR in REGION reads as zeros. */
+static
+bool
+vm_page_iszero(struct region *region, vaddr_t vaddr)
+{
+	if (region == NULL) {
+		/* The heap */
+		return true;
+	}
+	if (region->object != NULL || region->image != NULL) {
+		return false;
+	}
+	return region->vn == NULL ||
+		vaddr + PAGE_SIZE <= region->file_base ||
+		vaddr >= region->file_base + region->file_size;
+}
+
+/*
+ * Give the never-touched page at VADDR a frame and set *PTE to map it:
+ * for a MAP_SHARED page, the memory object's frame; for a read-only
+ * program page, the shared frame from the image cache (read in now if
+ * nobody has yet); for a read (not WRITE) of a page that would just be
+ * zeroed, the zero frame, copy-on-write; otherwise a private frame,
+ * zeroed or filled from the file. Without WAIT, fails rather than
+ * paging anything out to make room.
+ */
+static
+int
+vm_page_new(struct addrspace *as, struct region *region, vaddr_t vaddr,
+	    bool write, bool wait, pte_t *pte)
+{
+	struct image *im;
+	paddr_t paddr;
+	int result;
+
+	if (region != NULL && region->object != NULL) {
+		result = memobj_getpage(region->object,
+					MEMOBJ_INDEX(region, vaddr), wait, &paddr);
+		if (result) {
+			return result;
+		}
+		*pte = paddr | PTE_VALID | PTE_SHARED;
+		return 0;
+	}
+
+	im = region != NULL ? region->image : NULL;
+	if (im != NULL) {
+		paddr = image_getpage(im, region->image_seg, vaddr);
+		if (paddr != 0) {
+			*pte = paddr | PTE_VALID | PTE_SHARED;
+			return 0;
+		}
+	}
+
+	if (!write && vm_page_iszero(region, vaddr) &&
+	    page_refcount(vm_zeroframe) < VM_ZEROFRAME_MAXREFS) {
+		page_incref(vm_zeroframe);
+		*pte = vm_zeroframe | PTE_VALID | PTE_COW;
+		vm_nzeromapped++;
+		return 0;
+	}
+
+	paddr = wait ? page_alloc() : page_alloc_nowait();
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+	result = vm_fill_page(region, vaddr, paddr);
+	if (result) {
+		page_free(paddr);
+		return result;
+	}
+
+	if (im != NULL && image_putpage(im, region->image_seg, vaddr, &paddr)) {
+		*pte = paddr | PTE_VALID | PTE_SHARED;
+		return 0;
+	}
+	page_setowner(paddr, as, vaddr, SWAP_NOSLOT);
+	*pte = paddr | PTE_VALID;
+	return 0;
+}
+
+/*
+ * Fault-around.
+ *
+ * A fault that brings a page in also maps up to a window of the pages
+ * after it, if they are cheap: already resident, or never touched so
+ * they just need zeroing or reading from the executable. The window
+ * lives in the region's (or heap's) fault_history; it doubles, up to
+ * VM_FAULTAROUND_MAX, each time a fault lands right after the last
+ * page mapped, and halves on any other fault. Pages that would need
+ * swapping in, or memory we'd have to page out to get, end it.
+ *
+ * madvise overrides the history. In a MADV_RANDOM region nothing is
+ * mapped ahead. In a MADV_SEQUENTIAL one every fault maps the widest
+ * window, and pages more than VM_DROPBEHIND behind the fault lose
+ * their reference bits, so the clock takes them before anything a
+ * process might still want.
+ *
+ * Prefetched pages go in with PTE_REF set and their TLB entries
+ * loaded, so using them costs nothing. They are also marked
+ * PTE_PREFETCH until they next come through vm_fault: one the clock
+ * evicts still so marked was untouched since its reference bit was
+ * first cleared, which is what we count as unused.
+ */
+
+/* Keep the frame mapped at VADDR resident if VADDR is mlocked. */
+static
+void
+vm_wire_locked(struct addrspace *as, vaddr_t vaddr, pte_t pte)
+{
+	if (as->locked != NULL && as_mlocked(as, vaddr)) {
+		page_wire(pte & PTE_FRAME);
+	}
+}
+
+/* Map the page at VADDR ahead of use. Returns false to stop. */
+static
+bool
+vm_prefetch_page(struct addrspace *as, struct region *region, vaddr_t vaddr)
+{
+	pte_t *pte;
+
+	pte = pt_lookup(as->ptable, vaddr, true);
+	if (pte == NULL) {
+		return false;
+	}
+	if (*pte & PTE_VALID) {
+		*pte |= PTE_REF;
+		vm_tlb_load(vaddr, *pte);
+		return true;
+	}
+	if (*pte != 0) {
+		/* Swapped out: not cheap. */
+		return false;
+	}
+	if (as->rss >= vm_rss_limit()) {
+		/* Not worth evicting our own pages for. */
+		return false;
+	}
+
+	if (vm_page_new(as, region, vaddr, false, false, pte)) {
+		return false;
+	}
+	*pte |= PTE_REF | PTE_PREFETCH;
+	vm_wire_locked(as, vaddr, *pte);
+	vm_tlb_load(vaddr, *pte);
+	vm_nprefetched++;
+	return true;
+}
+
+/* pt_walk callback: age a page a sequential reader has left behind */
+static
+int
+vm_dropbehind_page(vaddr_t vaddr, pte_t *pte, void *data)
+{
+	struct tlb_batch *tb = data;
+
+	if ((*pte & (PTE_VALID | PTE_REF | PTE_SHARED | PTE_COW)) ==
+	    (PTE_VALID | PTE_REF)) {
+		*pte &= ~(PTE_REF | PTE_PREFETCH);
+		vm_tlb_batch_add(tb, vaddr);
+		vm_ndroppedbehind++;
+	}
+	return 0;
+}
+
+/* Drop behind a MADV_SEQUENTIAL fault at VADDR in [BASE, ...). */
+static
+void
+vm_dropbehind(struct addrspace *as, struct fault_history *fh,
+	      vaddr_t base, vaddr_t vaddr)
+{
+	struct tlb_batch tb;
+	vaddr_t start, end;
+
+	if (vaddr < base + VM_DROPBEHIND * PAGE_SIZE) {
+		return;
+	}
+	end = vaddr - VM_DROPBEHIND * PAGE_SIZE;
+	start = fh->fh_behind > base ? fh->fh_behind : base;
+	if (start < end) {
+		vm_tlb_batch_init(&tb, as);
+		pt_walk(as->ptable, start, end, vm_dropbehind_page, &tb);
+		vm_tlb_batch_flush(&tb);
+	}
+	fh->fh_behind = end;
+}
+
+/* VADDR was just brought in; map what follows if the history says so. */
+static
+void
+vm_faultaround(struct addrspace *as, struct region *region, vaddr_t vaddr)
+{
+	struct fault_history *fh;
+	vaddr_t base, end, next;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(as->lock));
+
+	if (region != NULL) {
+		fh = &region->history;
+		base = region->region_base;
+		end = region->region_end;
+	}
+	else {
+		fh = &as->heap_history;
+		base = as->heap_base;
+		end = as->heap_end - 1;
+	}
+
+	if (fh->fh_advice == MADV_RANDOM) {
+		return;
+	}
+	if (fh->fh_advice == MADV_SEQUENTIAL) {
+		fh->fh_window = VM_FAULTAROUND_MAX;
+		vm_dropbehind(as, fh, base, vaddr);
+	}
+	else if (vaddr == fh->fh_next) {
+		fh->fh_window = fh->fh_window == 0 ? 1 : fh->fh_window * 2;
+		if (fh->fh_window > VM_FAULTAROUND_MAX) {
+			fh->fh_window = VM_FAULTAROUND_MAX;
+		}
+	}
+	else {
+		fh->fh_window /= 2;
+	}
+
+	next = vaddr + PAGE_SIZE;
+	for (i = 0; i < fh->fh_window; i++) {
+		if (next > end || !vm_prefetch_page(as, region, next)) {
+			break;
+		}
+		next += PAGE_SIZE;
+	}
+	fh->fh_next = next;
+}
+
+/*
+ * MADV_WILLNEED.
+ *
+ * Requests queue up for a kernel thread, which brings their pages in
+ * one at a time, round robin, the way fault-around would: reading
+ * them from swap or the file as needed, but not paging anything out
+ * to make room, and not past the process's RSS limit. Pages that
+ * would only be zeroed are left for their first fault. The thread
+ * holds willneed_lock while it works on a page, so vm_willneed_cancel
+ * waits for it to finish with an address space about to be destroyed.
+ */
+
+struct willneed {
+	struct addrspace *wn_as;
+	vaddr_t wn_start;		/* next page to bring in */
+	vaddr_t wn_end;			/* page after the last */
+	unsigned wn_rsslimit;		/* the process's, in pages */
+	struct willneed *wn_next;
+};
+
+static struct lock *willneed_lock;
+static struct cv *willneed_cv;
+static struct willneed *willneed_head;
+static struct willneed *willneed_tail;
+static unsigned willneed_count;
+
+void
+vm_willneed(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	struct willneed *wn;
+
+	if (start >= end) {
+		return;
+	}
+	wn = kmalloc(sizeof(struct willneed));
+	if (wn == NULL) {
+		return;
+	}
+	wn->wn_as = as;
+	wn->wn_start = start;
+	wn->wn_end = end;
+	wn->wn_rsslimit = vm_rss_limit();
+	wn->wn_next = NULL;
+
+	lock_acquire(willneed_lock);
+	if (willneed_count >= VM_WILLNEED_MAX) {
+		lock_release(willneed_lock);
+		kfree(wn);
+		return;
+	}
+	if (willneed_tail != NULL) {
+		willneed_tail->wn_next = wn;
+	}
+	else {
+		willneed_head = wn;
+	}
+	willneed_tail = wn;
+	willneed_count++;
+	cv_signal(willneed_cv, willneed_lock);
+	lock_release(willneed_lock);
+}
+
+void
+vm_willneed_cancel(struct addrspace *as)
+{
+	struct willneed **prevp, *wn;
+
+	lock_acquire(willneed_lock);
+	willneed_tail = NULL;
+	prevp = &willneed_head;
+	while ((wn = *prevp) != NULL) {
+		if (wn->wn_as == as) {
+			*prevp = wn->wn_next;
+			willneed_count--;
+			kfree(wn);
+			continue;
+		}
+		willneed_tail = wn;
+		prevp = &wn->wn_next;
+	}
+	lock_release(willneed_lock);
+}
+
+/* Bring in the next page WN asks for. Returns false to give up. */
+static
+bool
+vm_willneed_page(struct willneed *wn)
+{
+	struct addrspace *as = wn->wn_as;
+	struct region *region;
+	vaddr_t vaddr = wn->wn_start;
+	paddr_t paddr;
+	pte_t *pte;
+	bool more = true;
+
+	lock_acquire(as->lock);
+	if (as->ws_suspended || as->rss >= wn->wn_rsslimit) {
+		/* Load control or the limit would only page it out again. */
+		lock_release(as->lock);
+		return false;
+	}
+
+	region = as_find_region(as, vaddr);
+	if (region == NULL &&
+	    (vaddr < as->heap_base || vaddr >= as->heap_end)) {
+		/* Unmapped since; what's left may be too. */
+		lock_release(as->lock);
+		return true;
+	}
+	if (region != NULL && !region->readable && !region->writeable) {
+		lock_release(as->lock);
+		return true;
+	}
+
+	pte = pt_lookup(as->ptable, vaddr, true);
+	if (pte == NULL) {
+		more = false;
+	}
+	else if (*pte & PTE_SWAPPED) {
+		paddr = page_alloc_nowait();
+		if (paddr == 0) {
+			more = false;
+		}
+		else if (swap_pagein(PTE_SLOT(*pte), paddr)) {
+			page_free(paddr);
+			more = false;
+		}
+		else {
+			page_setowner(paddr, as, vaddr, PTE_SLOT(*pte));
+			*pte = paddr | PTE_VALID | PTE_REF | PTE_PREFETCH;
+			vm_wire_locked(as, vaddr, *pte);
+			vm_nwillneed++;
+		}
+	}
+	else if (*pte == 0 && !vm_page_iszero(region, vaddr)) {
+		if (vm_page_new(as, region, vaddr, false, false, pte)) {
+			more = false;
+		}
+		else {
+			*pte |= PTE_REF | PTE_PREFETCH;
+			vm_wire_locked(as, vaddr, *pte);
+			vm_nwillneed++;
+		}
+	}
+
+	lock_release(as->lock);
+	return more;
+}
+
+static
+void
+vm_willneed_thread(void *data1, unsigned long data2)
+{
+	struct willneed *wn;
+	bool more;
+
+	(void)data1;
+	(void)data2;
+
+	lock_acquire(willneed_lock);
+	while (1) {
+		while (willneed_head == NULL) {
+			cv_wait(willneed_cv, willneed_lock);
+		}
+		wn = willneed_head;
+		willneed_head = wn->wn_next;
+		if (willneed_head == NULL) {
+			willneed_tail = NULL;
+		}
+
+		more = vm_willneed_page(wn);
+		wn->wn_start += PAGE_SIZE;
+		if (!more || wn->wn_start >= wn->wn_end) {
+			willneed_count--;
+			kfree(wn);
+		}
+		else {
+			/* To the back of the queue */
+			wn->wn_next = NULL;
+			if (willneed_tail != NULL) {
+				willneed_tail->wn_next = wn;
+			}
+			else {
+				willneed_head = wn;
+			}
+			willneed_tail = wn;
+		}
+
+		/* Let cancellations and new requests in between pages. */
+		lock_release(willneed_lock);
+		thread_yield();
+		lock_acquire(willneed_lock);
+	}
+}
+
+void
+vm_willneed_bootstrap(void)
+{
+	int result;
+
+	willneed_lock = lock_create("willneed");
+	willneed_cv = cv_create("willneed");
+	if (willneed_lock == NULL || willneed_cv == NULL) {
+		panic("vm_willneed_bootstrap: out of memory\n");
+	}
+	result = thread_fork("willneed", NULL, vm_willneed_thread, NULL, 0);
+	if (result) {
+		panic("vm_willneed_bootstrap: thread_fork: %s\n",
+		      strerror(result));
+	}
+}
+
+/*
+ * Handle a TLB fault on a user address.
+ *
+ * Pages are populated on first touch with a zeroed frame; a read of
+ * anonymous memory just maps the shared zero frame copy-on-write, so
+ * a frame is only spent once the page is written. The TLB
+ * only gets the dirty (writable) bit once the page has actually been
+ * written, so PTE_DIRTY tracks modification as well as permission;
+ * a write to a clean page comes back here as VM_FAULT_READONLY.
+ * Frames shared by fork are mapped PTE_COW and copied on the first
+ * write. Program text and data are read from the executable here, a
+ * page at a time, rather than at exec. Pages that were evicted come
+ * back in from swap. A write to a MAP_SHARED page marks it dirty in
+ * its memory object. Heap pages are populated the same way, anywhere
+ * below the break sbrk has set. A process at its RSS limit pages
+ * out some of its own memory before it gets a frame, and one that
+ * load control has suspended waits here until it is let back in.
+ */
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct region *region;
+	bool writeable, populated;
+	paddr_t paddr;
+	pte_t *pte;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+	if (faultaddress >= VMALLOC_BASE) {
+		/* Kernel memory from vmalloc, from any context */
+		return vmalloc_fault(faultaddress);
+	}
+	if (faultaddress >= USERSPACETOP) {
+		return EFAULT;
+	}
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		/* Kernel thread, or a fault early in process startup. */
+		return EFAULT;
+	}
+
+	loadctl_wait(as);
+	lock_acquire(as->lock);
+
+	region = as_find_region(as, faultaddress);
+	if (region != NULL && !region->readable && !region->writeable &&
+	    !as->loading) {
+		/* PROT_NONE */
+		lock_release(as->lock);
+		return EFAULT;
+	}
+	if (region != NULL) {
+		writeable = region->writeable || as->loading;
+	}
+	else if (faultaddress >= as->heap_base &&
+		 faultaddress < as->heap_end) {
+		writeable = true;
+	}
+	else {
+		lock_release(as->lock);
+		return EFAULT;
+	}
+
+	if (faulttype != VM_FAULT_READ && !writeable) {
+		lock_release(as->lock);
+		return EFAULT;
+	}
+
+	pte = pt_lookup(as->ptable, faultaddress, true);
+	if (pte == NULL) {
+		lock_release(as->lock);
+		return ENOMEM;
+	}
+
+	populated = !(*pte & PTE_VALID);
+	if (populated || ((*pte & PTE_COW) && faulttype != VM_FAULT_READ)) {
+		vm_rss_enforce(as);
+	}
+	if (*pte & PTE_PREFETCH) {
+		*pte &= ~PTE_PREFETCH;
+		vm_nprefetchhits++;
+	}
+
+	if (*pte & PTE_SWAPPED) {
+		paddr = page_alloc();
+		if (paddr == 0) {
+			lock_release(as->lock);
+			return ENOMEM;
+		}
+		result = swap_pagein(PTE_SLOT(*pte), paddr);
+		if (result) {
+			page_free(paddr);
+			lock_release(as->lock);
+			return result;
+		}
+		/* The frame keeps the PTE's reference to its swap copy. */
+		page_setowner(paddr, as, faultaddress, PTE_SLOT(*pte));
+		*pte = paddr | PTE_VALID;
+	}
+	else if (!(*pte & PTE_VALID)) {
+		result = vm_page_new(as, region, faultaddress,
+				     faulttype != VM_FAULT_READ, true, pte);
+		if (result) {
+			lock_release(as->lock);
+			return result;
+		}
+	}
+	else if ((*pte & PTE_SHARED) && faulttype != VM_FAULT_READ &&
+		 region->object == NULL) {
+		/* Even while loading, nobody writes shared text. */
+		lock_release(as->lock);
+		return EFAULT;
+	}
+	else if (*pte & PTE_COW) {
+		/*
+		 * Break copy-on-write sharing on a write. If every other
+		 * sharer has already gone away the frame is ours and
+		 * just needs claiming, whatever the access.
+		 */
+		paddr = *pte & PTE_FRAME;
+		if (page_refcount(paddr) == 1) {
+			page_setowner(paddr, as, faultaddress, SWAP_NOSLOT);
+			*pte &= ~PTE_COW;
+		}
+		else if (faulttype != VM_FAULT_READ) {
+			if (page_iszeroframe(paddr)) {
+				/* Nothing to copy; a fresh frame is zeroed. */
+				paddr = page_alloc();
+				vm_nzerowritten++;
+			}
+			else {
+				paddr = page_copy(paddr);
+			}
+			if (paddr == 0) {
+				lock_release(as->lock);
+				return ENOMEM;
+			}
+			page_free(*pte & PTE_FRAME);
+			page_setowner(paddr, as, faultaddress, SWAP_NOSLOT);
+			*pte = paddr | PTE_VALID;
+		}
+	}
+
+	*pte |= PTE_REF;
+	if (faulttype != VM_FAULT_READ) {
+		/* Written again, so the contents matter after all. */
+		*pte = (*pte & ~PTE_LAZYFREE) | PTE_DIRTY;
+		if ((*pte & PTE_SHARED) && region->object != NULL) {
+			memobj_dirty(region->object,
+				     MEMOBJ_INDEX(region, faultaddress));
+		}
+	}
+	vm_wire_locked(as, faultaddress, *pte);
+	vm_tlb_load(faultaddress, *pte);
+
+	if (populated) {
+		vm_faultaround(as, region, faultaddress);
+	}
 
-    return 0;
+	lock_release(as->lock);
+	return 0;
 }
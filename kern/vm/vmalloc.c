@@ -0,0 +1,257 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <vm.h>
+#include <vmalloc.h>
+
+/*
+ * Kernel virtual memory in kseg2. See vmalloc.h.
+ *
+ * vmalloc_pt has an entry for each page of the window: the frame
+ * mapped there and VMPTE_VALID, with VMPTE_LAST on the last page of
+ * each block, or else the state of an address on its way round:
+ *
+ *    0               free
+ *    VMPTE_BUSY      handed out, frames still being allocated
+ *    VMPTE_STALE     freed, but may still be in some cpu's TLB
+ *    VMPTE_FLUSHING  stale, and a flush of every TLB has begun
+ *
+ * A purge marks the stale entries flushing, flushes every TLB and
+ * then frees the entries still flushing. Two purges may overlap;
+ * whichever frees an entry has flushed since it was marked.
+ * vmalloc_splk covers changes between states. Busy and valid entries
+ * belong to whoever allocated them, and vmalloc_fault reads entries
+ * without the lock.
+ */
+
+#define VMPTE_VALID	0x01
+#define VMPTE_LAST	0x02
+#define VMPTE_BUSY	0x04
+#define VMPTE_STALE	0x08
+#define VMPTE_FLUSHING	0x10
+
+static struct spinlock vmalloc_splk = SPINLOCK_INITIALIZER;
+static uint32_t vmalloc_pt[VMALLOC_PAGES];
+static unsigned vmalloc_hint;		/* where to start looking */
+static unsigned vmalloc_nstale;		/* entries stale or flushing */
+
+/* Statistics */
+static unsigned vmalloc_nblocks;	/* blocks allocated */
+static unsigned vmalloc_nmapped;	/* pages mapped now */
+static unsigned vmalloc_nfailed;	/* allocations that failed */
+static unsigned vmalloc_nfaults;	/* TLB misses filled */
+static unsigned vmalloc_npurges;	/* TLB flushes to reclaim addresses */
+
+/* Find NPAGES free entries in a row, or return VMALLOC_PAGES. */
+static
+unsigned
+vmalloc_find(unsigned npages)
+{
+	unsigned i, n, run = 0;
+
+	KASSERT(spinlock_do_i_hold(&vmalloc_splk));
+
+	i = vmalloc_hint;
+	for (n = 0; n < VMALLOC_PAGES + npages; n++, i++) {
+		if (i == VMALLOC_PAGES) {
+			/* Blocks don't wrap around. */
+			i = 0;
+			run = 0;
+		}
+		if (vmalloc_pt[i] != 0) {
+			run = 0;
+		}
+		else if (++run == npages) {
+			return i + 1 - npages;
+		}
+	}
+	return VMALLOC_PAGES;
+}
+
+/* Make the addresses of freed blocks free again. */
+static
+void
+vmalloc_purge(void)
+{
+	unsigned i;
+
+	spinlock_acquire(&vmalloc_splk);
+	for (i = 0; i < VMALLOC_PAGES; i++) {
+		if (vmalloc_pt[i] == VMPTE_STALE) {
+			vmalloc_pt[i] = VMPTE_FLUSHING;
+		}
+	}
+	spinlock_release(&vmalloc_splk);
+
+	vm_tlb_flush_all();
+
+	spinlock_acquire(&vmalloc_splk);
+	for (i = 0; i < VMALLOC_PAGES; i++) {
+		if (vmalloc_pt[i] == VMPTE_FLUSHING) {
+			vmalloc_pt[i] = 0;
+			vmalloc_nstale--;
+		}
+	}
+	vmalloc_npurges++;
+	spinlock_release(&vmalloc_splk);
+}
+
+void *
+vmalloc(unsigned npages)
+{
+	unsigned start, i;
+	bool canpurge;
+	vaddr_t kva;
+
+	if (npages == 0 || npages > VMALLOC_PAGES) {
+		return NULL;
+	}
+
+	/*
+	 * A purge waits for the other cpus, which needs interrupts on.
+	 * Early in boot there is no curthread yet, and nothing to purge.
+	 */
+	canpurge = curthread != NULL && curthread->t_curspl == 0;
+	if (canpurge && vmalloc_nstale >= VMALLOC_PURGE) {
+		vmalloc_purge();
+	}
+
+	spinlock_acquire(&vmalloc_splk);
+	start = vmalloc_find(npages);
+	if (start == VMALLOC_PAGES && canpurge && vmalloc_nstale > 0) {
+		spinlock_release(&vmalloc_splk);
+		vmalloc_purge();
+		spinlock_acquire(&vmalloc_splk);
+		start = vmalloc_find(npages);
+	}
+	if (start == VMALLOC_PAGES) {
+		vmalloc_nfailed++;
+		spinlock_release(&vmalloc_splk);
+		return NULL;
+	}
+	for (i = start; i < start + npages; i++) {
+		vmalloc_pt[i] = VMPTE_BUSY;
+	}
+	vmalloc_hint = (start + npages) % VMALLOC_PAGES;
+	spinlock_release(&vmalloc_splk);
+
+	for (i = 0; i < npages; i++) {
+		kva = alloc_kpages(1);
+		if (kva == 0) {
+			break;
+		}
+		vmalloc_pt[start + i] = KVADDR_TO_PADDR(kva) | VMPTE_VALID;
+	}
+
+	if (i < npages) {
+		/* Nobody has seen the addresses, so they can't be in a TLB. */
+		while (i > 0) {
+			i--;
+			free_kpages(PADDR_TO_KVADDR(vmalloc_pt[start + i] &
+						    PAGE_FRAME));
+		}
+		spinlock_acquire(&vmalloc_splk);
+		for (i = start; i < start + npages; i++) {
+			vmalloc_pt[i] = 0;
+		}
+		vmalloc_nfailed++;
+		spinlock_release(&vmalloc_splk);
+		return NULL;
+	}
+	vmalloc_pt[start + npages - 1] |= VMPTE_LAST;
+
+	spinlock_acquire(&vmalloc_splk);
+	vmalloc_nblocks++;
+	vmalloc_nmapped += npages;
+	spinlock_release(&vmalloc_splk);
+
+	return (void *)(VMALLOC_BASE + start * PAGE_SIZE);
+}
+
+void
+vfree(void *ptr)
+{
+	vaddr_t vaddr = (vaddr_t)ptr;
+	unsigned start, end, i;
+	uint32_t pte;
+
+	KASSERT(vaddr >= VMALLOC_BASE && vaddr % PAGE_SIZE == 0);
+	start = (vaddr - VMALLOC_BASE) / PAGE_SIZE;
+	KASSERT(start < VMALLOC_PAGES);
+	KASSERT(start == 0 || !(vmalloc_pt[start - 1] & VMPTE_VALID) ||
+		(vmalloc_pt[start - 1] & VMPTE_LAST));
+
+	/*
+	 * Other cpus may have translations for the block until the
+	 * next purge, but only a use after free would touch them.
+	 */
+	for (i = start; ; i++) {
+		KASSERT(i < VMALLOC_PAGES);
+		pte = vmalloc_pt[i];
+		KASSERT(pte & VMPTE_VALID);
+		free_kpages(PADDR_TO_KVADDR(pte & PAGE_FRAME));
+		if (pte & VMPTE_LAST) {
+			break;
+		}
+	}
+	end = i + 1;
+
+	spinlock_acquire(&vmalloc_splk);
+	for (i = start; i < end; i++) {
+		vmalloc_pt[i] = VMPTE_STALE;
+	}
+	vmalloc_nstale += end - start;
+	vmalloc_nmapped -= end - start;
+	spinlock_release(&vmalloc_splk);
+}
+
+int
+vmalloc_fault(vaddr_t vaddr)
+{
+	uint32_t pte, entryhi, entrylo;
+	unsigned index;
+	int spl, slot;
+
+	KASSERT(vaddr >= VMALLOC_BASE);
+	index = (vaddr - VMALLOC_BASE) / PAGE_SIZE;
+	if (index >= VMALLOC_PAGES) {
+		return EFAULT;
+	}
+	pte = vmalloc_pt[index];
+	if (!(pte & VMPTE_VALID)) {
+		return EFAULT;
+	}
+
+	entrylo = (pte & PAGE_FRAME) | TLBLO_VALID | TLBLO_DIRTY |
+		TLBLO_GLOBAL;
+
+	spl = splhigh();
+	/* Writing entryhi sets the current ASID too, so keep it. */
+	entryhi = (vaddr & TLBHI_VPAGE) | (curcpu->c_asid << TLBHI_PIDSHIFT);
+	slot = tlb_probe(entryhi, 0);
+	if (slot >= 0) {
+		tlb_write(entryhi, entrylo, slot);
+	}
+	else {
+		tlb_random(entryhi, entrylo);
+	}
+	vmalloc_nfaults++;
+	splx(spl);
+	return 0;
+}
+
+void
+vmalloc_printstats(void)
+{
+	kprintf("vmalloc: %u blocks allocated, %u pages mapped, "
+		"%u failures\n", vmalloc_nblocks, vmalloc_nmapped,
+		vmalloc_nfailed);
+	kprintf("vmalloc: %u TLB misses, %u pages stale, %u purges\n",
+		vmalloc_nfaults, vmalloc_nstale, vmalloc_npurges);
+}
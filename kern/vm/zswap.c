@@ -0,0 +1,476 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vm.h>
+#include <zswap.h>
+
+/*
+ * Compressed swap cache. See zswap.h.
+ *
+ * zswap_lock covers everything here, including the compressor's hash
+ * table and output buffer, which are static because a kernel stack
+ * is only one page.
+ */
+
+/*
+ * A slab page cut into chunks of one size class. The header sits at
+ * the start of the page itself, so adding a slab never calls kmalloc
+ * (which could recurse into page-out). Fewer than 64 chunks fit in
+ * what's left, so the free chunks are a 64-bit mask.
+ */
+struct zslab {
+	unsigned zs_class;		/* chunk size is (class+1)*ZSWAP_CHUNK */
+	unsigned zs_nfree;		/* free chunks */
+	uint64_t zs_freemask;		/* bit per free chunk */
+	struct zslab *zs_next;		/* next slab of this class */
+};
+
+/* Where a slot's compressed copy lives; zse_slab NULL if nowhere. */
+struct zswap_entry {
+	struct zslab *zse_slab;
+	uint16_t zse_chunk;
+	uint16_t zse_len;
+};
+
+static struct lock *zswap_lock;
+static struct zswap_entry *zswap_entries;
+static unsigned zswap_nslots;
+static struct zslab *zswap_slabs[ZSWAP_NCLASSES];
+static unsigned zswap_npages;		/* slab pages in use */
+static unsigned zswap_maxpages;		/* cap on zswap_npages */
+
+/* Statistics */
+static unsigned zswap_nstored;		/* pages in the store now */
+static unsigned zswap_nbytes;		/* their compressed size */
+static unsigned zswap_nstores;
+static unsigned zswap_nrejects;		/* incompressible or full */
+static unsigned zswap_nhits;
+static unsigned zswap_nmisses;
+
+////////////////////////////////////////////////////////////
+// compressor
+
+#define LZ_MINMATCH	4
+#define LZ_HASHBITS	10
+
+static uint16_t lz_table[1 << LZ_HASHBITS];	/* position + 1, 0 if none */
+static uint8_t lz_buf[ZSWAP_MAXSIZE];
+
+static
+unsigned
+lz_hash(const uint8_t *p)
+{
+	uint32_t v;
+
+	v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+	return (v * 2654435761U) >> (32 - LZ_HASHBITS);
+}
+
+/* Write a length's extension bytes (after the 15 in the nibble). */
+static
+int
+lz_putlen(uint8_t *dst, size_t *op, size_t dstmax, size_t len)
+{
+	while (len >= 255) {
+		if (*op >= dstmax) {
+			return -1;
+		}
+		dst[(*op)++] = 255;
+		len -= 255;
+	}
+	if (*op >= dstmax) {
+		return -1;
+	}
+	dst[(*op)++] = len;
+	return 0;
+}
+
+/*
+ * Emit one sequence: LITLEN literals, then a match of MATCHLEN bytes
+ * OFFSET back. MATCHLEN is 0 only for the final sequence, which has
+ * no match part at all.
+ */
+static
+int
+lz_emit(uint8_t *dst, size_t *op, size_t dstmax,
+	const uint8_t *lit, size_t litlen, unsigned offset, size_t matchlen)
+{
+	uint8_t token;
+
+	token = (litlen < 15 ? litlen : 15) << 4;
+	if (matchlen > 0) {
+		token |= matchlen - LZ_MINMATCH < 15 ?
+			matchlen - LZ_MINMATCH : 15;
+	}
+	if (*op >= dstmax) {
+		return -1;
+	}
+	dst[(*op)++] = token;
+	if (litlen >= 15 && lz_putlen(dst, op, dstmax, litlen - 15)) {
+		return -1;
+	}
+	if (*op + litlen > dstmax) {
+		return -1;
+	}
+	memcpy(dst + *op, lit, litlen);
+	*op += litlen;
+
+	if (matchlen == 0) {
+		return 0;
+	}
+	if (*op + 2 > dstmax) {
+		return -1;
+	}
+	dst[(*op)++] = offset & 0xff;
+	dst[(*op)++] = offset >> 8;
+	if (matchlen - LZ_MINMATCH >= 15 &&
+	    lz_putlen(dst, op, dstmax, matchlen - LZ_MINMATCH - 15)) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Compress the page at SRC into DST. Returns the compressed length,
+ * or 0 if it doesn't fit in DSTMAX bytes.
+ */
+static
+size_t
+lz_compress(const uint8_t *src, uint8_t *dst, size_t dstmax)
+{
+	size_t ip, anchor, op, ref, len;
+	unsigned h;
+
+	bzero(lz_table, sizeof(lz_table));
+	ip = anchor = op = 0;
+	while (ip + LZ_MINMATCH <= PAGE_SIZE) {
+		h = lz_hash(src + ip);
+		ref = lz_table[h];
+		lz_table[h] = ip + 1;
+		if (ref == 0 || src[ref - 1] != src[ip] ||
+		    src[ref] != src[ip + 1] || src[ref + 1] != src[ip + 2] ||
+		    src[ref + 2] != src[ip + 3]) {
+			ip++;
+			continue;
+		}
+		ref--;
+		len = LZ_MINMATCH;
+		while (ip + len < PAGE_SIZE && src[ref + len] == src[ip + len]) {
+			len++;
+		}
+		if (lz_emit(dst, &op, dstmax, src + anchor, ip - anchor,
+			    ip - ref, len)) {
+			return 0;
+		}
+		ip += len;
+		anchor = ip;
+	}
+	if (lz_emit(dst, &op, dstmax, src + anchor, PAGE_SIZE - anchor, 0, 0)) {
+		return 0;
+	}
+	return op;
+}
+
+/* Read a length's extension bytes. */
+static
+int
+lz_getlen(const uint8_t *src, size_t *ip, size_t srclen, size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= srclen) {
+			return -1;
+		}
+		b = src[(*ip)++];
+		*len += b;
+	} while (b == 255);
+	return 0;
+}
+
+/* Decompress SRCLEN bytes at SRC into the page at DST. */
+static
+int
+lz_decompress(const uint8_t *src, size_t srclen, uint8_t *dst)
+{
+	size_t ip, op, litlen, matchlen, offset;
+	uint8_t token;
+
+	ip = op = 0;
+	while (ip < srclen) {
+		token = src[ip++];
+
+		litlen = token >> 4;
+		if (litlen == 15 && lz_getlen(src, &ip, srclen, &litlen)) {
+			return EINVAL;
+		}
+		if (ip + litlen > srclen || op + litlen > PAGE_SIZE) {
+			return EINVAL;
+		}
+		memcpy(dst + op, src + ip, litlen);
+		ip += litlen;
+		op += litlen;
+
+		if (ip == srclen) {
+			/* Final sequence: no match part */
+			break;
+		}
+		if (ip + 2 > srclen) {
+			return EINVAL;
+		}
+		offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		matchlen = token & 15;
+		if (matchlen == 15 && lz_getlen(src, &ip, srclen, &matchlen)) {
+			return EINVAL;
+		}
+		matchlen += LZ_MINMATCH;
+		if (offset == 0 || offset > op || op + matchlen > PAGE_SIZE) {
+			return EINVAL;
+		}
+		/* May overlap itself; copy forward a byte at a time. */
+		while (matchlen-- > 0) {
+			dst[op] = dst[op - offset];
+			op++;
+		}
+	}
+	return op == PAGE_SIZE ? 0 : EINVAL;
+}
+
+////////////////////////////////////////////////////////////
+// slab
+
+static
+unsigned
+zslab_chunks(unsigned class)
+{
+	return (PAGE_SIZE - sizeof(struct zslab)) / ((class + 1) * ZSWAP_CHUNK);
+}
+
+static
+void *
+zslab_addr(struct zslab *zs, unsigned chunk)
+{
+	return (char *)(zs + 1) + chunk * (zs->zs_class + 1) * ZSWAP_CHUNK;
+}
+
+/* Find a free chunk of CLASS, adding a slab page if need be. */
+static
+int
+zslab_alloc(unsigned class, struct zslab **ret, unsigned *chunk)
+{
+	struct zslab *zs;
+	unsigned i, n;
+
+	for (zs = zswap_slabs[class]; zs != NULL; zs = zs->zs_next) {
+		if (zs->zs_nfree > 0) {
+			break;
+		}
+	}
+
+	if (zs == NULL) {
+		if (zswap_npages >= zswap_maxpages) {
+			return ENOSPC;
+		}
+		/* Don't page things out to make room for paging out. */
+		zs = (struct zslab *)alloc_kpages_nowait(1);
+		if (zs == NULL) {
+			return ENOMEM;
+		}
+		n = zslab_chunks(class);
+		KASSERT(n > 0 && n < 64);
+		zs->zs_class = class;
+		zs->zs_nfree = n;
+		zs->zs_freemask = ((uint64_t)1 << n) - 1;
+		zs->zs_next = zswap_slabs[class];
+		zswap_slabs[class] = zs;
+		zswap_npages++;
+	}
+
+	for (i = 0; !(zs->zs_freemask & ((uint64_t)1 << i)); i++) {
+		KASSERT(i < 64);
+	}
+	zs->zs_freemask &= ~((uint64_t)1 << i);
+	zs->zs_nfree--;
+	*ret = zs;
+	*chunk = i;
+	return 0;
+}
+
+/* Free a chunk, and its slab page once the page is empty. */
+static
+void
+zslab_free(struct zslab *zs, unsigned chunk)
+{
+	struct zslab **p;
+
+	KASSERT(!(zs->zs_freemask & ((uint64_t)1 << chunk)));
+	zs->zs_freemask |= (uint64_t)1 << chunk;
+	zs->zs_nfree++;
+	if (zs->zs_nfree < zslab_chunks(zs->zs_class)) {
+		return;
+	}
+
+	for (p = &zswap_slabs[zs->zs_class]; *p != zs; p = &(*p)->zs_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = zs->zs_next;
+	free_kpages((vaddr_t)zs);
+	zswap_npages--;
+}
+
+////////////////////////////////////////////////////////////
+// store
+
+void
+zswap_bootstrap(unsigned nslots)
+{
+	unsigned i;
+
+	zswap_lock = lock_create("zswap");
+	zswap_entries = kmalloc(nslots * sizeof(zswap_entries[0]));
+	if (zswap_lock == NULL || zswap_entries == NULL) {
+		panic("zswap_bootstrap: out of memory\n");
+	}
+	for (i = 0; i < nslots; i++) {
+		zswap_entries[i].zse_slab = NULL;
+	}
+	zswap_nslots = nslots;
+	zswap_maxpages = coremap_npages() * ZSWAP_CAPPCT / 100;
+}
+
+/* Drop SLOT's entry; zswap_lock held. */
+static
+void
+zswap_drop(unsigned slot)
+{
+	struct zswap_entry *zse;
+
+	zse = &zswap_entries[slot];
+	if (zse->zse_slab == NULL) {
+		return;
+	}
+	zswap_nstored--;
+	zswap_nbytes -= zse->zse_len;
+	zslab_free(zse->zse_slab, zse->zse_chunk);
+	zse->zse_slab = NULL;
+}
+
+int
+zswap_store(unsigned slot, paddr_t paddr)
+{
+	struct zswap_entry *zse;
+	struct zslab *zs;
+	unsigned chunk;
+	size_t len;
+	int result;
+
+	KASSERT(slot < zswap_nslots);
+	zse = &zswap_entries[slot];
+
+	lock_acquire(zswap_lock);
+	zswap_drop(slot);
+
+	len = lz_compress((const uint8_t *)PADDR_TO_KVADDR(paddr),
+			  lz_buf, ZSWAP_MAXSIZE);
+	if (len == 0) {
+		zswap_nrejects++;
+		lock_release(zswap_lock);
+		return ENOSPC;
+	}
+
+	result = zslab_alloc((len - 1) / ZSWAP_CHUNK, &zs, &chunk);
+	if (result) {
+		zswap_nrejects++;
+		lock_release(zswap_lock);
+		return ENOSPC;
+	}
+	memcpy(zslab_addr(zs, chunk), lz_buf, len);
+	zse->zse_slab = zs;
+	zse->zse_chunk = chunk;
+	zse->zse_len = len;
+
+	zswap_nstored++;
+	zswap_nbytes += len;
+	zswap_nstores++;
+	lock_release(zswap_lock);
+	return 0;
+}
+
+int
+zswap_load(unsigned slot, paddr_t paddr)
+{
+	struct zswap_entry *zse;
+	int result;
+
+	KASSERT(slot < zswap_nslots);
+	zse = &zswap_entries[slot];
+
+	lock_acquire(zswap_lock);
+	if (zse->zse_slab == NULL) {
+		zswap_nmisses++;
+		lock_release(zswap_lock);
+		return ENOENT;
+	}
+	result = lz_decompress(zslab_addr(zse->zse_slab, zse->zse_chunk),
+			       zse->zse_len, (uint8_t *)PADDR_TO_KVADDR(paddr));
+	if (result) {
+		panic("zswap: slot %u is corrupt\n", slot);
+	}
+	zswap_nhits++;
+	lock_release(zswap_lock);
+	return 0;
+}
+
+void
+zswap_invalidate(unsigned slot)
+{
+	KASSERT(slot < zswap_nslots);
+
+	lock_acquire(zswap_lock);
+	zswap_drop(slot);
+	lock_release(zswap_lock);
+}
+
+void
+zswap_setcap(unsigned maxpages)
+{
+	if (zswap_lock == NULL) {
+		return;
+	}
+
+	/* Only limits growth; what's stored stays until it's freed. */
+	lock_acquire(zswap_lock);
+	zswap_maxpages = maxpages;
+	lock_release(zswap_lock);
+}
+
+void
+zswap_printstats(void)
+{
+	unsigned lookups;
+
+	if (zswap_lock == NULL) {
+		kprintf("zswap: disabled\n");
+		return;
+	}
+
+	lock_acquire(zswap_lock);
+	kprintf("zswap: %u pages stored in %u/%u pages of memory\n",
+		zswap_nstored, zswap_npages, zswap_maxpages);
+	if (zswap_nbytes > 0) {
+		/* Two decimal places, in integers */
+		kprintf("zswap: compression ratio %u.%02u "
+			"(%u bytes for %u bytes)\n",
+			zswap_nstored * PAGE_SIZE / zswap_nbytes,
+			(zswap_nstored * PAGE_SIZE % zswap_nbytes) * 100 /
+			zswap_nbytes,
+			zswap_nbytes, zswap_nstored * PAGE_SIZE);
+	}
+	lookups = zswap_nhits + zswap_nmisses;
+	kprintf("zswap: %u stores, %u rejected; %u/%u page-ins hit (%u%%)\n",
+		zswap_nstores, zswap_nrejects, zswap_nhits, lookups,
+		lookups > 0 ? zswap_nhits * 100 / lookups : 0);
+	lock_release(zswap_lock);
+}
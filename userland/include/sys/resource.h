@@ -0,0 +1,21 @@
+#ifndef _SYS_RESOURCE_H_
+#define _SYS_RESOURCE_H_
+
+/*
+ * Get struct rlimit and the RLIMIT_* codes from the kernel.
+ */
+#include <sys/types.h>
+#include <kern/time.h>
+#include <kern/resource.h>
+
+/*
+ * Only RLIMIT_MEMLOCK and RLIMIT_RSS are enforced: mlock fails with
+ * ENOMEM rather than lock more than the soft RLIMIT_MEMLOCK, and a
+ * process at its soft RLIMIT_RSS pages out its own memory to make
+ * room for more. The rest are always unlimited.
+ */
+int getrlimit(int resource, struct rlimit *rlp);
+int setrlimit(int resource, const struct rlimit *rlp);
+
+
+#endif /* _SYS_RESOURCE_H_ */
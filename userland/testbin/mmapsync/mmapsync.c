@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mmapsync - check that stores to a shared file mapping reach the
+ * file each time it is synced, not just the first time.
+ *
+ * After a sync has written a page back, the page is still mapped
+ * writable, so a second store need not fault. The second sync must
+ * write it anyway.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define FILENAME	"mmapsync.dat"
+#define PAGESIZE	4096
+
+static char buf[PAGESIZE];
+
+/* Check that the file holds WHAT at the start of its first page. */
+static
+void
+check(int fd, const char *what, int pass)
+{
+	size_t len = strlen(what);
+	ssize_t r;
+
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		err(1, "%s: lseek", FILENAME);
+	}
+	r = read(fd, buf, len);
+	if (r < 0) {
+		err(1, "%s: read", FILENAME);
+	}
+	if ((size_t)r != len || memcmp(buf, what, len) != 0) {
+		errx(1, "Pass %d: file does not have the stored data", pass);
+	}
+	printf("Pass %d: ok\n", pass);
+}
+
+int
+main(void)
+{
+	char *p;
+	ssize_t r;
+	int fd;
+
+	fd = open(FILENAME, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", FILENAME);
+	}
+
+	/* Mapping a file never makes it longer, so fill in a page. */
+	memset(buf, 0, sizeof(buf));
+	r = write(fd, buf, sizeof(buf));
+	if (r < 0) {
+		err(1, "%s: write", FILENAME);
+	}
+	else if (r != sizeof(buf)) {
+		errx(1, "%s: short write", FILENAME);
+	}
+
+	p = mmap(NULL, PAGESIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+
+	strcpy(p, "first store");
+	if (sync() < 0) {
+		err(1, "sync");
+	}
+	check(fd, "first store", 1);
+
+	strcpy(p, "second store");
+	if (sync() < 0) {
+		err(1, "sync");
+	}
+	check(fd, "second store", 2);
+
+	if (munmap(p, PAGESIZE) < 0) {
+		err(1, "munmap");
+	}
+	close(fd);
+	remove(FILENAME);
+
+	printf("Passed mmapsync.\n");
+	return 0;
+}